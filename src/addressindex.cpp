@@ -0,0 +1,282 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+
+#include "chain.h"
+#include "crypto/sha256.h"
+#include "main.h"
+#include "undo.h"
+#include "util.h"
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+static const char DB_ADDRESS_HISTORY = 'h';
+static const char DB_ADDRESS_UNSPENT = 'u';
+static const char DB_BEST_BLOCK = 'B';
+
+CAddressIndex *paddressindex = NULL;
+
+uint256 GetScriptHash(const CScript& scriptPubKey)
+{
+    uint256 hash;
+    CSHA256().Write(scriptPubKey.data(), scriptPubKey.size()).Finalize(hash.begin());
+    return hash;
+}
+
+CAddressIndexDB::CAddressIndexDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "addressindex", nCacheSize, fMemory, fWipe) {
+}
+
+bool CAddressIndexDB::ReadBestBlock(CBlockLocator& locator) {
+    return Read(DB_BEST_BLOCK, locator);
+}
+
+bool CAddressIndexDB::ReadUnspent(const CAddressUnspentKey& key, CAddressUnspentValue& value) {
+    return Read(make_pair(DB_ADDRESS_UNSPENT, key), value);
+}
+
+bool CAddressIndexDB::ReadHistoryEntry(const CAddressHistoryKey& key, CAddressHistoryValue& value) {
+    return Read(make_pair(DB_ADDRESS_HISTORY, key), value);
+}
+
+void CAddressIndexDB::WriteBestBlock(CLevelDBBatch& batch, const CBlockLocator& locator) {
+    batch.Write(DB_BEST_BLOCK, locator);
+}
+
+void CAddressIndexDB::WriteHistoryEntry(CLevelDBBatch& batch, const CAddressHistoryKey& key, const CAddressHistoryValue& value) {
+    batch.Write(make_pair(DB_ADDRESS_HISTORY, key), value);
+}
+
+void CAddressIndexDB::EraseHistoryEntry(CLevelDBBatch& batch, const CAddressHistoryKey& key) {
+    batch.Erase(make_pair(DB_ADDRESS_HISTORY, key));
+}
+
+void CAddressIndexDB::WriteUnspent(CLevelDBBatch& batch, const CAddressUnspentKey& key, const CAddressUnspentValue& value) {
+    batch.Write(make_pair(DB_ADDRESS_UNSPENT, key), value);
+}
+
+void CAddressIndexDB::EraseUnspent(CLevelDBBatch& batch, const CAddressUnspentKey& key) {
+    batch.Erase(make_pair(DB_ADDRESS_UNSPENT, key));
+}
+
+bool CAddressIndexDB::ReadHistory(const uint256& hashScript, int nFromHeight, size_t nSkip, size_t nCount, vector<CAddressHistoryEntry>& vEntries) {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    // The smallest key of the script at nFromHeight
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(DB_ADDRESS_HISTORY, CAddressHistoryKey(hashScript, nFromHeight, uint256(), 0, false));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid() && vEntries.size() < nCount) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressHistoryKey key;
+            ssKey >> chType;
+            if (chType != DB_ADDRESS_HISTORY)
+                break;
+            ssKey >> key;
+            if (key.hashScript != hashScript)
+                break;
+            if (nSkip > 0) {
+                nSkip--;
+            } else {
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CAddressHistoryValue value;
+                ssValue >> value;
+                vEntries.push_back(make_pair(key, value));
+            }
+            pcursor->Next();
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CAddressIndexDB::ReadUnspentOutputs(const uint256& hashScript, size_t nSkip, size_t nCount, vector<CAddressUnspentEntry>& vEntries) {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(DB_ADDRESS_UNSPENT, hashScript);
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid() && vEntries.size() < nCount) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey key;
+            ssKey >> chType;
+            if (chType != DB_ADDRESS_UNSPENT)
+                break;
+            ssKey >> key;
+            if (key.hashScript != hashScript)
+                break;
+            if (nSkip > 0) {
+                nSkip--;
+            } else {
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CAddressUnspentValue value;
+                ssValue >> value;
+                vEntries.push_back(make_pair(key, value));
+            }
+            pcursor->Next();
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+CAddressIndex::CAddressIndex(size_t nCacheSize, bool fWipe) : db(nCacheSize, false, fWipe), nPending(0)
+{
+}
+
+bool CAddressIndex::GetUnspent(const CAddressUnspentKey& key, CAddressUnspentValue& value)
+{
+    map<CAddressUnspentKey, CAddressUnspentValue>::const_iterator it = mapPendingUnspent.find(key);
+    if (it != mapPendingUnspent.end()) {
+        value = it->second;
+        return !value.IsNull();
+    }
+    return db.ReadUnspent(key, value);
+}
+
+void CAddressIndex::WriteUnspent(const CAddressUnspentKey& key, const CAddressUnspentValue& value)
+{
+    CAddressIndexDB::WriteUnspent(batch, key, value);
+    mapPendingUnspent[key] = value;
+    nPending++;
+}
+
+void CAddressIndex::EraseUnspent(const CAddressUnspentKey& key)
+{
+    CAddressIndexDB::EraseUnspent(batch, key);
+    mapPendingUnspent[key].SetNull();
+    nPending++;
+}
+
+bool CAddressIndex::ReadBestBlock(CBlockLocator& locator)
+{
+    return db.ReadBestBlock(locator);
+}
+
+bool CAddressIndex::ReadBlock(CBlock& block, const CBlockIndex* pindex)
+{
+    return ReadBlockFromDisk(block, pindex);
+}
+
+bool CAddressIndex::ReadBlockUndo(CBlockUndo& blockundo, const CBlock& block, const CBlockIndex* pindex)
+{
+    CDiskBlockPos pos = pindex->GetUndoPos();
+    if (pos.IsNull())
+        return error("%s: no undo data available for block %s", __func__, pindex->GetBlockHash().ToString());
+    if (!UndoReadFromDisk(blockundo, pos, pindex->pprev->GetBlockHash()))
+        return false;
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+        return error("%s: undo data does not match block %s", __func__, pindex->GetBlockHash().ToString());
+    return true;
+}
+
+bool CAddressIndex::AppendBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    CBlockUndo blockundo;
+    if (!ReadBlockUndo(blockundo, block, pindex))
+        return false;
+
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        const uint256& txid = tx.GetHash();
+
+        if (i > 0) {
+            const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+            if (txundo.vprevout.size() != tx.vin.size())
+                return error("%s: undo data does not match transaction %s", __func__, txid.ToString());
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const CTxOut& prev = txundo.vprevout[j].txout;
+                CAddressUnspentKey key(GetScriptHash(prev.scriptPubKey), tx.vin[j].prevout);
+                CAddressUnspentValue value;
+                GetUnspent(key, value);
+                EraseUnspent(key);
+                CAddressIndexDB::WriteHistoryEntry(batch, CAddressHistoryKey(key.hashScript, pindex->nHeight, txid, j, true),
+                                                   CAddressHistoryValue(-prev.nValue, tx.vin[j].prevout, value.nHeight));
+                nPending++;
+            }
+        }
+
+        for (unsigned int j = 0; j < tx.vout.size(); j++) {
+            const CTxOut& out = tx.vout[j];
+            if (out.scriptPubKey.IsUnspendable())
+                continue;
+            CAddressUnspentKey key(GetScriptHash(out.scriptPubKey), COutPoint(txid, j));
+            WriteUnspent(key, CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight));
+            CAddressIndexDB::WriteHistoryEntry(batch, CAddressHistoryKey(key.hashScript, pindex->nHeight, txid, j, false),
+                                               CAddressHistoryValue(out.nValue, COutPoint(), -1));
+            nPending++;
+        }
+    }
+    return true;
+}
+
+bool CAddressIndex::RewindBlock(const CBlockIndex* pindex)
+{
+    CBlock block;
+    CBlockUndo blockundo;
+    if (!ReadBlock(block, pindex) || !ReadBlockUndo(blockundo, block, pindex))
+        return false;
+
+    // Undo AppendBlock in reverse, so that outputs created and spent
+    // within the block end up erased.
+    for (unsigned int i = block.vtx.size(); i-- > 0; ) {
+        const CTransaction& tx = block.vtx[i];
+        const uint256& txid = tx.GetHash();
+
+        for (unsigned int j = 0; j < tx.vout.size(); j++) {
+            const CTxOut& out = tx.vout[j];
+            if (out.scriptPubKey.IsUnspendable())
+                continue;
+            CAddressUnspentKey key(GetScriptHash(out.scriptPubKey), COutPoint(txid, j));
+            EraseUnspent(key);
+            CAddressIndexDB::EraseHistoryEntry(batch, CAddressHistoryKey(key.hashScript, pindex->nHeight, txid, j, false));
+            nPending++;
+        }
+
+        if (i > 0) {
+            const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+            for (unsigned int j = 0; j < tx.vin.size() && j < txundo.vprevout.size(); j++) {
+                const CTxOut& prev = txundo.vprevout[j].txout;
+                CAddressHistoryKey historyKey(GetScriptHash(prev.scriptPubKey), pindex->nHeight, txid, j, true);
+                // The spend recorded the height of the output, which the
+                // restored unspent entry needs again.
+                CAddressHistoryValue spend;
+                if (!db.ReadHistoryEntry(historyKey, spend))
+                    return error("%s: missing spend of %s in the address index", __func__, tx.vin[j].prevout.ToString());
+                WriteUnspent(CAddressUnspentKey(historyKey.hashScript, tx.vin[j].prevout), CAddressUnspentValue(prev.nValue, prev.scriptPubKey, spend.nPrevHeight));
+                CAddressIndexDB::EraseHistoryEntry(batch, historyKey);
+                nPending++;
+            }
+        }
+    }
+    return true;
+}
+
+bool CAddressIndex::Commit(const CBlockLocator& locator)
+{
+    CAddressIndexDB::WriteBestBlock(batch, locator);
+    if (!db.WriteBatch(batch))
+        return false;
+    batch = CLevelDBBatch();
+    mapPendingUnspent.clear();
+    nPending = 0;
+    return true;
+}
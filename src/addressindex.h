@@ -0,0 +1,196 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ADDRESSINDEX_H
+#define BITCOIN_ADDRESSINDEX_H
+
+#include "amount.h"
+#include "baseindex.h"
+#include "crypto/common.h"
+#include "leveldbwrapper.h"
+#include "primitives/transaction.h"
+#include "script/script.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <map>
+#include <vector>
+
+class CBlockUndo;
+
+/** Default for -addressindex */
+static const bool DEFAULT_ADDRESSINDEX = false;
+
+/** The key scripts are indexed by: the SHA256 of the scriptPubKey, shown byte-reversed like other hashes. */
+uint256 GetScriptHash(const CScript& scriptPubKey);
+
+/**
+ * Something that happened to a script: one of its outputs was created
+ * (funding) or spent. Keys sort by script, then height, so a script's
+ * history can be read in order starting at any height.
+ */
+struct CAddressHistoryKey
+{
+    uint256 hashScript;
+    int nHeight;
+    uint256 txid;
+    unsigned int nIndex; //! output index when funding, input index when spending
+    bool fSpending;
+
+    CAddressHistoryKey() : nHeight(0), nIndex(0), fSpending(false) {}
+    CAddressHistoryKey(const uint256& hashScriptIn, int nHeightIn, const uint256& txidIn, unsigned int nIndexIn, bool fSpendingIn) :
+        hashScript(hashScriptIn), nHeight(nHeightIn), txid(txidIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hashScript);
+        // Big endian, so that entries sort by height
+        unsigned char heightBE[4];
+        if (!ser_action.ForRead())
+            WriteBE32(heightBE, nHeight);
+        READWRITE(FLATDATA(heightBE));
+        if (ser_action.ForRead())
+            nHeight = ReadBE32(heightBE);
+        READWRITE(txid);
+        READWRITE(nIndex);
+        READWRITE(fSpending);
+    }
+};
+
+struct CAddressHistoryValue
+{
+    CAmount nValue;      //! negative when spending
+    COutPoint prevout;   //! the output spent, when spending
+    int nPrevHeight;     //! height of the block that created prevout
+
+    CAddressHistoryValue() : nValue(0), nPrevHeight(-1) {}
+    CAddressHistoryValue(CAmount nValueIn, const COutPoint& prevoutIn, int nPrevHeightIn) :
+        nValue(nValueIn), prevout(prevoutIn), nPrevHeight(nPrevHeightIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nValue);
+        READWRITE(prevout);
+        READWRITE(nPrevHeight);
+    }
+};
+
+/** An unspent output of a script. */
+struct CAddressUnspentKey
+{
+    uint256 hashScript;
+    COutPoint outpoint;
+
+    CAddressUnspentKey() {}
+    CAddressUnspentKey(const uint256& hashScriptIn, const COutPoint& outpointIn) :
+        hashScript(hashScriptIn), outpoint(outpointIn) {}
+
+    friend bool operator<(const CAddressUnspentKey& a, const CAddressUnspentKey& b)
+    {
+        return a.hashScript < b.hashScript || (a.hashScript == b.hashScript && a.outpoint < b.outpoint);
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hashScript);
+        READWRITE(outpoint);
+    }
+};
+
+struct CAddressUnspentValue
+{
+    CAmount nValue;
+    CScript scriptPubKey;
+    int nHeight;
+
+    CAddressUnspentValue() { SetNull(); }
+    CAddressUnspentValue(CAmount nValueIn, const CScript& scriptPubKeyIn, int nHeightIn) :
+        nValue(nValueIn), scriptPubKey(scriptPubKeyIn), nHeight(nHeightIn) {}
+
+    void SetNull() { nValue = -1; scriptPubKey.clear(); nHeight = -1; }
+    bool IsNull() const { return nValue == -1; }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nValue);
+        READWRITE(scriptPubKey);
+        READWRITE(nHeight);
+    }
+};
+
+typedef std::pair<CAddressHistoryKey, CAddressHistoryValue> CAddressHistoryEntry;
+typedef std::pair<CAddressUnspentKey, CAddressUnspentValue> CAddressUnspentEntry;
+
+/** Access to the address index database (addressindex/) */
+class CAddressIndexDB : public CLevelDBWrapper
+{
+public:
+    CAddressIndexDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    bool ReadBestBlock(CBlockLocator& locator);
+    bool ReadUnspent(const CAddressUnspentKey& key, CAddressUnspentValue& value);
+    bool ReadHistoryEntry(const CAddressHistoryKey& key, CAddressHistoryValue& value);
+
+    /** Read up to nCount history entries of a script from nFromHeight on, after skipping nSkip of them. */
+    bool ReadHistory(const uint256& hashScript, int nFromHeight, size_t nSkip, size_t nCount, std::vector<CAddressHistoryEntry>& vEntries);
+    /** Read up to nCount unspent outputs of a script, after skipping nSkip of them. */
+    bool ReadUnspentOutputs(const uint256& hashScript, size_t nSkip, size_t nCount, std::vector<CAddressUnspentEntry>& vEntries);
+
+    static void WriteBestBlock(CLevelDBBatch& batch, const CBlockLocator& locator);
+    static void WriteHistoryEntry(CLevelDBBatch& batch, const CAddressHistoryKey& key, const CAddressHistoryValue& value);
+    static void EraseHistoryEntry(CLevelDBBatch& batch, const CAddressHistoryKey& key);
+    static void WriteUnspent(CLevelDBBatch& batch, const CAddressUnspentKey& key, const CAddressUnspentValue& value);
+    static void EraseUnspent(CLevelDBBatch& batch, const CAddressUnspentKey& key);
+};
+
+/**
+ * Maintains the address index (-addressindex): for every script, the
+ * outputs that paid to it and the inputs that spent them, and its current
+ * unspent outputs. Spends are resolved through the block undo data.
+ */
+class CAddressIndex : public CBaseIndex
+{
+private:
+    CAddressIndexDB db;
+    CLevelDBBatch batch;
+    size_t nPending;
+    /** Unspent entries changed by the pending batch, which the database cannot see yet; null when erased. */
+    std::map<CAddressUnspentKey, CAddressUnspentValue> mapPendingUnspent;
+
+    bool GetUnspent(const CAddressUnspentKey& key, CAddressUnspentValue& value);
+    void WriteUnspent(const CAddressUnspentKey& key, const CAddressUnspentValue& value);
+    void EraseUnspent(const CAddressUnspentKey& key);
+
+protected:
+    /** Read a block of the active chain from disk; tests supply their own. */
+    virtual bool ReadBlock(CBlock& block, const CBlockIndex* pindex);
+    /** Read the undo data of a block, which holds the outputs its inputs spent. */
+    virtual bool ReadBlockUndo(CBlockUndo& blockundo, const CBlock& block, const CBlockIndex* pindex);
+
+    const char* GetName() const { return "addressindex"; }
+    bool ReadBestBlock(CBlockLocator& locator);
+    bool AppendBlock(const CBlock& block, const CBlockIndex* pindex);
+    bool RewindBlock(const CBlockIndex* pindex);
+    size_t GetPendingCount() const { return nPending; }
+    bool Commit(const CBlockLocator& locator);
+
+public:
+    CAddressIndex(size_t nCacheSize, bool fWipe = false);
+
+    /** Queries see the index as of the last commit. */
+    CAddressIndexDB& GetDB() { return db; }
+};
+
+/** The address index, if -addressindex is enabled. */
+extern CAddressIndex *paddressindex;
+
+#endif // BITCOIN_ADDRESSINDEX_H
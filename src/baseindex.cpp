@@ -0,0 +1,152 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "baseindex.h"
+
+#include "chain.h"
+#include "main.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/thread.hpp>
+
+using namespace std;
+
+/** Number of index entries to collect before writing them out. */
+static const size_t INDEX_BATCH_SIZE = 50000;
+/** Seconds between progress messages while catching up. */
+static const int64_t INDEX_LOG_INTERVAL = 30;
+
+CBaseIndex::CBaseIndex() : fTipChanged(false), fSynced(false), nBestHeight(-1)
+{
+}
+
+void CBaseIndex::UpdatedBlockTip(const CBlockIndex *pindex)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fTipChanged = true;
+    condTipChanged.notify_one();
+}
+
+bool CBaseIndex::IsSynced()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return fSynced;
+}
+
+int CBaseIndex::GetBestHeight()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nBestHeight;
+}
+
+void CBaseIndex::CommitBest(const CBlockIndex* pindex)
+{
+    CBlockLocator locator;
+    {
+        LOCK(cs_main);
+        locator = chainActive.GetLocator(pindex);
+    }
+    if (!Commit(locator))
+        throw runtime_error("failed to write index");
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nBestHeight = pindex->nHeight;
+}
+
+void CBaseIndex::ThreadSync()
+{
+    RenameThread((string("dogecoin-") + GetName()).c_str());
+
+    // Find where we left off. A block we know that is no longer in the
+    // active chain is rewound below; otherwise use the best match we have.
+    const CBlockIndex* pindex = NULL;
+    CBlockLocator locator;
+    if (ReadBestBlock(locator) && !locator.vHave.empty()) {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(locator.vHave[0]);
+        pindex = mi != mapBlockIndex.end() ? mi->second : FindForkInGlobalIndex(chainActive, locator);
+    }
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nBestHeight = pindex ? pindex->nHeight : -1;
+    }
+    LogPrintf("%s: starting after height %d\n", GetName(), pindex ? pindex->nHeight : -1);
+
+    const CBlockIndex* pindexCommitted = pindex;
+    int64_t nLastLog = GetTime();
+    try {
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            const CBlockIndex* pindexNext = NULL;
+            bool fRewind = false;
+            {
+                LOCK(cs_main);
+                if (pindex && !chainActive.Contains(pindex))
+                    fRewind = true;
+                else
+                    pindexNext = pindex ? chainActive.Next(pindex) : chainActive.Genesis();
+            }
+
+            if (fRewind) {
+                // Rewinding reads back what was written, so start from a
+                // committed state, and commit each block as it is undone.
+                if (pindex != pindexCommitted)
+                    CommitBest(pindex);
+                if (!RewindBlock(pindex))
+                    throw runtime_error("failed to rewind block " + pindex->GetBlockHash().ToString());
+                pindex = pindex->pprev;
+                CommitBest(pindex);
+                pindexCommitted = pindex;
+                continue;
+            }
+
+            if (!pindexNext) {
+                if (pindex != pindexCommitted) {
+                    CommitBest(pindex);
+                    pindexCommitted = pindex;
+                }
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (!fSynced && pindex) {
+                    LogPrintf("%s: synchronized at height %d\n", GetName(), pindex->nHeight);
+                    fSynced = true;
+                }
+                while (!fTipChanged)
+                    condTipChanged.wait(lock);
+                fTipChanged = false;
+                continue;
+            }
+
+            // The genesis block's transactions are not spendable and never were indexed.
+            if (pindexNext->nHeight > 0) {
+                CBlock block;
+                if (!ReadBlockFromDisk(block, pindexNext))
+                    throw runtime_error("failed to read block " + pindexNext->GetBlockHash().ToString());
+                if (!AppendBlock(block, pindexNext))
+                    throw runtime_error("failed to index block " + pindexNext->GetBlockHash().ToString());
+            }
+            pindex = pindexNext;
+
+            if (GetPendingCount() >= INDEX_BATCH_SIZE) {
+                CommitBest(pindex);
+                pindexCommitted = pindex;
+            }
+            if (GetTime() - nLastLog >= INDEX_LOG_INTERVAL) {
+                LogPrintf("%s: indexed up to height %d\n", GetName(), pindex->nHeight);
+                nLastLog = GetTime();
+            }
+        }
+    } catch (const boost::thread_interrupted&) {
+        // Keep what we have so far so that we resume from here.
+        try {
+            if (pindex != pindexCommitted)
+                CommitBest(pindex);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", GetName(), e.what());
+        }
+        throw;
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s, stopped indexing\n", GetName(), e.what());
+    }
+}
@@ -0,0 +1,67 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BASEINDEX_H
+#define BITCOIN_BASEINDEX_H
+
+#include "validationinterface.h"
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CBlock;
+class CBlockIndex;
+struct CBlockLocator;
+
+/**
+ * Base for the optional indexes that are built on their own thread, reading
+ * blocks back from the block files instead of indexing them as they are
+ * connected. An index records the block it is complete up to, so it can be
+ * switched on for an existing node and resumes where it left off after a
+ * restart. Once caught up it follows the tip, woken by UpdatedBlockTip;
+ * blocks that left the active chain are rewound before the new branch is
+ * appended.
+ */
+class CBaseIndex : public CValidationInterface
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condTipChanged;
+    bool fTipChanged;
+    bool fSynced;
+    int nBestHeight;
+
+    /** Write the pending entries and make pindex the block the index is complete up to. */
+    void CommitBest(const CBlockIndex* pindex);
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindex);
+
+    /** Name used in log messages and for the thread. */
+    virtual const char* GetName() const = 0;
+    /** Read the locator of the block the index is complete up to; false if the index is new. */
+    virtual bool ReadBestBlock(CBlockLocator& locator) = 0;
+    /** Add the entries for a block connected on top of the index. Not called for the genesis block. */
+    virtual bool AppendBlock(const CBlock& block, const CBlockIndex* pindex) = 0;
+    /** Remove the entries for the block the index is complete up to. Nothing is pending when this is called. */
+    virtual bool RewindBlock(const CBlockIndex* pindex) = 0;
+    /** Number of entries added since the last commit. */
+    virtual size_t GetPendingCount() const = 0;
+    /** Write the pending entries together with the new best block, atomically. */
+    virtual bool Commit(const CBlockLocator& locator) = 0;
+
+public:
+    CBaseIndex();
+
+    /** Index blocks until interrupted; run this in its own thread. */
+    void ThreadSync();
+
+    /** Whether the index has caught up with the active chain (at least once). */
+    bool IsSynced();
+
+    /** Height of the last block whose entries are written out, or -1. */
+    int GetBestHeight();
+};
+
+#endif // BITCOIN_BASEINDEX_H
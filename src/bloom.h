@@ -107,6 +107,9 @@ public:
  *
  * contains(item) will always return true if item was one of the last N things
  * insert()'ed ... but may also return true for items that were not inserted.
+ *
+ * Its memory use is fixed at construction, and insert() and contains() cost
+ * a constant number of hash computations regardless of how full it is.
  */
 class CRollingBloomFilter
 {
@@ -114,14 +117,22 @@ public:
     CRollingBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
 
     void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
     bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
 
     void clear();
 
 private:
-    unsigned int nBloomSize;
-    unsigned int nInsertions;
-    CBloomFilter b1, b2;
+    void insert(const unsigned char* pKey, size_t nKeyLen);
+    bool contains(const unsigned char* pKey, size_t nKeyLen) const;
+
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    std::vector<uint64_t> data;
+    unsigned int nTweak;
+    int nHashFuncs;
 };
 
 
@@ -25,6 +25,16 @@ struct SeedSpec6 {
     uint16_t port;
 };
 
+/**
+ * A UTXO set snapshot that -loadtxoutset accepts: the block it was taken at, the hash_serialized
+ * gettxoutsetinfo reports at that block, and the number of transactions up to and including it.
+ */
+struct CTxOutSetSnapshotData {
+    uint256 hashBlock;
+    uint256 hashSerialized;
+    uint64_t nChainTx;
+};
+
 
 /**
  * CChainParams defines various tweakable parameters of a given instance of the
@@ -89,6 +99,8 @@ public:
     const std::vector<unsigned char>& Base58Prefix(Base58Type type) const { return base58Prefixes[type]; }
     const std::vector<SeedSpec6>& FixedSeeds() const { return vFixedSeeds; }
     const Checkpoints::CCheckpointData& Checkpoints() const { return checkpointData; }
+    /** UTXO set snapshots known to be good; none have been published for any network yet. */
+    const std::vector<CTxOutSetSnapshotData>& TxOutSetSnapshots() const { return vTxOutSetSnapshots; }
 
 protected:
     CChainParams() {}
@@ -113,6 +125,7 @@ protected:
     bool fMineBlocksOnDemand;
     bool fTestnetToBeDeprecatedFieldRPC;
     Checkpoints::CCheckpointData checkpointData;
+    std::vector<CTxOutSetSnapshotData> vTxOutSetSnapshots;
 };
 
 /**
@@ -5,10 +5,16 @@
 #ifndef BITCOIN_CHECKQUEUE_H
 #define BITCOIN_CHECKQUEUE_H
 
+#include "utiltime.h"
+
 #include <algorithm>
+#include <deque>
 #include <vector>
 
+#include <stdint.h>
+
 #include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -16,20 +22,56 @@
 template <typename T>
 class CCheckQueueControl;
 
+/** Utilization counters for one worker slot of a CCheckQueue. */
+struct CCheckQueueWorkerStats
+{
+    //! Number of checks executed.
+    uint64_t nChecks;
+
+    //! Number of batches executed.
+    uint64_t nBatches;
+
+    //! Number of checks taken from other workers' deques.
+    uint64_t nStolen;
+
+    //! Number of times the worker went to sleep for lack of work.
+    uint64_t nSleeps;
+
+    //! Time spent executing checks, in microseconds.
+    int64_t nBusyMicros;
+
+    CCheckQueueWorkerStats() : nChecks(0), nBatches(0), nStolen(0), nSleeps(0), nBusyMicros(0) {}
+};
+
 /** 
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
-  * operator(), returning a bool.
+  * operator(), returning a bool, and a swap() method.
   *
   * One thread (the master) is assumed to push batches of verifications
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker owns a deque (slot 0 belongs to the master). Added work is
+  * spread over the deques; a worker pops batches from the back of its own
+  * deque and, once that runs dry, steals half of another worker's deque from
+  * the front. The shared mutex is only taken once per batch to account for
+  * completed work, never to move individual checks around.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
+    /** A per-worker deque of pending checks, with its own lock. */
+    struct CWorkerSlot
+    {
+        boost::mutex mutex;
+        std::deque<T> deque;
+        //! Protected by CCheckQueue::mutex, not by the slot mutex.
+        CCheckQueueWorkerStats stats;
+    };
+
     //! Mutex to protect the inner state
     boost::mutex mutex;
 
@@ -39,23 +81,28 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! Per-worker deques. Allocated once, so slots never move.
+    boost::scoped_array<CWorkerSlot> slots;
+
+    //! The number of allocated slots (maximum number of workers + 1 for the master).
+    const unsigned int nMaxSlots;
+
+    //! The number of slots currently in use (registered workers + the master).
+    unsigned int nSlotsUsed;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The number of worker threads that ever registered.
+    unsigned int nWorkers;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! Incremented every time Add() has finished publishing work.
+    uint64_t nAdded;
 
     //! The temporary evaluation result.
     bool fAllOk;
 
     /**
      * Number of verifications that haven't completed yet.
-     * This includes elements that are no longer queued, but still in the
-     * worker's own batches.
+     * This includes elements that are still in the deques, and elements
+     * in a worker's own batch.
      */
     unsigned int nTodo;
 
@@ -65,32 +112,96 @@ private:
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    /**
+     * Move a batch of checks into vChecks: from the back of our own deque if
+     * possible, otherwise from the front of another worker's deque.
+     * Returns the number of checks taken.
+     */
+    unsigned int Take(unsigned int nSlot, unsigned int nSlots, std::vector<T>& vChecks, uint64_t& nStolen)
+    {
+        {
+            CWorkerSlot& own = slots[nSlot];
+            boost::unique_lock<boost::mutex> lock(own.mutex);
+            if (!own.deque.empty()) {
+                // Leave half behind for others to steal, so all workers finish approximately simultaneously.
+                unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)own.deque.size() / 2));
+                vChecks.resize(nNow);
+                for (unsigned int i = 0; i < nNow; i++) {
+                    vChecks[i].swap(own.deque.back());
+                    own.deque.pop_back();
+                }
+                return nNow;
+            }
+        }
+        for (unsigned int i = 1; i < nSlots; i++) {
+            CWorkerSlot& victim = slots[(nSlot + i) % nSlots];
+            boost::unique_lock<boost::mutex> lock(victim.mutex);
+            if (victim.deque.empty())
+                continue;
+            unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)(victim.deque.size() + 1) / 2));
+            vChecks.resize(nNow);
+            for (unsigned int j = 0; j < nNow; j++) {
+                vChecks[j].swap(victim.deque.front());
+                victim.deque.pop_front();
+            }
+            nStolen += nNow;
+            return nNow;
+        }
+        return 0;
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(unsigned int nSlot, bool fMaster = false)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
+        unsigned int nSlots;
+        uint64_t nGeneration;
+        bool fOk;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nSlots = nSlotsUsed;
+            nGeneration = nAdded;
+            fOk = fAllOk;
+        }
         do {
-            {
+            uint64_t nStolen = 0;
+            unsigned int nNow = Take(nSlot, nSlots, vChecks, nStolen);
+            int64_t nBusy = 0;
+            if (nNow && !fOk) {
+                // fOk may be left over from a previous, failed round; the
+                // checks we now hold belong to the current one.
                 boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
+                fOk = fAllOk;
+            }
+            if (nNow) {
+                // execute work
+                int64_t nStart = GetTimeMicros();
+                BOOST_FOREACH (T& check, vChecks)
+                    if (fOk)
+                        fOk = check();
+                vChecks.clear();
+                nBusy = GetTimeMicros() - nStart;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            CCheckQueueWorkerStats& stats = slots[nSlot].stats;
+            if (nNow) {
+                fAllOk &= fOk;
+                nTodo -= nNow;
+                stats.nChecks += nNow;
+                stats.nBatches++;
+                stats.nStolen += nStolen;
+                stats.nBusyMicros += nBusy;
+                if (nTodo == 0 && !fMaster)
+                    // We processed the last element; inform the master it can exit and return the result
+                    condMaster.notify_one();
+            } else {
+                // Nothing left to take anywhere. Only sleep if no work was
+                // published since we last looked, or we could miss a wakeup.
+                while (nAdded == nGeneration) {
                     if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
                         bool fRet = fAllOk;
                         // reset the status for new work later
                         if (fMaster)
@@ -98,62 +209,72 @@ private:
                         // return the current status
                         return fRet;
                     }
-                    nIdle++;
+                    stats.nSleeps++;
                     cond.wait(lock); // wait
-                    nIdle--;
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                nGeneration = nAdded;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
+            nSlots = nSlotsUsed;
+            // Check whether we need to do work at all
+            fOk = fAllOk;
         } while (true);
     }
 
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue, with room for up to nMaxWorkersIn worker threads
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkersIn = 64) :
+        slots(new CWorkerSlot[nMaxWorkersIn + 1]), nMaxSlots(nMaxWorkersIn + 1), nSlotsUsed(1), nWorkers(0), nAdded(0),
+        fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        unsigned int nSlot;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // Workers beyond the number of slots share deques; that is safe, just slower.
+            nSlot = 1 + nWorkers % (nMaxSlots - 1);
+            nWorkers++;
+            nSlotsUsed = std::min(nMaxSlots, nWorkers + 1);
+        }
+        Loop(nSlot);
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        return Loop(0, true);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+        unsigned int nSlots;
+        {
+            // Account for the work before it becomes visible, so nTodo can never underflow.
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nTodo += vChecks.size();
+            nSlots = nSlotsUsed;
+        }
+        // Deal contiguous chunks out to all deques, starting with the workers' ones.
+        unsigned int nPerSlot = (vChecks.size() + nSlots - 1) / nSlots;
+        unsigned int nPos = 0;
+        for (unsigned int i = 0; i < nSlots && nPos < vChecks.size(); i++) {
+            CWorkerSlot& slot = slots[(i + 1) % nSlots];
+            unsigned int nEnd = std::min((unsigned int)vChecks.size(), nPos + nPerSlot);
+            boost::unique_lock<boost::mutex> lock(slot.mutex);
+            for (; nPos < nEnd; nPos++) {
+                slot.deque.push_back(T());
+                vChecks[nPos].swap(slot.deque.back());
+            }
         }
-        nTodo += vChecks.size();
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nAdded++;
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -164,7 +285,16 @@ public:
     bool IsIdle()
     {
         boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && fAllOk == true);
+    }
+
+    //! Copy out the utilization counters of every slot in use; slot 0 is the master.
+    void GetStats(std::vector<CCheckQueueWorkerStats>& vStats)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        vStats.clear();
+        for (unsigned int i = 0; i < nSlotsUsed; i++)
+            vStats.push_back(slots[i].stats);
     }
 
 };
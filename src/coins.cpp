@@ -4,6 +4,7 @@
 
 #include "coins.h"
 
+#include "hash.h"
 #include "memusage.h"
 #include "random.h"
 
@@ -264,3 +265,43 @@ CCoinsModifier::~CCoinsModifier()
         cache.cachedCoinsUsage += memusage::DynamicUsage(it->second.coins);
     }
 }
+
+static uint256 TxOutSetElement(const COutPoint& outpoint, const CTxOut& txout)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << outpoint << txout;
+    return ss.GetHash();
+}
+
+void CTxOutSetCommitment::AddOutput(const COutPoint& outpoint, const CTxOut& txout)
+{
+    uint256 element = TxOutSetElement(outpoint, txout);
+    muhash.Insert(element.begin(), element.size());
+    nTransactionOutputs++;
+    nTotalAmount += txout.nValue;
+}
+
+void CTxOutSetCommitment::RemoveOutput(const COutPoint& outpoint, const CTxOut& txout)
+{
+    uint256 element = TxOutSetElement(outpoint, txout);
+    muhash.Remove(element.begin(), element.size());
+    nTransactionOutputs--;
+    nTotalAmount -= txout.nValue;
+}
+
+void CTxOutSetCommitment::AddCoins(const uint256& txid, const CCoins& coins)
+{
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        if (!coins.vout[i].IsNull())
+            AddOutput(COutPoint(txid, i), coins.vout[i]);
+    }
+    if (!coins.IsPruned())
+        nTransactions++;
+}
+
+uint256 CTxOutSetCommitment::GetHash()
+{
+    unsigned char hash[32];
+    muhash.Finalize(hash);
+    return uint256(std::vector<unsigned char>(hash, hash + sizeof(hash)));
+}
@@ -7,6 +7,7 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "crypto/muhash.h"
 #include "memusage.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -258,7 +259,7 @@ public:
     size_t DynamicMemoryUsage() const {
         size_t ret = memusage::DynamicUsage(vout);
         BOOST_FOREACH(const CTxOut &out, vout) {
-            const std::vector<unsigned char> *script = &out.scriptPubKey;
+            const CScriptBase *script = &out.scriptPubKey;
             ret += memusage::DynamicUsage(*script);
         }
         return ret;
@@ -311,6 +312,48 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
 };
 
+/**
+ * Running commitment to the unspent outputs as of hashBlock: a MuHash of
+ * every (outpoint, txout) pair plus the totals gettxoutsetinfo reports.
+ * Since the hash does not depend on order it can be updated block by block
+ * instead of walking the whole chain state.
+ */
+class CTxOutSetCommitment
+{
+public:
+    uint256 hashBlock;
+    MuHash3072 muhash;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    arith_uint256 nTotalAmount;
+
+    CTxOutSetCommitment() : nTransactions(0), nTransactionOutputs(0), nTotalAmount(0) {}
+
+    void AddOutput(const COutPoint& outpoint, const CTxOut& txout);
+    void RemoveOutput(const COutPoint& outpoint, const CTxOut& txout);
+    //! Add all unspent outputs of coins, as the chain state stores them
+    void AddCoins(const uint256& txid, const CCoins& coins);
+    uint256 GetHash();
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hashBlock);
+        unsigned char state[MuHash3072::SERIALIZED_SIZE];
+        if (!ser_action.ForRead())
+            muhash.Serialize(state);
+        READWRITE(FLATDATA(state));
+        if (ser_action.ForRead())
+            muhash.Deserialize(state);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        uint256 amount = ArithToUint256(nTotalAmount);
+        READWRITE(amount);
+        nTotalAmount = UintToArith256(amount);
+    }
+};
+
 
 /** Abstract view on the open txout dataset. */
 class CCoinsView
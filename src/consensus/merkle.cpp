@@ -0,0 +1,120 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "consensus/merkle.h"
+
+#include "crypto/sha256.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+/*     WARNING! If you're reading this because you're learning about crypto
+       and/or designing a new system that will use merkle trees, keep in mind
+       that the following merkle tree algorithm has a serious flaw related to
+       duplicate txids, resulting in a vulnerability (CVE-2012-2459).
+
+       The reason is that if the number of hashes in the list at a given time
+       is odd, the last one is duplicated before computing the next level (which
+       is unusual in Merkle trees). This results in certain sequences of
+       transactions leading to the same merkle root. For example, these two
+       trees:
+
+                    A               A
+                  /  \            /   \
+                B     C         B       C
+               / \    |        / \     / \
+              D   E   F       D   E   F   F
+             / \ / \ / \     / \ / \ / \ / \
+             1 2 3 4 5 6     1 2 3 4 5 6 5 6
+
+       for transaction lists [1,2,3,4,5,6] and [1,2,3,4,5,6,5,6] (where 5 and
+       6 are repeated) result in the same root hash A (because the hash of both
+       of (F) and (F,F) is C).
+
+       The vulnerability results from being able to send a block with such a
+       transaction list, with the same merkle root, and the same block hash as
+       the original without duplication, resulting in failed validation. If the
+       receiving node proceeds to mark that block as permanently invalid
+       however, it will fail to accept further unmodified (and thus potentially
+       valid) versions of the same block. We defend against this by detecting
+       the case where we would hash two identical hashes together, and treating
+       that identically to the block having an invalid merkle root. Assuming no
+       double-SHA256 collisions, this will detect all known ways of changing the
+       transactions without affecting the merkle root. Identical hashes paired
+       anywhere else in the tree imply duplicate transactions, which make the
+       block invalid regardless.
+*/
+
+namespace {
+
+/** Replace the level in hashes by the level above it, without reallocating. */
+void HashLevel(std::vector<uint256>& hashes)
+{
+    const size_t nPairs = hashes.size() / 2;
+    if (hashes.size() & 1) {
+        // The odd last hash is paired with itself.
+        unsigned char pair[64];
+        memcpy(pair, hashes.back().begin(), 32);
+        memcpy(pair + 32, hashes.back().begin(), 32);
+        SHA256D64(hashes[0].begin(), hashes[0].begin(), nPairs);
+        SHA256D64(hashes[nPairs].begin(), pair, 1);
+        hashes.resize(nPairs + 1);
+    } else {
+        SHA256D64(hashes[0].begin(), hashes[0].begin(), nPairs);
+        hashes.resize(nPairs);
+    }
+}
+
+std::vector<uint256> BlockLeaves(const CBlock& block)
+{
+    std::vector<uint256> leaves;
+    leaves.reserve(block.vtx.size());
+    for (std::vector<CTransaction>::const_iterator it(block.vtx.begin()); it != block.vtx.end(); ++it)
+        leaves.push_back(it->GetHash());
+    return leaves;
+}
+
+} // anon namespace
+
+uint256 ComputeMerkleRoot(std::vector<uint256> hashes, bool* mutated)
+{
+    bool mutation = false;
+    while (hashes.size() > 1) {
+        if (mutated) {
+            for (size_t pos = 0; pos + 1 < hashes.size(); pos += 2) {
+                if (hashes[pos] == hashes[pos + 1])
+                    mutation = true;
+            }
+        }
+        HashLevel(hashes);
+    }
+    if (mutated) {
+        *mutated = mutation;
+    }
+    if (hashes.empty())
+        return uint256();
+    return hashes[0];
+}
+
+std::vector<uint256> ComputeMerkleBranch(std::vector<uint256> hashes, uint32_t nIndex)
+{
+    std::vector<uint256> vMerkleBranch;
+    while (hashes.size() > 1) {
+        vMerkleBranch.push_back(hashes[std::min<size_t>(nIndex ^ 1, hashes.size() - 1)]);
+        nIndex >>= 1;
+        HashLevel(hashes);
+    }
+    return vMerkleBranch;
+}
+
+uint256 BlockMerkleRoot(const CBlock& block, bool* mutated)
+{
+    return ComputeMerkleRoot(BlockLeaves(block), mutated);
+}
+
+std::vector<uint256> BlockMerkleBranch(const CBlock& block, uint32_t nIndex)
+{
+    return ComputeMerkleBranch(BlockLeaves(block), nIndex);
+}
@@ -0,0 +1,40 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CONSENSUS_MERKLE_H
+#define BITCOIN_CONSENSUS_MERKLE_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "primitives/block.h"
+#include "uint256.h"
+
+/**
+ * Compute the merkle root of a list of leaf hashes. Each level is hashed in
+ * place with the batched double-SHA256 kernel, so no tree is kept.
+ * If non-NULL, *mutated is set to whether two identical hashes were paired
+ * (CVE-2012-2459, see merkle.cpp).
+ */
+uint256 ComputeMerkleRoot(std::vector<uint256> hashes, bool* mutated = NULL);
+
+/**
+ * Compute the merkle branch for the leaf at position nIndex.
+ */
+std::vector<uint256> ComputeMerkleBranch(std::vector<uint256> hashes, uint32_t nIndex);
+
+/**
+ * Compute the merkle root of a block's transactions.
+ * If non-NULL, *mutated is set to whether mutation was detected in the merkle
+ * tree (a duplication of transactions in the block leading to an identical
+ * merkle root).
+ */
+uint256 BlockMerkleRoot(const CBlock& block, bool* mutated = NULL);
+
+/**
+ * Compute the merkle branch for the transaction at position nIndex in a block.
+ */
+std::vector<uint256> BlockMerkleBranch(const CBlock& block, uint32_t nIndex);
+
+#endif // BITCOIN_CONSENSUS_MERKLE_H
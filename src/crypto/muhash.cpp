@@ -0,0 +1,168 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+
+namespace
+{
+/** The modulus is 2^3072 - MAX_PRIME_DIFF. */
+const uint32_t MAX_PRIME_DIFF = 1103717;
+
+/** Hash an arbitrary byte string to a number modulo the prime. */
+Num3072 ToNum3072(const unsigned char* data, size_t len)
+{
+    unsigned char seed[32];
+    CSHA256().Write(data, len).Finalize(seed);
+    unsigned char tmp[Num3072::BYTE_SIZE];
+    for (unsigned char i = 0; i < Num3072::BYTE_SIZE / CSHA512::OUTPUT_SIZE; i++) {
+        CSHA512().Write(seed, sizeof(seed)).Write(&i, 1).Finalize(tmp + i * CSHA512::OUTPUT_SIZE);
+    }
+    return Num3072(tmp);
+}
+}
+
+Num3072::Num3072(const unsigned char* data)
+{
+    for (int i = 0; i < LIMBS; i++) {
+        limbs[i] = ReadLE32(data + 4 * i);
+    }
+    if (IsOverflow())
+        FullReduce();
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; i++) {
+        limbs[i] = 0;
+    }
+}
+
+void Num3072::ToBytes(unsigned char* out) const
+{
+    for (int i = 0; i < LIMBS; i++) {
+        WriteLE32(out + 4 * i, limbs[i]);
+    }
+}
+
+bool Num3072::IsOverflow() const
+{
+    // The modulus has all limbs set except the lowest one.
+    if (limbs[0] <= 0xffffffffU - MAX_PRIME_DIFF)
+        return false;
+    for (int i = 1; i < LIMBS; i++) {
+        if (limbs[i] != 0xffffffffU)
+            return false;
+    }
+    return true;
+}
+
+void Num3072::FullReduce()
+{
+    // Subtracting the modulus is adding MAX_PRIME_DIFF and dropping bit 3072.
+    uint64_t c = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS; i++) {
+        c += limbs[i];
+        limbs[i] = (uint32_t)c;
+        c >>= 32;
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    // Schoolbook multiplication into a double-width product. a may alias
+    // this, as limbs is only written once the product is complete.
+    uint32_t t[2 * LIMBS];
+    for (int i = 0; i < LIMBS; i++) {
+        t[i] = 0;
+    }
+    for (int i = 0; i < LIMBS; i++) {
+        uint64_t c = 0;
+        for (int j = 0; j < LIMBS; j++) {
+            c += (uint64_t)limbs[i] * a.limbs[j] + t[i + j];
+            t[i + j] = (uint32_t)c;
+            c >>= 32;
+        }
+        t[i + LIMBS] = (uint32_t)c;
+    }
+
+    // Since 2^3072 = MAX_PRIME_DIFF (mod p), fold the upper half onto the lower.
+    uint64_t c = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        c += (uint64_t)t[LIMBS + i] * MAX_PRIME_DIFF + t[i];
+        limbs[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    // What is left above bit 3072 is small; folding it in can carry out of
+    // the top limb at most once, and then only leaves a small number behind.
+    c *= MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS && c; i++) {
+        c += limbs[i];
+        limbs[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    if (c) {
+        c = MAX_PRIME_DIFF;
+        for (int i = 0; i < LIMBS && c; i++) {
+            c += limbs[i];
+            limbs[i] = (uint32_t)c;
+            c >>= 32;
+        }
+    }
+    if (IsOverflow())
+        FullReduce();
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // a^(p-2) = a^-1 (mod p). Every limb of p-2 but the lowest is all ones.
+    Num3072 result;
+    for (int i = LIMBS - 1; i >= 0; i--) {
+        uint32_t e = (i == 0) ? 0xffffffffU - MAX_PRIME_DIFF - 1 : 0xffffffffU;
+        for (int bit = 31; bit >= 0; bit--) {
+            result.Multiply(result);
+            if ((e >> bit) & 1)
+                result.Multiply(*this);
+        }
+    }
+    return result;
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+void MuHash3072::Finalize(unsigned char (&out)[32])
+{
+    numerator.Multiply(denominator.GetInverse());
+    denominator.SetToOne();
+
+    unsigned char data[Num3072::BYTE_SIZE];
+    numerator.ToBytes(data);
+    CSHA256().Write(data, sizeof(data)).Finalize(out);
+}
+
+void MuHash3072::Serialize(unsigned char (&out)[SERIALIZED_SIZE]) const
+{
+    numerator.ToBytes(out);
+    denominator.ToBytes(out + Num3072::BYTE_SIZE);
+}
+
+void MuHash3072::Deserialize(const unsigned char (&in)[SERIALIZED_SIZE])
+{
+    numerator = Num3072(in);
+    denominator = Num3072(in + Num3072::BYTE_SIZE);
+}
@@ -0,0 +1,69 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** An integer modulo the prime 2^3072 - 1103717, in little-endian 32-bit limbs. */
+class Num3072
+{
+public:
+    static const int LIMBS = 96;
+    static const size_t BYTE_SIZE = LIMBS * 4;
+
+    uint32_t limbs[LIMBS];
+
+    Num3072() { SetToOne(); }
+    /** Reads BYTE_SIZE little-endian bytes. */
+    explicit Num3072(const unsigned char* data);
+
+    void SetToOne();
+    void Multiply(const Num3072& a);
+    /** Computes the inverse by Fermat's little theorem; slow, use sparingly. */
+    Num3072 GetInverse() const;
+    /** Writes BYTE_SIZE little-endian bytes. */
+    void ToBytes(unsigned char* out) const;
+
+private:
+    bool IsOverflow() const;
+    void FullReduce();
+};
+
+/**
+ * A hash of a multiset of byte strings that can be updated one element at a
+ * time, in any order. Each element is hashed to a number modulo a 3072-bit
+ * prime; the set hash is the product of its elements. Removal multiplies a
+ * separate denominator so that the expensive inversion only happens once,
+ * in Finalize().
+ *
+ * The state can be saved with Serialize() and restored with Deserialize();
+ * two states for the same multiset finalize to the same hash even if their
+ * serializations differ.
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+public:
+    static const size_t SERIALIZED_SIZE = 2 * Num3072::BYTE_SIZE;
+
+    /** The hash of the empty set. */
+    MuHash3072() {}
+
+    MuHash3072& Insert(const unsigned char* data, size_t len);
+    MuHash3072& Remove(const unsigned char* data, size_t len);
+
+    /** Writes the 32-byte hash of the set; this also normalizes the state. */
+    void Finalize(unsigned char (&out)[32]);
+
+    void Serialize(unsigned char (&out)[SERIALIZED_SIZE]) const;
+    void Deserialize(const unsigned char (&in)[SERIALIZED_SIZE]);
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
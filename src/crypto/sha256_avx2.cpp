@@ -0,0 +1,136 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// This is a translation to AVX2 intrinsics of the generic SHA-256 transform,
+// hashing eight independent 64-byte inputs in the eight lanes of a register.
+
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
+#ifdef ENABLE_AVX2
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "crypto/common.h"
+
+namespace sha256d64_avx2 {
+namespace {
+
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+const uint32_t IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+__m256i inline Set(uint32_t x) { return _mm256_set1_epi32(x); }
+__m256i inline Add(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
+__m256i inline Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+__m256i inline Or(__m256i x, __m256i y) { return _mm256_or_si256(x, y); }
+__m256i inline And(__m256i x, __m256i y) { return _mm256_and_si256(x, y); }
+__m256i inline ShR(__m256i x, int n) { return _mm256_srli_epi32(x, n); }
+__m256i inline ShL(__m256i x, int n) { return _mm256_slli_epi32(x, n); }
+__m256i inline RotR(__m256i x, int n) { return Or(ShR(x, n), ShL(x, 32 - n)); }
+
+__m256i inline Ch(__m256i x, __m256i y, __m256i z) { return Xor(z, And(x, Xor(y, z))); }
+__m256i inline Maj(__m256i x, __m256i y, __m256i z) { return Or(And(x, y), And(z, Or(x, y))); }
+__m256i inline Sigma0(__m256i x) { return Xor(Xor(RotR(x, 2), RotR(x, 13)), RotR(x, 22)); }
+__m256i inline Sigma1(__m256i x) { return Xor(Xor(RotR(x, 6), RotR(x, 11)), RotR(x, 25)); }
+__m256i inline sigma0(__m256i x) { return Xor(Xor(RotR(x, 7), RotR(x, 18)), ShR(x, 3)); }
+__m256i inline sigma1(__m256i x) { return Xor(Xor(RotR(x, 17), RotR(x, 19)), ShR(x, 10)); }
+
+/** Run the 64 rounds over the message words w (which get expanded in place), and add the result into s. */
+void inline Transform(__m256i* s, __m256i* w)
+{
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        if (i >= 16)
+            w[i & 15] = Add(Add(w[i & 15], sigma1(w[(i + 14) & 15])), Add(w[(i + 9) & 15], sigma0(w[(i + 1) & 15])));
+        __m256i t1 = Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), Add(Set(K[i]), w[i & 15])));
+        __m256i t2 = Add(Sigma0(a), Maj(a, b, c));
+        h = g;
+        g = f;
+        f = e;
+        e = Add(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = Add(t1, t2);
+    }
+    s[0] = Add(s[0], a);
+    s[1] = Add(s[1], b);
+    s[2] = Add(s[2], c);
+    s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e);
+    s[5] = Add(s[5], f);
+    s[6] = Add(s[6], g);
+    s[7] = Add(s[7], h);
+}
+
+/** Load big-endian word j of each of the eight 64-byte inputs. */
+__m256i inline Read8(const unsigned char* in, int j)
+{
+    return _mm256_set_epi32(ReadBE32(in + 448 + 4 * j), ReadBE32(in + 384 + 4 * j), ReadBE32(in + 320 + 4 * j), ReadBE32(in + 256 + 4 * j),
+                            ReadBE32(in + 192 + 4 * j), ReadBE32(in + 128 + 4 * j), ReadBE32(in + 64 + 4 * j), ReadBE32(in + 4 * j));
+}
+
+/** Store word j of each lane as big-endian into the eight 32-byte outputs. */
+void inline Write8(unsigned char* out, int j, __m256i v)
+{
+    WriteBE32(out + 4 * j, _mm256_extract_epi32(v, 0));
+    WriteBE32(out + 32 + 4 * j, _mm256_extract_epi32(v, 1));
+    WriteBE32(out + 64 + 4 * j, _mm256_extract_epi32(v, 2));
+    WriteBE32(out + 96 + 4 * j, _mm256_extract_epi32(v, 3));
+    WriteBE32(out + 128 + 4 * j, _mm256_extract_epi32(v, 4));
+    WriteBE32(out + 160 + 4 * j, _mm256_extract_epi32(v, 5));
+    WriteBE32(out + 192 + 4 * j, _mm256_extract_epi32(v, 6));
+    WriteBE32(out + 224 + 4 * j, _mm256_extract_epi32(v, 7));
+}
+
+}
+
+void Transform_8way(unsigned char* out, const unsigned char* in)
+{
+    __m256i s[8], w[16];
+
+    // Transform 1: the 64-byte inputs.
+    for (int i = 0; i < 8; i++)
+        s[i] = Set(IV[i]);
+    for (int j = 0; j < 16; j++)
+        w[j] = Read8(in, j);
+    Transform(s, w);
+
+    // Transform 2: the padding block of a 64-byte message.
+    w[0] = Set(0x80000000ul);
+    for (int j = 1; j < 15; j++)
+        w[j] = _mm256_setzero_si256();
+    w[15] = Set(0x200);
+    Transform(s, w);
+
+    // Transform 3: the padded 32-byte hash from the first pass.
+    for (int j = 0; j < 8; j++) {
+        w[j] = s[j];
+        s[j] = Set(IV[j]);
+    }
+    w[8] = Set(0x80000000ul);
+    for (int j = 9; j < 15; j++)
+        w[j] = _mm256_setzero_si256();
+    w[15] = Set(0x100);
+    Transform(s, w);
+
+    for (int j = 0; j < 8; j++)
+        Write8(out, j, s[j]);
+}
+
+}
+
+#endif
@@ -10,6 +10,7 @@
 #include "eccryptoverify.h"
 #include "pubkey.h"
 #include "random.h"
+#include "support/pagelocker.h"
 
 #include <secp256k1.h>
 #include "ecwrapper.h"
@@ -23,8 +24,8 @@ bool CKey::Check(const unsigned char *vch) {
 void CKey::MakeNewKey(bool fCompressedIn) {
     RandAddSeedPerfmon();
     do {
-        GetRandBytes(vch, sizeof(vch));
-    } while (!Check(vch));
+        GetRandBytes(&keydata[0], keydata.size());
+    } while (!Check(&keydata[0]));
     fValid = true;
     fCompressed = fCompressedIn;
 }
@@ -11,9 +11,11 @@
 #include "alert.h"
 #include "arith_uint256.h"
 #include "auxpow.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "consensus/merkle.h"
 #include "consensus/validation.h"
 #include "newyorkcoin.h"
 #include "init.h"
@@ -63,6 +65,13 @@ bool fPruneMode = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = true;
+uint256 hashAssumeValid;
+bool fSkippedScriptChecks = false;
+bool fLoadingSnapshot = false;
+CBlockIndex *pindexSnapshotBase = NULL;
+/** The UTXO set commitment for pcoinsTip's best block, if fTxOutSetCommitment. */
+static CTxOutSetCommitment txoutsetCommitment;
+static bool fTxOutSetCommitment = false;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
 bool fAlerts = DEFAULT_ALERTS;
@@ -162,6 +171,7 @@ namespace {
         int64_t nTime;  //! Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //! The timeout for this block request (for disconnecting a slow peer)
+        boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;  //! Optional, set while a compact block is being completed.
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -176,6 +186,16 @@ namespace {
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /**
+     * The last block served to a peer, serialized as a "block" and as a
+     * "cmpctblock" message on first use. A new block is typically requested by
+     * most peers within seconds, and they all share these buffers. Protected
+     * by cs_main.
+     */
+    uint256 hashRecentBlockMsg;
+    CSerializedNetMsg recentBlockMsg;
+    CSerializedNetMsg recentCmpctBlockMsg;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -223,8 +243,22 @@ struct CNodeState {
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! Number of requested blocks received from this peer, and their total size.
+    uint64_t nBlocksDownloaded;
+    uint64_t nBytesDownloaded;
+    //! Moving averages (in microseconds) of the time between requesting a block and receiving it, and of
+    //! the time the peer spends on one block: from the later of its request and the previous block's
+    //! arrival until its own arrival. 0 if unknown.
+    int64_t nBlockLatency;
+    int64_t nBlockServiceTime;
+    //! Moving average of the size of the blocks received from this peer.
+    int64_t nAvgBlockSize;
+    //! When the last requested block arrived from this peer (in microseconds), or 0.
+    int64_t nLastBlockReceived;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer announced (through "sendcmpct") that it serves and accepts compact blocks.
+    bool fProvidesCompactBlocks;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -237,7 +271,14 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nBlocksDownloaded = 0;
+        nBytesDownloaded = 0;
+        nBlockLatency = 0;
+        nBlockServiceTime = 0;
+        nAvgBlockSize = 0;
+        nLastBlockReceived = 0;
         fPreferredDownload = false;
+        fProvidesCompactBlocks = false;
     }
 };
 
@@ -300,12 +341,50 @@ void FinalizeNode(NodeId nodeid) {
     mapNodeState.erase(nodeid);
 }
 
+/** Fold a sample into a moving average that weighs it 1/8; an average of 0 means no samples yet. */
+int64_t UpdateMovingAverage(int64_t nAverage, int64_t nSample)
+{
+    nSample = std::max<int64_t>(nSample, 1);
+    if (nAverage == 0)
+        return nSample;
+    return nAverage + (nSample - nAverage) / 8;
+}
+
+/** How many blocks may be in flight from this peer: enough to keep it busy for BLOCK_DOWNLOAD_PIPELINE_TIME. */
+int GetBlocksInTransitLimit(const CNodeState* state)
+{
+    if (state->nBlockServiceTime == 0)
+        return DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nLimit = 1000000LL * BLOCK_DOWNLOAD_PIPELINE_TIME / state->nBlockServiceTime;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_PEER, nLimit));
+}
+
+/** Whether a is a known block source that serves blocks at least twice as fast as b. */
+bool IsMuchFasterBlockSource(const CNodeState* a, const CNodeState* b)
+{
+    if (a->nBlockServiceTime == 0)
+        return false;
+    return b->nBlockServiceTime == 0 || b->nBlockServiceTime > 2 * a->nBlockServiceTime;
+}
+
 // Requires cs_main.
-// Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived(const uint256& hash) {
+// Returns a bool indicating whether we requested this block. If pblock is the block as received
+// from nodeFrom, and it was requested from that peer, its download statistics are updated.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1, const CBlock* pblock = NULL) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (pblock && itInFlight->second.first == nodeFrom) {
+            int64_t nNow = GetTimeMicros();
+            int64_t nRequested = itInFlight->second.second->nTime;
+            unsigned int nSize = ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
+            state->nBlocksDownloaded++;
+            state->nBytesDownloaded += nSize;
+            state->nBlockLatency = UpdateMovingAverage(state->nBlockLatency, nNow - nRequested);
+            state->nBlockServiceTime = UpdateMovingAverage(state->nBlockServiceTime, nNow - std::max(nRequested, state->nLastBlockReceived));
+            state->nAvgBlockSize = UpdateMovingAverage(state->nAvgBlockSize, nSize);
+            state->nLastBlockReceived = nNow;
+        }
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
@@ -326,7 +405,7 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     MarkBlockAsReceived(hash);
 
     int64_t nNow = GetTimeMicros();
-    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams)};
+    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams), boost::shared_ptr<PartiallyDownloadedBlock>()};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
@@ -387,8 +466,9 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+ *  at most count entries. pindexWaitingFor is set to the first block on the way that is in flight
+ *  from another peer, if any. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexWaitingFor) {
     if (count == 0)
         return;
 
@@ -465,6 +545,8 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                if (waitingfor != nodeid)
+                    pindexWaitingFor = pindex;
             }
         }
     }
@@ -484,6 +566,11 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksInTransitLimit = GetBlocksInTransitLimit(state);
+    stats.nBlocksDownloaded = state->nBlocksDownloaded;
+    stats.nBytesDownloaded = state->nBytesDownloaded;
+    stats.nBlockLatency = state->nBlockLatency;
+    stats.nBlockBytesPerSec = state->nBlockServiceTime ? 1000000LL * state->nAvgBlockSize / state->nBlockServiceTime : 0;
     return true;
 }
 
@@ -521,6 +608,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -888,8 +976,9 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+static bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const CTransaction &tx,
+                                     const CTransactionRef &ptx, bool fLimitFree,
+                                     bool* pfMissingInputs, bool fRejectAbsurdFee)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -996,7 +1085,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CAmount nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx));
+        CTxMemPoolEntry entry(ptx ? ptx : MakeTransactionRef(tx), nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx));
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1042,7 +1131,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true))
+        PrecomputedTransactionData txdata(tx);
+        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, txdata))
         {
             return error("AcceptToMemoryPool: ConnectInputs failed %s", hash.ToString());
         }
@@ -1056,7 +1146,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
         {
             return error("AcceptToMemoryPool: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
@@ -1070,6 +1160,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+{
+    return AcceptToMemoryPoolWorker(pool, state, tx, CTransactionRef(), fLimitFree, pfMissingInputs, fRejectAbsurdFee);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &ptx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+{
+    return AcceptToMemoryPoolWorker(pool, state, *ptx, ptx, fLimitFree, pfMissingInputs, fRejectAbsurdFee);
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1417,13 +1519,13 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 
 bool CScriptCheck::operator()() {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore, txdata), &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
     }
     return true;
 }
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks)
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, const PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
     {
@@ -1494,7 +1596,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1507,7 +1609,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
                         CScriptCheck check(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -1556,6 +1658,26 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
+/** Abort with a message */
+bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
+{
+    strMiscWarning = strMessage;
+    LogPrintf("*** %s\n", strMessage);
+    uiInterface.ThreadSafeMessageBox(
+        userMessage.empty() ? _("Error: A fatal internal error occured, see debug.log for details") : userMessage,
+        "", CClientUIInterface::MSG_ERROR);
+    StartShutdown();
+    return false;
+}
+
+bool AbortNode(CValidationState& state, const std::string& strMessage, const std::string& userMessage="")
+{
+    AbortNode(strMessage, userMessage);
+    return state.Error(strMessage);
+}
+
+} // anon namespace
+
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
     // Open history file to read
@@ -1583,26 +1705,6 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     return true;
 }
 
-/** Abort with a message */
-bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
-{
-    strMiscWarning = strMessage;
-    LogPrintf("*** %s\n", strMessage);
-    uiInterface.ThreadSafeMessageBox(
-        userMessage.empty() ? _("Error: A fatal internal error occured, see debug.log for details") : userMessage,
-        "", CClientUIInterface::MSG_ERROR);
-    StartShutdown();
-    return false;
-}
-
-bool AbortNode(CValidationState& state, const std::string& strMessage, const std::string& userMessage="")
-{
-    AbortNode(strMessage, userMessage);
-    return state.Error(strMessage);
-}
-
-} // anon namespace
-
 /**
  * Apply the undo operation of a CTxInUndo to the given chain state.
  * @param undo The undo object.
@@ -1636,7 +1738,49 @@ static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const CO
     return fClean;
 }
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+/** Apply the outputs created and spent by a block to a UTXO set commitment, or take them back. */
+static void UpdateTxOutSetCommitment(CTxOutSetCommitment& commitment, const CBlock& block, const CBlockUndo& blockundo, bool fConnect)
+{
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        const uint256 hash = tx.GetHash();
+        bool fUnspent = false;
+        for (unsigned int j = 0; j < tx.vout.size(); j++) {
+            if (tx.vout[j].scriptPubKey.IsUnspendable())
+                continue;
+            if (fConnect)
+                commitment.AddOutput(COutPoint(hash, j), tx.vout[j]);
+            else
+                commitment.RemoveOutput(COutPoint(hash, j), tx.vout[j]);
+            fUnspent = true;
+        }
+        if (fUnspent) {
+            if (fConnect)
+                commitment.nTransactions++;
+            else
+                commitment.nTransactions--;
+        }
+        if (i == 0)
+            continue;
+        const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+        for (unsigned int j = 0; j < tx.vin.size(); j++) {
+            const CTxInUndo& undo = txundo.vprevout[j];
+            if (fConnect)
+                commitment.RemoveOutput(tx.vin[j].prevout, undo.txout);
+            else
+                commitment.AddOutput(tx.vin[j].prevout, undo.txout);
+            // The undo data only records the height for the spend that pruned its transaction.
+            if (undo.nHeight != 0) {
+                if (fConnect)
+                    commitment.nTransactions--;
+                else
+                    commitment.nTransactions++;
+            }
+        }
+    }
+}
+
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, CTxOutSetCommitment* pcommitment)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -1696,6 +1840,11 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
+    if (pcommitment && fClean) {
+        UpdateTxOutSetCommitment(*pcommitment, block, blockUndo, false);
+        pcommitment->hashBlock = pindex->pprev->GetBlockHash();
+    }
+
     if (pfClean) {
         *pfClean = fClean;
         return true;
@@ -1729,13 +1878,18 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
 
 void ThreadScriptCheck() {
     RenameThread("dogecoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
+void GetScriptCheckStats(std::vector<CCheckQueueWorkerStats>& vStats)
+{
+    scriptcheckqueue.GetStats(vStats);
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -1804,7 +1958,7 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, CTxOutSetCommitment* pcommitment)
 {
     const CChainParams& chainparams = Params();
     const Consensus::Params consensus = chainparams.GetConsensus(pindex->nHeight);
@@ -1822,10 +1976,30 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (block.GetHash() == consensus.hashGenesisBlock) {
         if (!fJustCheck)
             view.SetBestBlock(pindex->GetBlockHash());
+        if (pcommitment && !fJustCheck)
+            pcommitment->hashBlock = pindex->GetBlockHash();
         return true;
     }
 
-    bool fScriptChecks = (!fCheckpointsEnabled || pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate(chainparams.Checkpoints()));
+    // Scripts need not be checked for ancestors of the -assumevalid block, but only as long as the block
+    // is also in our best header chain and buried under ASSUMEVALID_MIN_BURIAL_TIME worth of work. A
+    // chain can then only get us to skip an invalid block by burying it under much more work, and a
+    // recent block is always verified, however the setting is chosen.
+    bool fScriptChecks = true;
+    if (!hashAssumeValid.IsNull()) {
+        BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+        if (it != mapBlockIndex.end() && it->second->GetAncestor(pindex->nHeight) == pindex &&
+            pindexBestHeader->GetAncestor(pindex->nHeight) == pindex) {
+            fScriptChecks = GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, consensus) <= ASSUMEVALID_MIN_BURIAL_TIME;
+        }
+    }
+    if (!fJustCheck && fSkippedScriptChecks == fScriptChecks) {
+        fSkippedScriptChecks = !fScriptChecks;
+        if (fSkippedScriptChecks)
+            LogPrintf("%s: skipping script checks from height %d, block is an ancestor of assumed-valid block %s\n", __func__, pindex->nHeight, hashAssumeValid.ToString());
+        else
+            LogPrintf("%s: checking scripts from height %d\n", __func__, pindex->nHeight);
+    }
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -1862,15 +2036,18 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
+    // Sighash data shared by the script checks of each transaction. Declared
+    // before control, so it outlives the queued checks; the reserve keeps
+    // pointers into it stable.
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(block.vtx.size());
+
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
     int nInputs = 0;
     unsigned int nSigOps = 0;
-    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
-    vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
@@ -1900,8 +2077,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
+            if (fScriptChecks)
+                txdata.push_back(PrecomputedTransactionData(tx));
+            else
+                txdata.push_back(PrecomputedTransactionData());
             std::vector<CScriptCheck> vChecks;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, txdata.back(), nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
@@ -1911,9 +2092,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             blockundo.vtxundo.push_back(CTxUndo());
         }
         UpdateCoins(tx, state, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
-
-        vPos.push_back(std::make_pair(tx.GetHash(), pos));
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64_t nTime1 = GetTimeMicros(); nTimeConnect += nTime1 - nTimeStart;
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime1 - nTimeStart), 0.001 * (nTime1 - nTimeStart) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime1 - nTimeStart) / (nInputs-1), nTimeConnect * 0.000001);
@@ -1952,13 +2130,14 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
-            return AbortNode(state, "Failed to write transaction index");
-
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
+    if (pcommitment) {
+        UpdateTxOutSetCommitment(*pcommitment, block, blockundo, true);
+        pcommitment->hashBlock = pindex->GetBlockHash();
+    }
+
     int64_t nTime3 = GetTimeMicros(); nTimeIndex += nTime3 - nTime2;
     LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime3 - nTime2), nTimeIndex * 0.000001);
 
@@ -2066,7 +2245,10 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         // overwrite one. Still, use a conservative safety factor of 2.
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
-        // Flush the chainstate (which may refer to block index entries).
+        // Flush the chainstate (which may refer to block index entries),
+        // with the UTXO set commitment for the same block if we have it.
+        if (fTxOutSetCommitment)
+            pcoinsdbview->SetTxOutSetCommitment(txoutsetCommitment);
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
@@ -2102,10 +2284,11 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("%s: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n", __func__,
+    LogPrintf("%s: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f%s  cache=%.1fMiB(%utx)\n", __func__,
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-      Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)), pcoinsTip->GetCacheSize());
+      Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip()), fSkippedScriptChecks ? " (assumevalid)" : "",
+      pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)), pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -2133,6 +2316,31 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     }
 }
 
+/** The UTXO set commitment to keep up to date with pcoinsTip, or NULL if it has fallen out of step. */
+static CTxOutSetCommitment* GetTrackedTxOutSetCommitment()
+{
+    if (fTxOutSetCommitment && txoutsetCommitment.hashBlock == pcoinsTip->GetBestBlock())
+        return &txoutsetCommitment;
+    fTxOutSetCommitment = false;
+    return NULL;
+}
+
+bool GetTxOutSetCommitment(CTxOutSetCommitment& commitment)
+{
+    LOCK(cs_main);
+    if (!GetTrackedTxOutSetCommitment()) {
+        // Not tracked since startup (e.g. after upgrading); build it from a
+        // full scan of the chain state once and keep it up to date from then on.
+        FlushStateToDisk();
+        LogPrintf("Computing UTXO set commitment at block %s...\n", pcoinsTip->GetBestBlock().ToString());
+        if (!pcoinsdbview->ComputeTxOutSetCommitment(txoutsetCommitment))
+            return false;
+        fTxOutSetCommitment = true;
+    }
+    commitment = txoutsetCommitment;
+    return true;
+}
+
 /** Disconnect chainActive's tip. */
 bool static DisconnectTip(CValidationState &state) {
     CBlockIndex *pindexDelete = chainActive.Tip();
@@ -2146,7 +2354,7 @@ bool static DisconnectTip(CValidationState &state) {
     int64_t nStart = GetTimeMicros();
     {
         CCoinsViewCache view(pcoinsTip);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
+        if (!DisconnectBlock(block, state, pindexDelete, view, NULL, GetTrackedTxOutSetCommitment()))
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         assert(view.Flush());
     }
@@ -2202,7 +2410,7 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     {
         CCoinsViewCache view(pcoinsTip);
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view);
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, GetTrackedTxOutSetCommitment());
         GetMainSignals().BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -2428,6 +2636,7 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
             // Notify external listeners about the new tip.
             uiInterface.NotifyBlockTip(hashNewTip, pindexNewTip->nHeight);
         }
+        GetMainSignals().UpdatedBlockTip(pindexNewTip);
     } while(pindexMostWork != chainActive.Tip());
     CheckBlockIndex();
 
@@ -2696,6 +2905,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
 {
     // These are checks that are independent of context.
 
+    if (block.fChecked)
+        return true;
+
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
     if (!CheckBlockHeader(block, state, fCheckPOW))
@@ -2704,7 +2916,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     // Check the merkle root.
     if (fCheckMerkleRoot) {
         bool mutated;
-        uint256 hashMerkleRoot2 = block.BuildMerkleTree(&mutated);
+        uint256 hashMerkleRoot2 = BlockMerkleRoot(block, &mutated);
         if (block.hashMerkleRoot != hashMerkleRoot2)
             return state.DoS(100, error("CheckBlock(): hashMerkleRoot mismatch"),
                              REJECT_INVALID, "bad-txnmrklroot", true);
@@ -2749,6 +2961,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("CheckBlock(): out-of-bounds SigOpCount"),
                          REJECT_INVALID, "bad-blk-sigops", true);
 
+    if (fCheckPOW && fCheckMerkleRoot)
+        block.fChecked = true;
+
     return true;
 }
 
@@ -2972,7 +3187,7 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1, pblock);
         fRequested |= fForceProcessing;
         if (!checked) {
             return error("%s: CheckBlock FAILED", __func__);
@@ -3225,6 +3440,16 @@ bool static LoadBlockIndexDB()
             } else {
                 pindex->nChainTx = pindex->nTx;
             }
+        } else if (pindex->IsValid(BLOCK_VALID_SCRIPTS) && !(pindex->nStatus & BLOCK_HAVE_DATA) && pindex->pprev &&
+                   !pindex->pprev->nChainTx) {
+            // Only the block a UTXO set snapshot was loaded at gets fully validated without its data
+            // or its ancestors' transactions.
+            BOOST_FOREACH(const CTxOutSetSnapshotData& snapshot, chainparams.TxOutSetSnapshots()) {
+                if (snapshot.hashBlock == pindex->GetBlockHash()) {
+                    pindex->nChainTx = snapshot.nChainTx;
+                    pindexSnapshotBase = pindex;
+                }
+            }
         }
         if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
             setBlockIndexCandidates.insert(pindex);
@@ -3281,9 +3506,16 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadReindexing(fReindexing);
     fReindex |= fReindexing;
 
-    // Check whether we have a transaction index
-    pblocktree->ReadFlag("txindex", fTxIndex);
-    LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
+    // Pick up the stored UTXO set commitment if it matches the chain state;
+    // an empty chain state starts with the empty one.
+    if (pcoinsTip->GetBestBlock().IsNull()) {
+        txoutsetCommitment = CTxOutSetCommitment();
+        fTxOutSetCommitment = true;
+    } else {
+        fTxOutSetCommitment = pcoinsdbview->ReadTxOutSetCommitment(txoutsetCommitment) &&
+                              txoutsetCommitment.hashBlock == pcoinsTip->GetBestBlock();
+    }
+    LogPrintf("%s: UTXO set commitment %s\n", __func__, fTxOutSetCommitment ? "loaded" : "not available, will be computed on demand");
 
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
@@ -3335,6 +3567,9 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        // Blocks up to a loaded UTXO set snapshot were never downloaded
+        if (pindexSnapshotBase && pindex->nHeight <= pindexSnapshotBase->nHeight)
+            break;
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -3435,9 +3670,6 @@ bool InitBlockIndex() {
     if (chainActive.Genesis() != NULL)
         return true;
 
-    // Use the provided setting for -txindex in the new database
-    fTxIndex = GetBoolArg("-txindex", false);
-    pblocktree->WriteFlag("txindex", fTxIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3469,66 +3701,242 @@ bool InitBlockIndex() {
 
 
 
+namespace {
+
+/** Bytes of block records the import pipeline may hold between reading them and connecting them. */
+static const size_t IMPORT_PIPELINE_MAX_BYTES = 64 * MAX_BLOCK_SIZE;
+/** Bytes of imported blocks whose parent is not known yet that are kept in memory. Beyond this,
+ *  only their position on disk is remembered (when reindexing) and they are read back later. */
+static const size_t IMPORT_REORDER_MAX_BYTES = 64 * MAX_BLOCK_SIZE;
+
+/** A block record read from an external block file, on its way through CBlockImportPipeline. */
+struct CImportedBlock
+{
+    uint64_t nSequence;
+    CDiskBlockPos pos;      //! Only set when importing our own block files
+    size_t nSize;
+    CDataStream ssData;     //! The raw record, released once decoded
+    CBlock block;
+    std::string strError;   //! Why the record could not be decoded, if it could not
+
+    CImportedBlock() : nSequence(0), nSize(0), ssData(SER_DISK, CLIENT_VERSION) {}
+};
+typedef boost::shared_ptr<CImportedBlock> CImportedBlockRef;
+
+/**
+ * Imports one block file in three stages. A reader thread scans the file for block records,
+ * worker threads on all cores deserialize them and run the context-free checks (transaction
+ * hashes, merkle root, proof of work), and Next() hands the blocks back in file order. The
+ * checks are cached in the block, so ProcessNewBlock does not redo them. The reader stops
+ * while more than IMPORT_PIPELINE_MAX_BYTES are between it and the caller.
+ */
+class CBlockImportPipeline
+{
+private:
+    CBufferedFile& blkdat;
+    const CDiskBlockPos* dbp;
+
+    boost::mutex mutex;
+    boost::condition_variable condReader;
+    boost::condition_variable condWorker;
+    boost::condition_variable condNext;
+    std::deque<CImportedBlockRef> queueToDecode;
+    std::map<uint64_t, CImportedBlockRef> mapDecoded;
+    uint64_t nRead;
+    uint64_t nNext;
+    size_t nBytesPending;
+    bool fReadDone;
+    std::string strReadError;
+
+    boost::thread_group threads;
+
+    void Push(const CImportedBlockRef& pimport)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (nBytesPending > 0 && nBytesPending + pimport->nSize > IMPORT_PIPELINE_MAX_BYTES)
+            condReader.wait(lock);
+        pimport->nSequence = nRead++;
+        nBytesPending += pimport->nSize;
+        queueToDecode.push_back(pimport);
+        condWorker.notify_one();
+    }
+
+    void ThreadRead()
+    {
+        RenameThread("dogecoin-loadrd");
+        try {
+            uint64_t nRewind = blkdat.GetPos();
+            while (!blkdat.eof()) {
+                boost::this_thread::interruption_point();
+
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(Params().MessageStart()[0]);
+                    nRewind = blkdat.GetPos()+1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (const std::exception&) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+                try {
+                    // read the record; it is deserialized by a worker
+                    uint64_t nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    blkdat.SetPos(nBlockPos);
+                    CImportedBlockRef pimport(new CImportedBlock());
+                    if (dbp) {
+                        pimport->pos = *dbp;
+                        pimport->pos.nPos = nBlockPos;
+                    }
+                    pimport->nSize = nSize;
+                    pimport->ssData.resize(nSize);
+                    blkdat.read(&pimport->ssData[0], nSize);
+                    nRewind = blkdat.GetPos();
+                    Push(pimport);
+                } catch (const std::exception& e) {
+                    LogPrintf("%s: I/O error - %s\n", __func__, e.what());
+                }
+            }
+        } catch (const std::runtime_error& e) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            strReadError = e.what();
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReadDone = true;
+        condNext.notify_all();
+    }
+
+    void ThreadDecode()
+    {
+        RenameThread("dogecoin-loadchk");
+        while (true) {
+            CImportedBlockRef pimport;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueToDecode.empty())
+                    condWorker.wait(lock);
+                pimport = queueToDecode.front();
+                queueToDecode.pop_front();
+            }
+
+            try {
+                pimport->ssData >> pimport->block;
+                CValidationState state;
+                CheckBlock(pimport->block, state);
+            } catch (const std::exception& e) {
+                pimport->strError = e.what();
+            }
+            pimport->ssData = CDataStream(SER_DISK, CLIENT_VERSION);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapDecoded.insert(std::make_pair(pimport->nSequence, pimport));
+            if (pimport->nSequence == nNext)
+                condNext.notify_all();
+        }
+    }
+
+public:
+    CBlockImportPipeline(CBufferedFile& blkdatIn, const CDiskBlockPos* dbpIn) :
+        blkdat(blkdatIn), dbp(dbpIn), nRead(0), nNext(0), nBytesPending(0), fReadDone(false)
+    {
+        int nWorkers = std::max(1, (int)boost::thread::hardware_concurrency());
+        threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadRead, this));
+        for (int i = 0; i < nWorkers; i++)
+            threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadDecode, this));
+    }
+
+    ~CBlockImportPipeline()
+    {
+        threads.interrupt_all();
+        threads.join_all();
+    }
+
+    /** Wait for the next block of the file, in file order. Returns NULL at the end of the file. */
+    CImportedBlockRef Next()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            std::map<uint64_t, CImportedBlockRef>::iterator it = mapDecoded.find(nNext);
+            if (it != mapDecoded.end()) {
+                CImportedBlockRef pimport = it->second;
+                mapDecoded.erase(it);
+                nNext++;
+                nBytesPending -= pimport->nSize;
+                condReader.notify_one();
+                return pimport;
+            }
+            if (fReadDone && nNext == nRead)
+                return CImportedBlockRef();
+            condNext.wait(lock);
+        }
+    }
+
+    /** After Next() returned NULL: whether reading stopped on a file error. */
+    bool GetReadError(std::string& strError)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        strError = strReadError;
+        return !strError.empty();
+    }
+};
+
+} // anon namespace
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     const CChainParams& chainparams = Params();
     // Map of disk positions for blocks with unknown parent (only used for reindex)
     static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    // Blocks from this file with unknown parent that are kept in memory
+    std::multimap<uint256, CImportedBlockRef> mapBlocksWaitingForParent;
+    size_t nWaitingBytes = 0;
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
     try {
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        CBlockImportPipeline pipeline(blkdat, dbp);
+        CImportedBlockRef pimport;
+        while ((pimport = pipeline.Next())) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
+            if (!pimport->strError.empty()) {
+                LogPrintf("%s: Deserialize error - %s\n", __func__, pimport->strError);
+                continue;
             }
             try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+                CBlock& block = pimport->block;
+                CDiskBlockPos* pblockpos = dbp ? &pimport->pos : NULL;
 
                 // detect out of order blocks, and store them for later
                 uint256 hash = block.GetHash();
                 if (hash != chainparams.GetConsensus(0).hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
                     LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
                             block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+                    if (nWaitingBytes + pimport->nSize <= IMPORT_REORDER_MAX_BYTES) {
+                        mapBlocksWaitingForParent.insert(std::make_pair(block.hashPrevBlock, pimport));
+                        nWaitingBytes += pimport->nSize;
+                    } else if (dbp)
+                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, pimport->pos));
                     continue;
                 }
 
                 // process in case the block isn't known yet
                 if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
                     CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, true, dbp))
+                    if (ProcessNewBlock(state, NULL, &block, true, pblockpos))
                         nLoaded++;
                     if (state.IsError())
                         break;
@@ -3542,6 +3950,22 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 while (!queue.empty()) {
                     uint256 head = queue.front();
                     queue.pop_front();
+                    std::pair<std::multimap<uint256, CImportedBlockRef>::iterator, std::multimap<uint256, CImportedBlockRef>::iterator> rangeMem = mapBlocksWaitingForParent.equal_range(head);
+                    while (rangeMem.first != rangeMem.second) {
+                        std::multimap<uint256, CImportedBlockRef>::iterator it = rangeMem.first;
+                        CImportedBlockRef pchild = it->second;
+                        LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, pchild->block.GetHash().ToString(),
+                                head.ToString());
+                        CValidationState dummy;
+                        if (ProcessNewBlock(dummy, NULL, &pchild->block, true, dbp ? &pchild->pos : NULL))
+                        {
+                            nLoaded++;
+                            queue.push_back(pchild->block.GetHash());
+                        }
+                        nWaitingBytes -= pchild->nSize;
+                        rangeMem.first++;
+                        mapBlocksWaitingForParent.erase(it);
+                    }
                     std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
                     while (range.first != range.second) {
                         std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
@@ -3564,6 +3988,16 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
         }
+
+        // The parents of blocks still waiting may be in a later file; read them back from disk then.
+        if (dbp) {
+            for (std::multimap<uint256, CImportedBlockRef>::iterator it = mapBlocksWaitingForParent.begin(); it != mapBlocksWaitingForParent.end(); it++)
+                mapBlocksUnknownParent.insert(std::make_pair(it->first, it->second->pos));
+        }
+
+        std::string strError;
+        if (pipeline.GetReadError(strError))
+            throw std::runtime_error(strError);
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
@@ -3572,12 +4006,94 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     return nLoaded > 0;
 }
 
+bool LoadTxOutSetSnapshot(const boost::filesystem::path& path)
+{
+    const CChainParams& chainparams = Params();
+
+    // First pass: hash the snapshot without touching the chain state, and
+    // only accept it if it matches one of the snapshots we know about.
+    CCoinsStats stats;
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: cannot open %s", __func__, path.string());
+        LogPrintf("Checking UTXO set snapshot %s...\n", path.string());
+        if (!pcoinsdbview->LoadSnapshot(filein, false, stats))
+            return false;
+    }
+    const CTxOutSetSnapshotData* psnapshot = NULL;
+    BOOST_FOREACH(const CTxOutSetSnapshotData& snapshot, chainparams.TxOutSetSnapshots()) {
+        if (snapshot.hashBlock == stats.hashBlock)
+            psnapshot = &snapshot;
+    }
+    if (!psnapshot)
+        return error("%s: no UTXO set snapshot is known for block %s", __func__, stats.hashBlock.ToString());
+    if (stats.hashSerialized != psnapshot->hashSerialized)
+        return error("%s: snapshot hash %s does not match the expected %s", __func__,
+            stats.hashSerialized.ToString(), psnapshot->hashSerialized.ToString());
+
+    // The snapshot's block must be part of the best headers chain before we
+    // can make it our tip; block downloads are held back until then.
+    CBlockIndex* pindexBase = NULL;
+    LogPrintf("Waiting for the headers chain to reach block %s...\n", stats.hashBlock.ToString());
+    while (true) {
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(stats.hashBlock);
+            if (mi != mapBlockIndex.end() && pindexBestHeader &&
+                pindexBestHeader->GetAncestor(mi->second->nHeight) == mi->second) {
+                pindexBase = mi->second;
+                break;
+            }
+        }
+        MilliSleep(1000);
+    }
+
+    LOCK(cs_main);
+    if (chainActive.Height() > 0)
+        return error("%s: the chain state is already at height %d", __func__, chainActive.Height());
+    FlushStateToDisk();
+
+    // Second pass: write the coins. A failure here leaves the database half
+    // written, so treat it like any other chain state write error.
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        CCoinsStats statsLoaded;
+        LogPrintf("Loading UTXO set snapshot at block %s (height %d)...\n", stats.hashBlock.ToString(), pindexBase->nHeight);
+        if (filein.IsNull() || !pcoinsdbview->LoadSnapshot(filein, true, statsLoaded) ||
+            statsLoaded.hashSerialized != stats.hashSerialized)
+            return AbortNode("Failed to load UTXO set snapshot", _("Error loading the UTXO set snapshot. You need to rebuild the database using -reindex."));
+    }
+
+    // The cache was just flushed, so it only needs to learn the new best block.
+    pcoinsTip->SetBestBlock(stats.hashBlock);
+    pindexBase->nChainTx = psnapshot->nChainTx;
+    pindexBase->RaiseValidity(BLOCK_VALID_SCRIPTS);
+    setDirtyBlockIndex.insert(pindexBase);
+    setBlockIndexCandidates.insert(pindexBase);
+    pindexSnapshotBase = pindexBase;
+    UpdateTip(pindexBase);
+    PruneBlockIndexCandidates();
+
+    // We cannot serve the blocks below the snapshot.
+    nLocalServices &= ~NODE_NETWORK;
+    FlushStateToDisk();
+    LogPrintf("Loaded UTXO set snapshot: %lu transactions, %lu outputs\n",
+        (unsigned long)stats.nTransactions, (unsigned long)stats.nTransactionOutputs);
+    return true;
+}
+
 void static CheckBlockIndex()
 {
     if (!fCheckBlockIndex) {
         return;
     }
 
+    // The consistency rules below assume every block in the active chain was connected here.
+    if (pindexSnapshotBase) {
+        return;
+    }
+
     LOCK(cs_main);
 
     // During a reindex, we read the genesis block and call CheckBlockIndex before ActivateBestChain,
@@ -3846,6 +4362,28 @@ bool static AlreadyHave(const CInv& inv)
     return true;
 }
 
+// Requires cs_main.
+CSerializedNetMsg static GetBlockNetMsg(CBlockIndex* pindex, bool fCompact)
+{
+    if (pindex->GetBlockHash() != hashRecentBlockMsg) {
+        hashRecentBlockMsg = pindex->GetBlockHash();
+        recentBlockMsg.reset();
+        recentCmpctBlockMsg.reset();
+    }
+
+    CSerializedNetMsg& msg = fCompact ? recentCmpctBlockMsg : recentBlockMsg;
+    if (!msg) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            assert(!"cannot load block from disk");
+        if (fCompact)
+            msg = MakeNetMsg("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+        else
+            msg = MakeNetMsg("block", block);
+    }
+    return msg;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -3864,7 +4402,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -3889,14 +4427,21 @@ void static ProcessGetData(CNode* pfrom)
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // A peer asking for an old block is unlikely to have a mempool
+                        // that matches it, so send the full block instead of making it
+                        // come back for nearly every transaction.
+                        bool fCompact = inv.type == MSG_CMPCT_BLOCK &&
+                            mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                        pfrom->PushNetMsg(GetBlockNetMsg(mi->second, fCompact));
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -3910,7 +4455,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -3932,23 +4477,21 @@ void static ProcessGetData(CNode* pfrom)
             }
             else if (inv.IsKnownType())
             {
-                // Send stream from relay memory
+                // Send the transaction from relay memory, which holds it
+                // already serialized and shared between all peers
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSerializedNetMsg>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushNetMsg((*mi).second);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
+                    CTransactionRef ptx = mempool.get(inv.hash);
+                    if (ptx) {
+                        pfrom->PushMessage("tx", *ptx);
                         pushed = true;
                     }
                 }
@@ -3979,6 +4522,22 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Hand a block received from (or reconstructed with the help of) a peer to validation. Must not hold cs_main. */
+void static ProcessBlockFromPeer(CNode* pfrom, CBlock& block, bool fForceProcessing)
+{
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block, fForceProcessing, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", std::string("block"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -4131,6 +4690,26 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell the peer we can serve and reconstruct compact blocks. We never
+            // ask to have new blocks announced as compact blocks directly; they are
+            // requested with MSG_CMPCT_BLOCK once an inv arrives.
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, CMPCTBLOCKS_VERSION);
+        }
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesCompactBlocks = true;
+        }
     }
 
 
@@ -4242,8 +4821,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus(chainActive.Height()).nPowTargetSpacing * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        nodestate->nBlocksInFlight < GetBlocksInTransitLimit(nodestate)) {
+                        // Near the tip our mempool most likely holds the block's
+                        // transactions already, so ask for the compact form if we can.
+                        if (nodestate->fProvidesCompactBlocks)
+                            vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                        else
+                            vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus(chainActive.Height()));
@@ -4369,8 +4953,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         vector<uint256> vWorkQueue;
         vector<uint256> vEraseQueue;
-        CTransaction tx;
-        vRecv >> tx;
+        // Deserialize into a shared transaction, so the mempool and relay
+        // memory can hold on to it without copying
+        boost::shared_ptr<CTransaction> ptxNew(new CTransaction());
+        vRecv >> *ptxNew;
+        const CTransactionRef ptx(ptxNew);
+        const CTransaction& tx = *ptx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
@@ -4380,12 +4968,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         bool fMissingInputs = false;
         CValidationState state;
 
-        mapAlreadyAskedFor.erase(inv);
+        mapAlreadyAskedFor.Erase(inv.hash);
 
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        if (AcceptToMemoryPool(mempool, state, ptx, true, &fMissingInputs))
         {
             mempool.check(pcoinsTip);
-            RelayTransaction(tx);
+            RelayTransaction(ptx);
             vWorkQueue.push_back(inv.hash);
 
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
@@ -4405,7 +4993,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                      ++mi)
                 {
                     const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
+                    const CTransactionRef porphanTx = MakeTransactionRef(mapOrphanTransactions[orphanHash].tx);
                     NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
@@ -4416,10 +5004,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
                     if (setMisbehaving.count(fromPeer))
                         continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+                    if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, true, &fMissingInputs2))
                     {
                         LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
+                        RelayTransaction(porphanTx);
                         vWorkQueue.push_back(orphanHash);
                         vEraseQueue.push_back(orphanHash);
                     }
@@ -4458,7 +5046,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // Always relay transactions received from whitelisted peers, even
             // if they are already in the mempool (allowing the node to function
             // as a gateway for nodes hidden behind it).
-            RelayTransaction(tx);
+            RelayTransaction(ptx);
         }
         int nDoS = 0;
         if (state.IsInvalid(nDoS))
@@ -4538,19 +5126,169 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         pfrom->AddInventoryKnown(inv);
 
-        CValidationState state;
         // Process all blocks from whitelisted peers, even if not requested.
-        ProcessNewBlock(state, pfrom, &block, pfrom->fWhitelisted, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+        ProcessBlockFromPeer(pfrom, block, pfrom->fWhitelisted);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        CInv inv(MSG_BLOCK, cmpctblock.header.GetHash());
+        LogPrint("net", "received cmpctblock %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+
+        pfrom->AddInventoryKnown(inv);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+                // Doesn't connect: rather than failing the header, sync the headers first.
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                return true;
+            }
+
+            CBlockIndex *pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    return error("invalid header received in cmpctblock from peer=%d", pfrom->id);
+                }
+                return true;
+            }
+            UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+
+            // We only reconstruct compact blocks we asked this very peer for;
+            // anything else is left to the regular block download logic.
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(pindex->GetBlockHash());
+            if ((pindex->nStatus & BLOCK_HAVE_DATA) || itInFlight == mapBlocksInFlight.end() ||
+                    itInFlight->second.first != pfrom->GetId() || itInFlight->second.second->partialBlock)
+                return true;
+
+            boost::shared_ptr<PartiallyDownloadedBlock>& partialBlock = itInFlight->second.second->partialBlock;
+            partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+            ReadStatus status = partialBlock->InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(pindex->GetBlockHash()); // Let another peer serve the block
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us an invalid compact block", pfrom->id);
+            }
+
+            BlockTransactionsRequest req;
+            if (status == READ_STATUS_OK) {
+                for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                    if (!partialBlock->IsTxAvailable(i))
+                        req.indexes.push_back(i);
+                }
+                if (req.indexes.empty()) {
+                    // Everything was in our mempool
+                    status = partialBlock->FillBlock(block, std::vector<CTransaction>());
+                    partialBlock.reset();
+                    fBlockReconstructed = (status == READ_STATUS_OK);
+                }
+            }
+
+            if (status != READ_STATUS_OK) {
+                // Short ID collision; the block stays in flight from this peer, just get it in full.
+                LogPrint("net", "failed to reconstruct compact block %s, requesting it in full from peer=%d\n", inv.hash.ToString(), pfrom->id);
+                partialBlock.reset();
+                std::vector<CInv> vInv(1, inv);
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+
+            if (!fBlockReconstructed) {
+                req.blockhash = pindex->GetBlockHash();
+                pfrom->PushMessage("getblocktxn", req);
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block, true);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Only recent blocks are served piecemeal. For anything older, answer
+            // with the full block so that a peer cannot make us do cheap-to-request
+            // disk reads without also receiving all the data read.
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, it->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
             }
+            resp.txn[i] = block.vtx[req.indexes[i]];
         }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
 
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockRead = false;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+            if (itInFlight == mapBlocksInFlight.end() || !itInFlight->second.second->partialBlock ||
+                    itInFlight->second.first != pfrom->GetId()) {
+                LogPrint("net", "peer=%d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;
+            partialBlock.swap(itInFlight->second.second->partialBlock);
+            ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash); // Let another peer serve the block
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us invalid compact block/non-matching block transactions", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Might have collided, fall back to getdata now
+                LogPrint("net", "failed to reconstruct compact block %s, requesting it in full from peer=%d\n", resp.blockhash.ToString(), pfrom->id);
+                std::vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vInv);
+            } else
+                fBlockRead = true;
+        }
+
+        if (fBlockRead)
+            ProcessBlockFromPeer(pfrom, block, true);
     }
 
 
@@ -5055,7 +5793,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -5076,15 +5814,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -5128,16 +5863,35 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nBlocksInTransitLimit = GetBlocksInTransitLimit(&state);
+        if (!pto->fDisconnect && !pto->fClient && !fLoadingSnapshot && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nBlocksInTransitLimit) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            CBlockIndex *pindexWaitingFor = NULL;
+            FindNextBlocksToDownload(pto->GetId(), nBlocksInTransitLimit - state.nBlocksInFlight, vToDownload, staller, pindexWaitingFor);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
                 LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
+            // The first block in flight from another peer is the one holding back the download window
+            // the longest. If it is overdue and this peer is much faster, take the request over; the
+            // slow peer's average is charged with the time it has spent on it so far.
+            if (pindexWaitingFor && state.nBlocksInFlight < nBlocksInTransitLimit) {
+                map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(pindexWaitingFor->GetBlockHash());
+                if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.second->nTime < nNow - 1000000LL * BLOCK_DOWNLOAD_PIPELINE_TIME) {
+                    CNodeState *stateSlow = State(itInFlight->second.first);
+                    if (IsMuchFasterBlockSource(&state, stateSlow)) {
+                        stateSlow->nBlockServiceTime = UpdateMovingAverage(stateSlow->nBlockServiceTime,
+                            nNow - std::max(itInFlight->second.second->nTime, stateSlow->nLastBlockReceived));
+                        LogPrint("net", "Re-requesting block %s (%d) from peer=%d, overdue from peer=%d\n", pindexWaitingFor->GetBlockHash().ToString(),
+                            pindexWaitingFor->nHeight, pto->id, itInFlight->second.first);
+                        vGetData.push_back(CInv(MSG_BLOCK, pindexWaitingFor->GetBlockHash()));
+                        MarkBlockAsInFlight(pto->GetId(), pindexWaitingFor->GetBlockHash(), consensusParams, pindexWaitingFor);
+                    }
+                }
+            }
             if (state.nBlocksInFlight == 0 && staller != -1) {
                 if (State(staller)->nStallingSince == 0) {
                     State(staller)->nStallingSince = nNow;
@@ -5,6 +5,8 @@
 #ifndef BITCOIN_MEMUSAGE_H
 #define BITCOIN_MEMUSAGE_H
 
+#include "prevector.h"
+
 #include <stdlib.h>
 
 #include <map>
@@ -28,6 +30,7 @@ static size_t MallocUsage(size_t alloc);
  *  do the recursion themselves, or use more efficient caching + updating on modification.
  */
 template<typename X> static size_t DynamicUsage(const std::vector<X>& v);
+template<unsigned int N, typename X, typename S, typename D> static size_t DynamicUsage(const prevector<N, X, S, D>& v);
 template<typename X> static size_t DynamicUsage(const std::set<X>& s);
 template<typename X, typename Y> static size_t DynamicUsage(const std::map<X, Y>& m);
 template<typename X, typename Y> static size_t DynamicUsage(const boost::unordered_set<X, Y>& s);
@@ -65,6 +68,13 @@ static inline size_t DynamicUsage(const std::vector<X>& v)
     return MallocUsage(v.capacity() * sizeof(X));
 }
 
+template<unsigned int N, typename X, typename S, typename D>
+static inline size_t DynamicUsage(const prevector<N, X, S, D>& v)
+{
+    // Scripts that fit in the inline buffer own no heap memory at all.
+    return v.allocated_memory() ? MallocUsage(v.allocated_memory()) : 0;
+}
+
 template<typename X>
 static inline size_t DynamicUsage(const std::set<X>& s)
 {
@@ -21,6 +21,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -83,10 +84,10 @@ bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSerializedNetMsg> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
-limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
+CRequestTracker mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -622,23 +623,53 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializedNetMsg>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = **it;
+        size_t nToSend = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nToSend, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand as many queued messages as possible to the kernel in one call
+        struct iovec iov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nToSend = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSerializedNetMsg>::iterator jt = it; jt != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; jt++) {
+            const CSerializeData &data = **jt;
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = data.size() - nOffset;
+            nToSend += iov[nIov].iov_len;
+            nOffset = 0;
+            nIov++;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the messages that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nRemaining = (*it)->size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nToSend) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -1710,15 +1741,15 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
+    RelayTransaction(MakeTransactionRef(tx));
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransactionRef& ptx)
 {
+    const CTransaction& tx = *ptx;
     CInv inv(MSG_TX, tx.GetHash());
+    // Serialized once here, then shared by every peer that asks for it
+    CSerializedNetMsg msg = MakeNetMsg("tx", tx);
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
@@ -1728,8 +1759,8 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Keep the serialized transaction for answering getdata
+        mapRelay.insert(std::make_pair(inv, msg));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -1913,7 +1944,7 @@ unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) :
     ssSend(SER_NETWORK, INIT_PROTO_VERSION),
     addrKnown(5000, 0.001, insecure_rand()),
-    setInventoryKnown(SendBufferSize() / 1000)
+    filterInventoryKnown(SendBufferSize() / 1000, 0.000001, insecure_rand())
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -1975,18 +2006,61 @@ CNode::~CNode()
     GetNodeSignals().FinalizeNode(GetId());
 }
 
+CRequestTracker::CRequestTracker(size_t nMaxEntries) :
+    vEntries(std::max(nMaxEntries / BUCKET_SIZE, (size_t)1) * BUCKET_SIZE),
+    k0(GetRand(std::numeric_limits<uint64_t>::max())),
+    k1(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+    BOOST_FOREACH(Entry& entry, vEntries)
+        entry.nRequestTime = 0;
+}
+
+unsigned int CRequestTracker::GetBucket(const uint256& hash) const
+{
+    return (SipHashUint256(k0, k1, hash) % (vEntries.size() / BUCKET_SIZE)) * BUCKET_SIZE;
+}
+
+int64_t CRequestTracker::GetRequestTime(const uint256& hash) const
+{
+    const Entry* bucket = &vEntries[GetBucket(hash)];
+    for (unsigned int i = 0; i < BUCKET_SIZE; i++)
+        if (bucket[i].nRequestTime != 0 && bucket[i].hash == hash)
+            return bucket[i].nRequestTime;
+    return 0;
+}
+
+void CRequestTracker::SetRequestTime(const uint256& hash, int64_t nRequestTime)
+{
+    Entry* bucket = &vEntries[GetBucket(hash)];
+    // Reuse the item's own slot if it has one, otherwise the oldest (or an unused) one
+    Entry* slot = &bucket[0];
+    for (unsigned int i = 0; i < BUCKET_SIZE; i++) {
+        if (bucket[i].nRequestTime != 0 && bucket[i].hash == hash) {
+            slot = &bucket[i];
+            break;
+        }
+        if (bucket[i].nRequestTime < slot->nRequestTime)
+            slot = &bucket[i];
+    }
+    slot->hash = hash;
+    slot->nRequestTime = nRequestTime;
+}
+
+void CRequestTracker::Erase(const uint256& hash)
+{
+    Entry* bucket = &vEntries[GetBucket(hash)];
+    for (unsigned int i = 0; i < BUCKET_SIZE; i++)
+        if (bucket[i].nRequestTime != 0 && bucket[i].hash == hash)
+            bucket[i].nRequestTime = 0;
+}
+
 void CNode::AskFor(const CInv& inv)
 {
     if (mapAskFor.size() > MAPASKFOR_MAX_SZ)
         return;
     // We're using mapAskFor as a priority queue,
     // the key is the earliest time the request can be sent
-    int64_t nRequestTime;
-    limitedmap<CInv, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv);
-    if (it != mapAlreadyAskedFor.end())
-        nRequestTime = it->second;
-    else
-        nRequestTime = 0;
+    int64_t nRequestTime = mapAlreadyAskedFor.GetRequestTime(inv.hash);
     LogPrint("net", "askfor %s  %d (%s) peer=%d\n", inv.ToString(), nRequestTime, DateTimeStrFormat("%H:%M:%S", nRequestTime/1000000), id);
 
     // Make sure not to reuse time indexes to keep things in the same order
@@ -1998,10 +2072,7 @@ void CNode::AskFor(const CInv& inv)
 
     // Each retry is 2 minutes after the last
     nRequestTime = std::max(nRequestTime + 2 * 60 * 1000000, nNow);
-    if (it != mapAlreadyAskedFor.end())
-        mapAlreadyAskedFor.update(it, nRequestTime);
-    else
-        mapAlreadyAskedFor.insert(std::make_pair(inv, nRequestTime));
+    mapAlreadyAskedFor.SetRequestTime(inv.hash, nRequestTime);
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
@@ -2039,26 +2110,58 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     if (ssSend.size() == 0)
         return;
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+    CSerializedNetMsg msg = FinalizeNetMsg(ssSend);
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    LogPrint("net", "(%d bytes) peer=%d\n", msg->size() - CMessageHeader::HEADER_SIZE, id);
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
-
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
+
+void CNode::PushNetMsg(const CSerializedNetMsg& msg)
+{
+    LOCK(cs_vSend);
+    if (fDebug) {
+        const char* pchCommand = &(*msg)[MESSAGE_START_SIZE];
+        LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n",
+                 SanitizeString(std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE))),
+                 msg->size() - CMessageHeader::HEADER_SIZE, id);
+    }
+
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
+void BeginNetMsg(CDataStream& ss, const char* pszCommand)
+{
+    assert(ss.size() == 0);
+    ss << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+}
+
+CSerializedNetMsg FinalizeNetMsg(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    WriteLE32((uint8_t*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    boost::shared_ptr<CSerializeData> msg(new CSerializeData());
+    ss.GetAndClear(*msg);
+    return msg;
+}
@@ -9,9 +9,8 @@
 #include "bloom.h"
 #include "compat.h"
 #include "hash.h"
-#include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
+#include "primitives/transaction.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
@@ -28,6 +27,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -59,6 +59,8 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** The maximum number of queued messages handed to the kernel in one send call */
+static const int MAX_SEND_IOVECS = 64;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -79,6 +81,31 @@ void SocketSendData(CNode *pnode);
 
 typedef int NodeId;
 
+/**
+ * A complete network message (header and payload) that is never modified
+ * once built, so the same buffer can be queued on any number of nodes.
+ */
+typedef boost::shared_ptr<const CSerializeData> CSerializedNetMsg;
+
+/** Write the header for a message to be built with MakeNetMsg. */
+void BeginNetMsg(CDataStream& ss, const char* pszCommand);
+/** Fill in the size and checksum of a message started with BeginNetMsg and take its buffer. */
+CSerializedNetMsg FinalizeNetMsg(CDataStream& ss);
+
+/**
+ * Serialize a message once so that it can be sent to many peers with
+ * CNode::PushNetMsg. Only for payloads whose encoding does not depend on
+ * the peer's protocol version.
+ */
+template<typename T>
+CSerializedNetMsg MakeNetMsg(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    BeginNetMsg(ss, pszCommand);
+    ss << obj;
+    return FinalizeNetMsg(ss);
+}
+
 struct CombinerAll
 {
     typedef bool result_type;
@@ -144,10 +171,41 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializedNetMsg> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
-extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
+
+/**
+ * Remembers, for a bounded number of inventory items, when each was last
+ * requested from any peer, so that requests for the same item are spaced out.
+ * Items are hashed with a salted SipHash into small buckets stored in one
+ * flat array. A full bucket forgets its oldest request. Memory use is fixed
+ * and every operation costs a single bucket scan.
+ */
+class CRequestTracker
+{
+private:
+    struct Entry {
+        uint256 hash;
+        int64_t nRequestTime; //! 0 marks an unused slot
+    };
+    static const unsigned int BUCKET_SIZE = 4;
+
+    std::vector<Entry> vEntries;
+    uint64_t k0, k1;
+
+    unsigned int GetBucket(const uint256& hash) const;
+
+public:
+    CRequestTracker(size_t nMaxEntries);
+
+    /** The time of the last remembered request for hash, or 0. */
+    int64_t GetRequestTime(const uint256& hash) const;
+    void SetRequestTime(const uint256& hash, int64_t nRequestTime);
+    void Erase(const uint256& hash);
+};
+
+extern CRequestTracker mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
@@ -241,7 +299,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedNetMsg> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -306,7 +364,7 @@ public:
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -403,7 +461,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -411,7 +469,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -427,6 +485,9 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    /** Queue a message built with MakeNetMsg; the buffer is shared, not copied. */
+    void PushNetMsg(const CSerializedNetMsg& msg);
+
     void PushVersion();
 
 
@@ -622,9 +683,8 @@ public:
 
 
 
-class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransactionRef& ptx);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
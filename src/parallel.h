@@ -0,0 +1,41 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PARALLEL_H
+#define BITCOIN_PARALLEL_H
+
+#include <exception>
+
+#include <stddef.h>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+/**
+ * Run fn(i, nThreads) for every i below nThreads, each on a thread of its
+ * own, and wait for all of them. The work is usually split by stride, so
+ * the call for i takes items i, i + nThreads, i + 2 * nThreads and so on.
+ *
+ * Returns false if not all threads could be started. The threads that were
+ * started have finished by then, so the caller can still do the work itself,
+ * e.g. by calling fn(0, 1). Waiting cannot be interrupted, as the threads may
+ * use data on the caller's stack.
+ */
+inline bool RunOnThreads(size_t nThreads, const boost::function<void (size_t, size_t)>& fn)
+{
+    boost::this_thread::disable_interruption noInterrupt;
+    boost::thread_group threadGroup;
+    try {
+        for (size_t i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(fn, i, nThreads));
+    } catch (const std::exception&) {
+        threadGroup.join_all();
+        return false;
+    }
+    threadGroup.join_all();
+    return true;
+}
+
+#endif // BITCOIN_PARALLEL_H
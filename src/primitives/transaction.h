@@ -11,6 +11,8 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <boost/shared_ptr.hpp>
+
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
 class COutPoint
 {
@@ -256,6 +258,13 @@ public:
     std::string ToString() const;
 };
 
+/**
+ * A reference-counted immutable transaction, shared between the mempool and
+ * relay instead of copying (or re-serializing) the transaction for each.
+ */
+typedef boost::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef(const CTransaction& tx) { return CTransactionRef(new CTransaction(tx)); }
+
 /** A mutable version of CTransaction. */
 struct CMutableTransaction
 {
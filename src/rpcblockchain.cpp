@@ -3,14 +3,21 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "addressindex.h"
+#include "base58.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
+#include "clientversion.h"
 #include "consensus/validation.h"
 #include "core_io.h"
 #include "newyorkcoin.h"
 #include "main.h"
 #include "primitives/transaction.h"
 #include "rpcserver.h"
+#include "script/standard.h"
+#include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 
 #include <stdint.h>
@@ -353,40 +360,234 @@ Value getblock(const Array& params, bool fHelp)
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( full )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "These are kept up to date block by block; only the first call after an upgrade,\n"
+            "or a call with full set to true, takes some time.\n"
+            "\nArguments:\n"
+            "1. full    (boolean, optional, default=false) Also scan the whole set for bytes_serialized and hash_serialized\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
-            "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"muhash\": \"hash\",      (string) The order-independent rolling hash of the set\n"
+            "  \"bytes_serialized\": n,  (numeric, full only) The serialized size\n"
+            "  \"hash_serialized\": \"hash\",   (string, full only) The serialized hash\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "true")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    bool fFull = params.size() > 0 && params[0].get_bool();
+
     LOCK(cs_main);
 
     Object ret;
 
-    CCoinsStats stats;
-    FlushStateToDisk();
-    if (pcoinsTip->GetStats(stats)) {
-        ret.push_back(Pair("height", (int64_t)stats.nHeight));
-        ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
-        ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
-        ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+    CTxOutSetCommitment commitment;
+    if (!GetTxOutSetCommitment(commitment))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+
+    ret.push_back(Pair("height", (int64_t)mapBlockIndex.find(commitment.hashBlock)->second->nHeight));
+    ret.push_back(Pair("bestblock", commitment.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (int64_t)commitment.nTransactions));
+    ret.push_back(Pair("txouts", (int64_t)commitment.nTransactionOutputs));
+    ret.push_back(Pair("muhash", commitment.GetHash().GetHex()));
+    if (fFull) {
+        CCoinsStats stats;
+        FlushStateToDisk();
+        if (!pcoinsTip->GetStats(stats) || stats.hashBlock != commitment.hashBlock)
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
         ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
-        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    }
+    ret.push_back(Pair("total_amount", ValueFromAmount(commitment.nTotalAmount)));
+    return ret;
+}
+
+Value dumptxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"filename\"\n"
+            "\nWrites the unspent transaction output set to a snapshot file that can be\n"
+            "loaded with -loadtxoutset. Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"filename\"    (string, required) The file to write the snapshot to\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\":n,     (numeric) The block height of the snapshot\n"
+            "  \"bestblock\": \"hex\",   (string) the hash of the snapshot's block\n"
+            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"txouts\": n,            (numeric) The number of output transactions\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash, as reported by gettxoutsetinfo true\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    string strFile = params[0].get_str();
+
+    LOCK(cs_main);
+
+    FlushStateToDisk();
+    CAutoFile fileout(fopen(strFile.c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open " + strFile + " for writing");
+    CCoinsStats stats;
+    if (!pcoinsdbview->DumpSnapshot(fileout, stats))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Failed to write the UTXO set snapshot");
+
+    Object ret;
+    BlockMap::iterator mi = mapBlockIndex.find(stats.hashBlock);
+    ret.push_back(Pair("height", mi == mapBlockIndex.end() ? -1 : (int64_t)mi->second->nHeight));
+    ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
+    ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+    ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+    return ret;
+}
+
+/** Default and maximum number of entries returned by the address index calls */
+static const int DEFAULT_ADDRESSINDEX_COUNT = 1000;
+static const int MAX_ADDRESSINDEX_COUNT = 10000;
+
+/** Parse an address or a scripthash, and check the address index can answer for it. */
+static uint256 ParseAddressIndexScript(const Value& v)
+{
+    if (!paddressindex)
+        throw JSONRPCError(RPC_MISC_ERROR, "The address index is not enabled; restart with -addressindex");
+    if (!paddressindex->IsSynced())
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("The address index is still being built (at height %d)", paddressindex->GetBestHeight()));
+
+    CBitcoinAddress address(v.get_str());
+    if (address.IsValid())
+        return GetScriptHash(GetScriptForDestination(address.Get()));
+    return ParseHashV(v, "address or scripthash");
+}
+
+static size_t ParseAddressIndexCount(const Array& params, size_t nParam)
+{
+    int nCount = params.size() > nParam ? params[nParam].get_int() : DEFAULT_ADDRESSINDEX_COUNT;
+    if (nCount < 0 || nCount > MAX_ADDRESSINDEX_COUNT)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("count must be between 0 and %d", MAX_ADDRESSINDEX_COUNT));
+    return nCount;
+}
+
+Value getaddresshistory(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 4)
+        throw runtime_error(
+            "getaddresshistory \"address\" ( fromheight skip count )\n"
+            "\nReturns the outputs paying to an address or script and the inputs spending them,\n"
+            "in block order. Requires -addressindex.\n"
+            "\nArguments:\n"
+            "1. \"address\"     (string, required) The address, or the scripthash (SHA256 of the scriptPubKey, byte-reversed hex)\n"
+            "2. fromheight    (numeric, optional, default=0) Start at this block height\n"
+            "3. skip          (numeric, optional, default=0) Skip this many entries from fromheight on\n"
+            "4. count         (numeric, optional, default=" + strprintf("%d", DEFAULT_ADDRESSINDEX_COUNT) + ") Return at most this many entries (max " + strprintf("%d", MAX_ADDRESSINDEX_COUNT) + ")\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"txid\" : \"id\",         (string) The transaction id\n"
+            "    \"height\" : n,          (numeric) The height of the block it is in\n"
+            "    \"spending\" : true|false, (boolean) Whether an input spends from the script, or an output pays to it\n"
+            "    \"index\" : n,           (numeric) The input index when spending, the output index otherwise\n"
+            "    \"amount\" : x.xxx,      (numeric) The value in doge, negative when spending\n"
+            "    \"prevtxid\" : \"id\",     (string) When spending, the transaction of the output spent\n"
+            "    \"prevvout\" : n,        (numeric) When spending, the index of the output spent\n"
+            "    \"prevheight\" : n       (numeric) When spending, the height of the output spent\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresshistory", "\"DTaXouBvXCDfViRZzSCaVNQBAyt1D9zThT\" 100000 0 500")
+            + HelpExampleRpc("getaddresshistory", "\"DTaXouBvXCDfViRZzSCaVNQBAyt1D9zThT\", 100000, 0, 500")
+        );
+
+    uint256 hashScript = ParseAddressIndexScript(params[0]);
+    int nFromHeight = params.size() > 1 ? params[1].get_int() : 0;
+    int nSkip = params.size() > 2 ? params[2].get_int() : 0;
+    if (nFromHeight < 0 || nSkip < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "fromheight and skip must not be negative");
+    size_t nCount = ParseAddressIndexCount(params, 3);
+
+    vector<CAddressHistoryEntry> vEntries;
+    if (!paddressindex->GetDB().ReadHistory(hashScript, nFromHeight, nSkip, nCount, vEntries))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+
+    Array ret;
+    BOOST_FOREACH(const CAddressHistoryEntry& entry, vEntries) {
+        Object obj;
+        obj.push_back(Pair("txid", entry.first.txid.GetHex()));
+        obj.push_back(Pair("height", entry.first.nHeight));
+        obj.push_back(Pair("spending", entry.first.fSpending));
+        obj.push_back(Pair("index", (int64_t)entry.first.nIndex));
+        obj.push_back(Pair("amount", ValueFromAmount(entry.second.nValue)));
+        if (entry.first.fSpending) {
+            obj.push_back(Pair("prevtxid", entry.second.prevout.hash.GetHex()));
+            obj.push_back(Pair("prevvout", (int64_t)entry.second.prevout.n));
+            obj.push_back(Pair("prevheight", entry.second.nPrevHeight));
+        }
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddressutxos \"address\" ( skip count )\n"
+            "\nReturns the unspent outputs paying to an address or script, as of the last block\n"
+            "in the address index. Requires -addressindex.\n"
+            "\nArguments:\n"
+            "1. \"address\"     (string, required) The address, or the scripthash (SHA256 of the scriptPubKey, byte-reversed hex)\n"
+            "2. skip          (numeric, optional, default=0) Skip this many outputs\n"
+            "3. count         (numeric, optional, default=" + strprintf("%d", DEFAULT_ADDRESSINDEX_COUNT) + ") Return at most this many outputs (max " + strprintf("%d", MAX_ADDRESSINDEX_COUNT) + ")\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"txid\" : \"id\",         (string) The transaction id\n"
+            "    \"vout\" : n,            (numeric) The output index\n"
+            "    \"amount\" : x.xxx,      (numeric) The value in doge\n"
+            "    \"scriptPubKey\" : \"hex\", (string) The output script\n"
+            "    \"height\" : n           (numeric) The height of the block it is in\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressutxos", "\"DTaXouBvXCDfViRZzSCaVNQBAyt1D9zThT\"")
+            + HelpExampleRpc("getaddressutxos", "\"DTaXouBvXCDfViRZzSCaVNQBAyt1D9zThT\", 0, 100")
+        );
+
+    uint256 hashScript = ParseAddressIndexScript(params[0]);
+    int nSkip = params.size() > 1 ? params[1].get_int() : 0;
+    if (nSkip < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "skip must not be negative");
+    size_t nCount = ParseAddressIndexCount(params, 2);
+
+    vector<CAddressUnspentEntry> vEntries;
+    if (!paddressindex->GetDB().ReadUnspentOutputs(hashScript, nSkip, nCount, vEntries))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+
+    Array ret;
+    BOOST_FOREACH(const CAddressUnspentEntry& entry, vEntries) {
+        Object obj;
+        obj.push_back(Pair("txid", entry.first.outpoint.hash.GetHex()));
+        obj.push_back(Pair("vout", (int64_t)entry.first.outpoint.n));
+        obj.push_back(Pair("amount", ValueFromAmount(entry.second.nValue)));
+        obj.push_back(Pair("scriptPubKey", HexStr(entry.second.scriptPubKey.begin(), entry.second.scriptPubKey.end())));
+        obj.push_back(Pair("height", entry.second.nHeight));
+        ret.push_back(obj);
     }
     return ret;
 }
@@ -513,6 +714,7 @@ Value getblockchaininfo(const Array& params, bool fHelp)
             "  \"bestblockhash\": \"...\", (string) the hash of the currently best block\n"
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
+            "  \"assumevalid\": true|false, (boolean) whether the scripts of the last connected block were assumed valid (-assumevalid)\n"
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
             "}\n"
             "\nExamples:\n"
@@ -529,6 +731,7 @@ Value getblockchaininfo(const Array& params, bool fHelp)
     obj.push_back(Pair("bestblockhash",         chainActive.Tip()->GetBlockHash().GetHex()));
     obj.push_back(Pair("difficulty",            (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress",  Checkpoints::GuessVerificationProgress(Params().Checkpoints(), chainActive.Tip())));
+    obj.push_back(Pair("assumevalid",           fSkippedScriptChecks));
     obj.push_back(Pair("chainwork",             chainActive.Tip()->nChainWork.GetHex()));
     obj.push_back(Pair("pruned",                fPruneMode));
     if (fPruneMode)
@@ -670,6 +873,46 @@ Value getmempoolinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getscriptcheckinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getscriptcheckinfo\n"
+            "\nReturns utilization counters of the parallel script verification workers.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"worker\": n,             (numeric) Worker index, 0 is the thread connecting the block\n"
+            "    \"checks\": n,             (numeric) Number of script checks executed\n"
+            "    \"batches\": n,            (numeric) Number of batches executed\n"
+            "    \"stolen\": n,             (numeric) Number of checks taken from other workers\n"
+            "    \"sleeps\": n,             (numeric) Number of times the worker ran out of work\n"
+            "    \"busytime\": n            (numeric) Time spent executing checks, in microseconds\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getscriptcheckinfo", "")
+            + HelpExampleRpc("getscriptcheckinfo", "")
+        );
+
+    std::vector<CCheckQueueWorkerStats> vStats;
+    GetScriptCheckStats(vStats);
+
+    Array ret;
+    for (unsigned int i = 0; i < vStats.size(); i++) {
+        Object obj;
+        obj.push_back(Pair("worker", (int)i));
+        obj.push_back(Pair("checks", (uint64_t)vStats[i].nChecks));
+        obj.push_back(Pair("batches", (uint64_t)vStats[i].nBatches));
+        obj.push_back(Pair("stolen", (uint64_t)vStats[i].nStolen));
+        obj.push_back(Pair("sleeps", (uint64_t)vStats[i].nSleeps));
+        obj.push_back(Pair("busytime", vStats[i].nBusyMicros));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 Value invalidateblock(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
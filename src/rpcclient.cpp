@@ -83,6 +83,14 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "lockunspent", 1 },
     { "importprivkey", 2 },
     { "importaddress", 2 },
+    { "rescanblockchain", 0 },
+    { "rescanblockchain", 1 },
+    { "gettxoutsetinfo", 0 },
+    { "getaddresshistory", 1 },
+    { "getaddresshistory", 2 },
+    { "getaddresshistory", 3 },
+    { "getaddressutxos", 1 },
+    { "getaddressutxos", 2 },
     { "verifychain", 0 },
     { "verifychain", 1 },
     { "keypoolrefill", 0 },
@@ -6,6 +6,7 @@
 #include "amount.h"
 #include "chainparams.h"
 #include "consensus/consensus.h"
+#include "consensus/merkle.h"
 #include "consensus/validation.h"
 #include "core_io.h"
 #include "newyorkcoin.h"
@@ -822,7 +823,7 @@ Value getauxblockbip22(const Array& params, bool fHelp)
             CBlock* pblock = &pblocktemplate->block;
             IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
             pblock->nVersion.SetAuxpow(true);
-            pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+            pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 
             // Save
             mapNewBlock[pblock->GetHash()] = pblock;
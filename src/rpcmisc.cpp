@@ -10,6 +10,7 @@
 #include "net.h"
 #include "netbase.h"
 #include "rpcserver.h"
+#include "support/lockedpool.h"
 #include "timedata.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
@@ -395,3 +396,39 @@ Value setmocktime(const Array& params, bool fHelp)
 
     return Value::null;
 }
+
+Value getmemoryinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmemoryinfo\n"
+            "Returns an object containing information about memory usage.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"locked\": {               (json object) Information about locked memory manager\n"
+            "    \"used\": xxxxx,          (numeric) Number of bytes used\n"
+            "    \"free\": xxxxx,          (numeric) Number of bytes available in current arenas\n"
+            "    \"total\": xxxxxxx,       (numeric) Total number of bytes managed\n"
+            "    \"locked\": xxxxxx,       (numeric) Amount of bytes that succeeded locking. If this number is smaller than total, locking pages failed at some point and key data could be swapped to disk.\n"
+            "    \"chunks_used\": xxxxx,   (numeric) Number allocated chunks\n"
+            "    \"chunks_free\": xxxxx,   (numeric) Number unused chunks\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmemoryinfo", "")
+            + HelpExampleRpc("getmemoryinfo", "")
+        );
+
+    LockedPool::Stats stats = LockedPoolManager::Instance().stats();
+    Object locked;
+    locked.push_back(Pair("used", (uint64_t)stats.used));
+    locked.push_back(Pair("free", (uint64_t)stats.free));
+    locked.push_back(Pair("total", (uint64_t)stats.total));
+    locked.push_back(Pair("locked", (uint64_t)stats.locked));
+    locked.push_back(Pair("chunks_used", (uint64_t)stats.chunks_used));
+    locked.push_back(Pair("chunks_free", (uint64_t)stats.chunks_free));
+
+    Object obj;
+    obj.push_back(Pair("locked", locked));
+    return obj;
+}
@@ -106,7 +106,12 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"inflight_limit\": n,      (numeric) How many blocks may be in flight from this peer, sized to its download speed\n"
+            "    \"blocks_downloaded\": n,   (numeric) The number of requested blocks received from this peer\n"
+            "    \"bytes_downloaded\": n,    (numeric) The total size of those blocks\n"
+            "    \"block_latency\": n,       (numeric) Average time in seconds between requesting a block and receiving it (if known)\n"
+            "    \"block_speed\": n          (numeric) Measured block download speed in bytes per second (if known)\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -156,6 +161,13 @@ Value getpeerinfo(const Array& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("inflight_limit", statestats.nBlocksInTransitLimit));
+            obj.push_back(Pair("blocks_downloaded", statestats.nBlocksDownloaded));
+            obj.push_back(Pair("bytes_downloaded", statestats.nBytesDownloaded));
+            if (statestats.nBlockLatency > 0)
+                obj.push_back(Pair("block_latency", statestats.nBlockLatency * 0.000001));
+            if (statestats.nBlockBytesPerSec > 0)
+                obj.push_back(Pair("block_speed", statestats.nBlockBytesPerSec));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
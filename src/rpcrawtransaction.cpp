@@ -17,6 +17,7 @@
 #include "script/script_error.h"
 #include "script/sign.h"
 #include "script/standard.h"
+#include "txindex.h"
 #include "uint256.h"
 #ifdef ENABLE_WALLET
 #include "wallet/wallet.h"
@@ -182,8 +183,11 @@ Value getrawtransaction(const Array& params, bool fHelp)
 
     CTransaction tx;
     uint256 hashBlock;
-    if (!GetTransaction(hash, tx, hashBlock, true))
+    if (!GetTransaction(hash, tx, hashBlock, true)) {
+        if (ptxindex && !ptxindex->IsSynced())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available about transaction; the transaction index is still being built");
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available about transaction");
+    }
 
     string strHex = EncodeHexTx(tx);
 
@@ -709,20 +713,30 @@ Value signrawtransaction(const Array& params, bool fHelp)
     // Script verification errors
     Array vErrors;
 
-    // Sign what we can:
+    // Sign what we can, all inputs at once:
+    vector<const CScript*> vpPrevPubKeys(mergedTx.vin.size(), (const CScript*)NULL);
+    vector<const CScript*> vpSignPubKeys(mergedTx.vin.size(), (const CScript*)NULL);
     for (unsigned int i = 0; i < mergedTx.vin.size(); i++) {
         CTxIn& txin = mergedTx.vin[i];
         const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-        if (coins == NULL || !coins->IsAvailable(txin.prevout.n)) {
-            TxInErrorToJSON(txin, vErrors, "Input not found or already spent");
+        if (coins == NULL || !coins->IsAvailable(txin.prevout.n))
             continue;
-        }
-        const CScript& prevPubKey = coins->vout[txin.prevout.n].scriptPubKey;
+        vpPrevPubKeys[i] = &coins->vout[txin.prevout.n].scriptPubKey;
 
         txin.scriptSig.clear();
         // Only sign SIGHASH_SINGLE if there's a corresponding output:
         if (!fHashSingle || (i < mergedTx.vout.size()))
-            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType);
+            vpSignPubKeys[i] = vpPrevPubKeys[i];
+    }
+    SignSignatures(keystore, vpSignPubKeys, mergedTx, nHashType);
+
+    for (unsigned int i = 0; i < mergedTx.vin.size(); i++) {
+        CTxIn& txin = mergedTx.vin[i];
+        if (vpPrevPubKeys[i] == NULL) {
+            TxInErrorToJSON(txin, vErrors, "Input not found or already spent");
+            continue;
+        }
+        const CScript& prevPubKey = *vpPrevPubKeys[i];
 
         // ... and merge in other signatures:
         BOOST_FOREACH(const CMutableTransaction& txv, txVariants) {
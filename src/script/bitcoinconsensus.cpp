@@ -5,12 +5,27 @@
 
 #include "bitcoinconsensus.h"
 
+#include "parallel.h"
 #include "primitives/transaction.h"
 #include "script/interpreter.h"
 #include "version.h"
 
+#include <algorithm>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <openssl/crypto.h>
+
 namespace {
 
+/** Transactions with fewer inputs than this are verified on the calling thread */
+const unsigned int VERIFY_PARALLEL_MIN_INPUTS = 16;
+
+/** Marks an input no thread has got to yet */
+const int VERIFY_PENDING = -1;
+
 /** A class that deserializes a single CTransaction one time. */
 class TxInputStream
 {
@@ -60,6 +75,46 @@ inline int set_error(bitcoinconsensus_error* ret, bitcoinconsensus_error serror)
     return 0;
 }
 
+/** A deserialized transaction, the outputs it spends, and what sighash work they share. */
+struct BatchVerifyData
+{
+    const CTransaction* ptx;
+    const PrecomputedTransactionData* ptxdata;
+    const unsigned char * const *scriptPubKeys;
+    const unsigned int *scriptPubKeyLens;
+    unsigned int flags;
+};
+
+void VerifyInputs(const BatchVerifyData* pdata, std::vector<int>* pvResults, size_t nStart, size_t nStep)
+{
+    for (size_t i = nStart; i < pvResults->size(); i += nStep)
+    {
+        if ((*pvResults)[i] != VERIFY_PENDING)
+            continue;
+        try {
+            const CScript scriptPubKey(pdata->scriptPubKeys[i], pdata->scriptPubKeys[i] + pdata->scriptPubKeyLens[i]);
+            (*pvResults)[i] = VerifyScript(pdata->ptx->vin[i].scriptSig, scriptPubKey, pdata->flags,
+                                           TransactionSignatureChecker(pdata->ptx, i, pdata->ptxdata), NULL);
+        } catch (const std::exception&) {
+            (*pvResults)[i] = 0;
+        }
+    }
+}
+
+/**
+ * Whether signatures may be checked on several threads by default. OpenSSL
+ * before 1.1 is only safe to use from several threads once the application
+ * has installed its locking callbacks.
+ */
+bool CanVerifyInParallel()
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    return CRYPTO_get_locking_callback() != NULL;
+#else
+    return true;
+#endif
+}
+
 } // anon namespace
 
 int bitcoinconsensus_verify_script(const unsigned char *scriptPubKey, unsigned int scriptPubKeyLen,
@@ -84,6 +139,45 @@ int bitcoinconsensus_verify_script(const unsigned char *scriptPubKey, unsigned i
     }
 }
 
+int bitcoinconsensus_verify_script_batch(const unsigned char * const *scriptPubKeys, const unsigned int *scriptPubKeyLens,
+                                    unsigned int nSpentOutputs,
+                                    const unsigned char *txTo        , unsigned int txToLen,
+                                    unsigned int flags, unsigned int nThreads,
+                                    int *results, bitcoinconsensus_error* err)
+{
+    try {
+        TxInputStream stream(SER_NETWORK, PROTOCOL_VERSION, txTo, txToLen);
+        CTransaction tx;
+        stream >> tx;
+        if (nSpentOutputs != tx.vin.size())
+            return set_error(err, bitcoinconsensus_ERR_SPENT_OUTPUTS_MISMATCH);
+        if (tx.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION) != txToLen)
+            return set_error(err, bitcoinconsensus_ERR_TX_SIZE_MISMATCH);
+
+        const PrecomputedTransactionData txdata(tx);
+        BatchVerifyData data = { &tx, &txdata, scriptPubKeys, scriptPubKeyLens, flags };
+        std::vector<int> vResults(tx.vin.size(), VERIFY_PENDING);
+
+        if (nThreads == 0)
+            nThreads = CanVerifyInParallel() ? std::max(boost::thread::hardware_concurrency(), 1U) : 1;
+        nThreads = std::min(nThreads, nSpentOutputs);
+        // If the threads cannot all be started, the inputs they did not get
+        // to are checked here
+        if (nThreads <= 1 || nSpentOutputs < VERIFY_PARALLEL_MIN_INPUTS ||
+            !RunOnThreads(nThreads, boost::bind(&VerifyInputs, &data, &vResults, _1, _2)))
+            VerifyInputs(&data, &vResults, 0, 1);
+
+        // Regardless of the verification result, the tx did not error.
+        set_error(err, bitcoinconsensus_ERR_OK);
+
+        if (results)
+            std::copy(vResults.begin(), vResults.end(), results);
+        return std::find(vResults.begin(), vResults.end(), 0) == vResults.end();
+    } catch (const std::exception&) {
+        return set_error(err, bitcoinconsensus_ERR_TX_DESERIALIZE); // Error deserializing
+    }
+}
+
 unsigned int bitcoinconsensus_version()
 {
     // Just use the API version for now
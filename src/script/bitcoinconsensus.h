@@ -31,7 +31,7 @@
 extern "C" {
 #endif
 
-#define BITCOINCONSENSUS_API_VER 0
+#define BITCOINCONSENSUS_API_VER 1
 
 typedef enum bitcoinconsensus_error_t
 {
@@ -39,6 +39,7 @@ typedef enum bitcoinconsensus_error_t
     bitcoinconsensus_ERR_TX_INDEX,
     bitcoinconsensus_ERR_TX_SIZE_MISMATCH,
     bitcoinconsensus_ERR_TX_DESERIALIZE,
+    bitcoinconsensus_ERR_SPENT_OUTPUTS_MISMATCH,
 } bitcoinconsensus_error;
 
 /** Script verification flags */
@@ -57,6 +58,26 @@ EXPORT_SYMBOL int bitcoinconsensus_verify_script(const unsigned char *scriptPubK
                                     const unsigned char *txTo        , unsigned int txToLen,
                                     unsigned int nIn, unsigned int flags, bitcoinconsensus_error* err);
 
+/// Returns 1 if every input of the serialized transaction pointed to by txTo
+/// correctly spends its output under the additional constraints specified by
+/// flags: input i spends the scriptPubKey pointed to by scriptPubKeys[i], of
+/// scriptPubKeyLens[i] bytes, and nSpentOutputs must equal the number of
+/// inputs. The transaction is deserialized once, the signature hash work
+/// shared by its inputs is done once, and the inputs are checked on up to
+/// nThreads threads (0 for one per core). Transactions with fewer than 16
+/// inputs are checked on the calling thread. With OpenSSL older than 1.1 the
+/// caller must have installed its locking callbacks to use more than one;
+/// without them, 0 means the calling thread only. Inputs that no thread could
+/// be started for are checked on the calling thread.
+/// If not NULL, results must hold nSpentOutputs entries and will contain 1 or
+/// 0 for each input.
+/// If not NULL, err will contain an error/success code for the operation
+EXPORT_SYMBOL int bitcoinconsensus_verify_script_batch(const unsigned char * const *scriptPubKeys, const unsigned int *scriptPubKeyLens,
+                                    unsigned int nSpentOutputs,
+                                    const unsigned char *txTo        , unsigned int txToLen,
+                                    unsigned int flags, unsigned int nThreads,
+                                    int *results, bitcoinconsensus_error* err);
+
 EXPORT_SYMBOL unsigned int bitcoinconsensus_version();
 
 #ifdef __cplusplus
@@ -1031,9 +1031,55 @@ public:
     }
 };
 
+/** Stream that appends serialized data to a byte vector. */
+class CByteVectorWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+
+public:
+    CByteVectorWriter(std::vector<unsigned char>& vchIn) : vch(vchIn) {}
+
+    CByteVectorWriter& write(const char* pch, size_t nSize)
+    {
+        vch.insert(vch.end(), (const unsigned char*)pch, (const unsigned char*)pch + nSize);
+        return (*this);
+    }
+
+    template<typename T>
+    CByteVectorWriter& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj, SER_GETHASH, 0);
+        return (*this);
+    }
+};
+
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
+{
+    // Signing an out of range input blanks the scripts of all inputs
+    const CScript scriptEmpty;
+    CTransactionSignatureSerializer txBlank(txTo, scriptEmpty, txTo.vin.size(), SIGHASH_ALL);
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+
+    CByteVectorWriter ssSuffix(vSuffix);
+    vPrefix.reserve(txTo.vin.size());
+    vInputOffset.reserve(txTo.vin.size() + 1);
+    for (unsigned int nInput = 0; nInput < txTo.vin.size(); nInput++) {
+        vPrefix.push_back(ss);
+        vInputOffset.push_back(vSuffix.size());
+        txBlank.SerializeInput(ssSuffix, nInput, SER_GETHASH, 0);
+        ss.write((const char*)&vSuffix[vInputOffset.back()], vSuffix.size() - vInputOffset.back());
+    }
+    vInputOffset.push_back(vSuffix.size());
+    ssSuffix << txTo.vout << txTo.nLockTime;
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata)
 {
     static const uint256 one(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
     if (nIn >= txTo.vin.size()) {
@@ -1052,6 +1098,18 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    if (txdata && txdata->vPrefix.size() == txTo.vin.size() && !(nHashType & SIGHASH_ANYONECANPAY) &&
+        (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        // Resume from the hash state after the inputs in front of ours, and
+        // append the shared serialization of everything after it.
+        CHashWriter ss(txdata->vPrefix[nIn]);
+        txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+        const unsigned int nOffset = txdata->vInputOffset[nIn + 1];
+        ss.write((const char*)&txdata->vSuffix[nOffset], txdata->vSuffix.size() - nOffset);
+        ss << nHashType;
+        return ss.GetHash();
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1076,7 +1134,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, txdata);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
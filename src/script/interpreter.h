@@ -6,6 +6,7 @@
 #ifndef BITCOIN_SCRIPT_INTERPRETER_H
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
+#include "hash.h"
 #include "script_error.h"
 #include "primitives/transaction.h"
 
@@ -78,7 +79,27 @@ enum
     SCRIPT_VERIFY_CLEANSTACK = (1U << 8),
 };
 
-uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/**
+ * Serialization work that is shared by the signature hashes of all inputs of a
+ * transaction. For SIGHASH_ALL, the serialization hashed for input i only
+ * differs from that of other inputs in input i itself, so this keeps the hash
+ * state after every prefix of blanked inputs, and the serialized remainder of
+ * the transaction. A default-constructed object caches nothing.
+ */
+struct PrecomputedTransactionData
+{
+    //! Hash state after nVersion, the input count and blanked inputs [0, i), for every input i
+    std::vector<CHashWriter> vPrefix;
+    //! Blanked inputs, followed by the outputs and nLockTime
+    std::vector<unsigned char> vSuffix;
+    //! Offset in vSuffix at which each blanked input starts; the last entry is where the outputs start
+    std::vector<unsigned int> vInputOffset;
+
+    PrecomputedTransactionData() {}
+    explicit PrecomputedTransactionData(const CTransaction& txTo);
+};
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata = NULL);
 
 class BaseSignatureChecker
 {
@@ -96,12 +117,13 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const PrecomputedTransactionData* txdata;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const PrecomputedTransactionData* txdataIn = NULL) : txTo(txToIn), nIn(nInIn), txdata(txdataIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
 };
 
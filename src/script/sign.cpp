@@ -8,15 +8,27 @@
 #include "primitives/transaction.h"
 #include "key.h"
 #include "keystore.h"
+#include "parallel.h"
 #include "script/standard.h"
 #include "uint256.h"
 
+#include <algorithm>
+
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
 typedef vector<unsigned char> valtype;
 
+/** Fewer inputs than this are signed on the calling thread */
+static const unsigned int SIGN_PARALLEL_MIN_INPUTS = 16;
+/** Maximum number of threads a single transaction is signed on */
+static const unsigned int MAX_SIGN_THREADS = 8;
+/** Marks an input in SignSignatures that no thread has got to yet */
+static const unsigned char SIGN_PENDING = 2;
+
 TransactionSignatureCreator::TransactionSignatureCreator(const CKeyStore* keystoreIn, const CTransaction* txToIn, unsigned int nInIn, int nHashTypeIn) : BaseSignatureCreator(keystoreIn), txTo(txToIn), nIn(nInIn), nHashType(nHashTypeIn), checker(txTo, nIn) {}
 
 bool TransactionSignatureCreator::CreateSig(std::vector<unsigned char>& vchSig, const CKeyID& address, const CScript& scriptCode) const
@@ -117,7 +129,7 @@ bool ProduceSignature(const BaseSignatureCreator& creator, const CScript& fromPu
         bool fSolved =
             SignStep(creator, subscript, scriptSig, subType) && subType != TX_SCRIPTHASH;
         // Append serialized subscript whether or not it is completely signed:
-        scriptSig << static_cast<valtype>(subscript);
+        scriptSig << ToByteVector(subscript);
         if (!fSolved) return false;
     }
 
@@ -146,6 +158,51 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CMutab
     return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
 }
 
+namespace {
+
+void SignInputs(const CKeyStore* pkeystore, const vector<const CScript*>* pvpFromPubKeys, const CTransaction* ptxConst,
+                CMutableTransaction* ptxTo, int nHashType, vector<unsigned char>* pvfSolved, size_t nStart, size_t nStep)
+{
+    for (size_t i = nStart; i < pvpFromPubKeys->size(); i += nStep)
+    {
+        if ((*pvfSolved)[i] != SIGN_PENDING)
+            continue;
+        const CScript* pscriptPubKey = (*pvpFromPubKeys)[i];
+        if (pscriptPubKey == NULL)
+        {
+            (*pvfSolved)[i] = true;
+            continue;
+        }
+        try {
+            TransactionSignatureCreator creator(pkeystore, ptxConst, i, nHashType);
+            (*pvfSolved)[i] = ProduceSignature(creator, *pscriptPubKey, ptxTo->vin[i].scriptSig);
+        } catch (...) {
+            (*pvfSolved)[i] = false;
+        }
+    }
+}
+
+}
+
+bool SignSignatures(const CKeyStore &keystore, const vector<const CScript*>& vpFromPubKeys, CMutableTransaction& txTo, int nHashType)
+{
+    assert(vpFromPubKeys.size() == txTo.vin.size());
+
+    // Other inputs' scriptSigs are not covered by the signature hash, so
+    // the inputs can be signed in any order against the same copy.
+    const CTransaction txToConst(txTo);
+    vector<unsigned char> vfSolved(txTo.vin.size(), SIGN_PENDING);
+
+    // If the threads cannot all be started, the inputs they did not get to
+    // are signed here
+    size_t nThreads = std::min((size_t)std::max(boost::thread::hardware_concurrency(), 1U), (size_t)MAX_SIGN_THREADS);
+    if (nThreads <= 1 || txTo.vin.size() < SIGN_PARALLEL_MIN_INPUTS ||
+        !RunOnThreads(nThreads, boost::bind(&SignInputs, &keystore, &vpFromPubKeys, &txToConst, &txTo, nHashType, &vfSolved, _1, _2)))
+        SignInputs(&keystore, &vpFromPubKeys, &txToConst, &txTo, nHashType, &vfSolved, 0, 1);
+
+    return std::find(vfSolved.begin(), vfSolved.end(), false) == vfSolved.end();
+}
+
 static CScript PushAll(const vector<valtype>& values)
 {
     CScript result;
@@ -50,6 +50,14 @@ bool ProduceSignature(const BaseSignatureCreator& creator, const CScript& script
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CMutableTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 
+/**
+ * Produce script signatures for the inputs of a transaction, input i spending
+ * *vpFromPubKeys[i]; inputs with a NULL entry are left alone. All inputs are
+ * signed against one copy of the transaction, and large transactions are
+ * signed on several threads. Returns whether every input given was solved.
+ */
+bool SignSignatures(const CKeyStore& keystore, const std::vector<const CScript*>& vpFromPubKeys, CMutableTransaction& txTo, int nHashType=SIGHASH_ALL);
+
 /** Combine two script signatures using a generic signature checker, intelligently, possibly with OP_0 placeholders. */
 CScript CombineSignatures(const CScript& scriptPubKey, const BaseSignatureChecker& checker, const CScript& scriptSig1, const CScript& scriptSig2);
 
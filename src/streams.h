@@ -292,9 +292,13 @@ public:
         return (*this);
     }
 
+    /** Hand the unread contents over to data, replacing what it held, without copying them. */
     void GetAndClear(CSerializeData &data) {
-        data.insert(data.end(), begin(), end());
-        clear();
+        if (nReadPos != 0)
+            vch.erase(vch.begin(), vch.begin() + nReadPos);
+        nReadPos = 0;
+        data.swap(vch);
+        vch.clear();
     }
 };
 
@@ -0,0 +1,409 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "support/lockedpool.h"
+#include "support/cleanse.h"
+#include "util.h"
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#ifdef WIN32
+#ifdef _WIN32_WINNT
+#undef _WIN32_WINNT
+#endif
+#define _WIN32_WINNT 0x0501
+#define WIN32_LEAN_AND_MEAN 1
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h> // for mmap
+#include <sys/resource.h> // for getrlimit
+#include <limits.h> // for PAGESIZE
+#include <unistd.h> // for sysconf
+#endif
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+LockedPoolManager* LockedPoolManager::_instance = NULL;
+boost::once_flag LockedPoolManager::init_flag = BOOST_ONCE_INIT;
+
+/*******************************************************************************/
+// Utilities
+//
+/** Align up to power of 2 */
+static inline size_t align_up(size_t x, size_t align)
+{
+    return (x + align - 1) & ~(align - 1);
+}
+
+/*******************************************************************************/
+// Implementation: Arena
+
+Arena::Arena(void* base_in, size_t size_in, size_t alignment_in) :
+    base(static_cast<char*>(base_in)), end(static_cast<char*>(base_in) + size_in), alignment(alignment_in)
+{
+    // Start with one free chunk that covers the entire arena
+    SizeToChunkSortedMap::iterator it = size_to_free_chunk.insert(std::make_pair(size_in, base));
+    chunks_free.insert(std::make_pair(base, it));
+    chunks_free_end.insert(std::make_pair(base + size_in, it));
+}
+
+Arena::~Arena()
+{
+}
+
+void* Arena::alloc(size_t size)
+{
+    // Round to next multiple of alignment
+    size = align_up(size, alignment);
+
+    // Don't handle zero-sized chunks
+    if (size == 0)
+        return NULL;
+
+    // Pick the smallest free chunk that fits
+    SizeToChunkSortedMap::iterator size_ptr_it = size_to_free_chunk.lower_bound(size);
+    if (size_ptr_it == size_to_free_chunk.end())
+        return NULL;
+
+    // Create the used-chunk, taking its space from the end of the free-chunk
+    const size_t size_remaining = size_ptr_it->first - size;
+    char* const chunk_base = size_ptr_it->second;
+    char* const allocated = chunk_base + size_remaining;
+    chunks_used.insert(std::make_pair(allocated, size));
+    chunks_free_end.erase(chunk_base + size_ptr_it->first);
+    if (size_remaining == 0) {
+        // whole chunk is used up
+        chunks_free.erase(chunk_base);
+    } else {
+        // still some memory left in the chunk
+        SizeToChunkSortedMap::iterator it_remaining = size_to_free_chunk.insert(std::make_pair(size_remaining, chunk_base));
+        chunks_free[chunk_base] = it_remaining;
+        chunks_free_end.insert(std::make_pair(chunk_base + size_remaining, it_remaining));
+    }
+    size_to_free_chunk.erase(size_ptr_it);
+
+    return reinterpret_cast<void*>(allocated);
+}
+
+void Arena::free(void* ptr)
+{
+    // Freeing the NULL pointer is OK.
+    if (ptr == NULL)
+        return;
+
+    // Remove chunk from used map
+    std::map<char*, size_t>::iterator i = chunks_used.find(static_cast<char*>(ptr));
+    if (i == chunks_used.end())
+        throw std::runtime_error("Arena: invalid or double free");
+    std::pair<char*, size_t> freed = *i;
+    chunks_used.erase(i);
+
+    // Coalesce freed with the free chunk that ends where it starts
+    ChunkToSizeMap::iterator prev = chunks_free_end.find(freed.first);
+    if (prev != chunks_free_end.end()) {
+        freed.first -= prev->second->first;
+        freed.second += prev->second->first;
+        size_to_free_chunk.erase(prev->second);
+        chunks_free.erase(freed.first);
+        chunks_free_end.erase(prev);
+    }
+
+    // Coalesce freed with the free chunk that starts where it ends
+    ChunkToSizeMap::iterator next = chunks_free.find(freed.first + freed.second);
+    if (next != chunks_free.end()) {
+        freed.second += next->second->first;
+        size_to_free_chunk.erase(next->second);
+        chunks_free_end.erase(freed.first + freed.second);
+        chunks_free.erase(next);
+    }
+
+    // Add the coalesced free chunk
+    SizeToChunkSortedMap::iterator it = size_to_free_chunk.insert(std::make_pair(freed.second, freed.first));
+    chunks_free[freed.first] = it;
+    chunks_free_end[freed.first + freed.second] = it;
+}
+
+Arena::Stats Arena::stats() const
+{
+    Arena::Stats r = { 0, 0, 0, chunks_used.size(), chunks_free.size() };
+    for (std::map<char*, size_t>::const_iterator it = chunks_used.begin(); it != chunks_used.end(); ++it)
+        r.used += it->second;
+    for (SizeToChunkSortedMap::const_iterator it = size_to_free_chunk.begin(); it != size_to_free_chunk.end(); ++it)
+        r.free += it->first;
+    r.total = r.used + r.free;
+    return r;
+}
+
+/*******************************************************************************/
+// Implementation: Win32LockedPageAllocator
+
+#ifdef WIN32
+/** LockedPageAllocator specialized for Windows.
+ */
+class Win32LockedPageAllocator : public LockedPageAllocator
+{
+public:
+    Win32LockedPageAllocator();
+    void* AllocateLocked(size_t len, bool* lockingSuccess);
+    void FreeLocked(void* addr, size_t len);
+    size_t GetLimit();
+
+private:
+    size_t page_size;
+};
+
+Win32LockedPageAllocator::Win32LockedPageAllocator()
+{
+    // Determine system page size in bytes
+    SYSTEM_INFO sSysInfo;
+    GetSystemInfo(&sSysInfo);
+    page_size = sSysInfo.dwPageSize;
+}
+
+void* Win32LockedPageAllocator::AllocateLocked(size_t len, bool* lockingSuccess)
+{
+    len = align_up(len, page_size);
+    void* addr = VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (addr) {
+        // VirtualLock is used to attempt to keep keying material out of swap. Note
+        // that it does not provide this as a guarantee, but, in practice, memory
+        // that has been VirtualLock'd almost never gets written to the pagefile
+        // except in rare circumstances where memory is extremely low.
+        *lockingSuccess = VirtualLock(const_cast<void*>(addr), len) != 0;
+    }
+    return addr;
+}
+
+void Win32LockedPageAllocator::FreeLocked(void* addr, size_t len)
+{
+    len = align_up(len, page_size);
+    memory_cleanse(addr, len);
+    VirtualUnlock(const_cast<void*>(addr), len);
+    VirtualFree(addr, 0, MEM_RELEASE);
+}
+
+size_t Win32LockedPageAllocator::GetLimit()
+{
+    // VirtualLock can lock no more than the minimum working set size of the
+    // process, less a few pages Windows keeps for itself.
+    SIZE_T minWorkingSet, maxWorkingSet;
+    if (GetProcessWorkingSetSize(GetCurrentProcess(), &minWorkingSet, &maxWorkingSet))
+        return minWorkingSet;
+    return std::numeric_limits<size_t>::max();
+}
+#endif
+
+/*******************************************************************************/
+// Implementation: PosixLockedPageAllocator
+
+#ifndef WIN32
+/** LockedPageAllocator specialized for OSes that don't try to be
+ * special snowflakes.
+ */
+class PosixLockedPageAllocator : public LockedPageAllocator
+{
+public:
+    PosixLockedPageAllocator();
+    void* AllocateLocked(size_t len, bool* lockingSuccess);
+    void FreeLocked(void* addr, size_t len);
+    size_t GetLimit();
+
+private:
+    size_t page_size;
+};
+
+PosixLockedPageAllocator::PosixLockedPageAllocator()
+{
+    // Determine system page size in bytes
+#if defined(PAGESIZE) // defined in limits.h
+    page_size = PAGESIZE;
+#else                 // assume some POSIX OS
+    page_size = sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Some systems (at least OS X) do not define MAP_ANONYMOUS yet and define
+// MAP_ANON which is deprecated
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+void* PosixLockedPageAllocator::AllocateLocked(size_t len, bool* lockingSuccess)
+{
+    void* addr;
+    len = align_up(len, page_size);
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+    *lockingSuccess = mlock(addr, len) == 0;
+    return addr;
+}
+
+void PosixLockedPageAllocator::FreeLocked(void* addr, size_t len)
+{
+    len = align_up(len, page_size);
+    memory_cleanse(addr, len);
+    munlock(addr, len);
+    munmap(addr, len);
+}
+
+size_t PosixLockedPageAllocator::GetLimit()
+{
+#ifdef RLIMIT_MEMLOCK
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_MEMLOCK, &rlim) == 0) {
+        if (rlim.rlim_cur != RLIM_INFINITY)
+            return rlim.rlim_cur;
+    }
+#endif
+    return std::numeric_limits<size_t>::max();
+}
+#endif
+
+/*******************************************************************************/
+// Implementation: LockedPool
+
+LockedPool::LockedPool(LockedPageAllocator* allocator_in, LockingFailed_Callback lf_cb_in) :
+    allocator(allocator_in), lf_cb(lf_cb_in), cumulative_bytes_locked(0)
+{
+}
+
+LockedPool::~LockedPool()
+{
+    for (ArenaMap::iterator it = arenas.begin(); it != arenas.end(); ++it)
+        delete it->second;
+    delete allocator;
+}
+
+void* LockedPool::alloc(size_t size)
+{
+    boost::mutex::scoped_lock lock(mutex);
+
+    // Don't handle impossible sizes
+    if (size == 0 || size > ARENA_SIZE)
+        return NULL;
+
+    // Try allocating from each current arena
+    for (ArenaMap::iterator it = arenas.begin(); it != arenas.end(); ++it) {
+        void* addr = it->second->alloc(size);
+        if (addr)
+            return addr;
+    }
+    // If that fails, create a new one
+    LockedPageArena* arena = new_arena(ARENA_SIZE, ARENA_ALIGN);
+    if (arena)
+        return arena->alloc(size);
+    return NULL;
+}
+
+void LockedPool::free(void* ptr)
+{
+    boost::mutex::scoped_lock lock(mutex);
+    // Freeing the NULL pointer is OK.
+    if (ptr == NULL)
+        return;
+    // The arena holding ptr is the last one that starts at or before it
+    ArenaMap::iterator it = arenas.upper_bound(static_cast<char*>(ptr));
+    if (it != arenas.begin()) {
+        --it;
+        if (it->second->addressInArena(ptr)) {
+            it->second->free(ptr);
+            return;
+        }
+    }
+    throw std::runtime_error("LockedPool: invalid address not pointing to any arena");
+}
+
+LockedPool::Stats LockedPool::stats() const
+{
+    boost::mutex::scoped_lock lock(mutex);
+    LockedPool::Stats r = { 0, 0, 0, cumulative_bytes_locked, 0, 0 };
+    for (ArenaMap::const_iterator it = arenas.begin(); it != arenas.end(); ++it) {
+        Arena::Stats i = it->second->stats();
+        r.used += i.used;
+        r.free += i.free;
+        r.total += i.total;
+        r.chunks_used += i.chunks_used;
+        r.chunks_free += i.chunks_free;
+    }
+    return r;
+}
+
+LockedPool::LockedPageArena* LockedPool::new_arena(size_t size, size_t align)
+{
+    bool locked;
+    // If this is the first arena, handle this specially: Cap the upper size
+    // by the process limit. This makes sure that the first arena will at least
+    // be locked. An exception to this is if the process limit is 0:
+    // in this case no memory can be locked at all so we'll skip past this logic.
+    if (arenas.empty()) {
+        size_t limit = allocator->GetLimit();
+        if (limit > 0) {
+            size = std::min(size, limit);
+        }
+    }
+    void* addr = allocator->AllocateLocked(size, &locked);
+    if (!addr)
+        return NULL;
+    if (locked) {
+        cumulative_bytes_locked += size;
+    } else if (!lf_cb || !lf_cb()) { // Call the locking-failed callback if locking failed
+        allocator->FreeLocked(addr, size);
+        return NULL;
+    }
+    LockedPageArena* arena = new LockedPageArena(allocator, addr, size, align);
+    arenas[static_cast<char*>(addr)] = arena;
+    return arena;
+}
+
+LockedPool::LockedPageArena::LockedPageArena(LockedPageAllocator* allocator_in, void* base_in, size_t size_in, size_t align_in) :
+    Arena(base_in, size_in, align_in), base(base_in), size(size_in), allocator(allocator_in)
+{
+}
+
+LockedPool::LockedPageArena::~LockedPageArena()
+{
+    allocator->FreeLocked(base, size);
+}
+
+/*******************************************************************************/
+// Implementation: LockedPoolManager
+//
+LockedPoolManager::LockedPoolManager(LockedPageAllocator* allocator_in) :
+    LockedPool(allocator_in, &LockedPoolManager::LockingFailed)
+{
+}
+
+bool LockedPoolManager::LockingFailed()
+{
+    // Called with the pool mutex held, so the flag needs no lock of its own
+    static bool fWarned = false;
+    if (!fWarned) {
+        fWarned = true;
+        LogPrintf("Warning: could not lock memory for key data, it may be swapped to disk. Raise the locked memory limit (ulimit -l) to avoid this.\n");
+    }
+    // Keep the memory even though it could not be locked, like LockedPageManager
+    // did: losing the protection against swap is better than failing to load keys.
+    return true;
+}
+
+void LockedPoolManager::CreateInstance()
+{
+    // Using a local static instance guarantees that the object is initialized
+    // when it's first needed and also deinitialized after all objects that use
+    // it are done with it.
+#ifdef WIN32
+    static LockedPoolManager instance(new Win32LockedPageAllocator());
+#else
+    static LockedPoolManager instance(new PosixLockedPageAllocator());
+#endif
+    LockedPoolManager::_instance = &instance;
+}
@@ -0,0 +1,244 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_LOCKEDPOOL_H
+#define BITCOIN_SUPPORT_LOCKEDPOOL_H
+
+#include <stdint.h>
+#include <map>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+
+/**
+ * OS-dependent allocation and deallocation of locked/pinned memory pages.
+ * Abstract base class so that it can be stubbed for tests.
+ */
+class LockedPageAllocator
+{
+public:
+    virtual ~LockedPageAllocator() {}
+    /** Allocate and lock memory pages.
+     * If len is not a multiple of the system page size, it is rounded up.
+     * Returns NULL in case of allocation failure.
+     *
+     * If locking the memory pages could not be accomplished it will still
+     * return the memory, however the lockingSuccess flag will be false.
+     * lockingSuccess is undefined if the allocation fails.
+     */
+    virtual void* AllocateLocked(size_t len, bool* lockingSuccess) = 0;
+
+    /** Unlock and free memory pages.
+     * Clear the memory before unlocking.
+     */
+    virtual void FreeLocked(void* addr, size_t len) = 0;
+
+    /** Get the total limit on the amount of memory that may be locked by this
+     * process, in bytes. Return size_t max if there is no limit or the limit
+     * is unknown. Return 0 if no memory can be locked at all.
+     */
+    virtual size_t GetLimit() = 0;
+};
+
+/**
+ * An arena manages a contiguous region of memory by dividing it into chunks.
+ * Free chunks are kept by size, so that an allocation takes the smallest
+ * one that fits, and neighbouring free chunks are merged when freed.
+ */
+class Arena
+{
+public:
+    Arena(void* base, size_t size, size_t alignment);
+    virtual ~Arena();
+
+    /** Memory statistics. */
+    struct Stats
+    {
+        size_t used;
+        size_t free;
+        size_t total;
+        size_t chunks_used;
+        size_t chunks_free;
+    };
+
+    /** Allocate size bytes from this arena.
+     * Returns pointer on success, or NULL if memory is full or
+     * the application tried to allocate 0 bytes.
+     */
+    void* alloc(size_t size);
+
+    /** Free a previously allocated chunk of memory.
+     * Freeing the NULL pointer has no effect.
+     * Raises std::runtime_error in case of error.
+     */
+    void free(void* ptr);
+
+    /** Get arena usage statistics */
+    Stats stats() const;
+
+    /** Return whether a pointer points inside this arena.
+     * This returns base <= ptr < (base+size) so only use it for (inclusive)
+     * chunk starting addresses.
+     */
+    bool addressInArena(void* ptr) const { return ptr >= base && ptr < end; }
+
+private:
+    Arena(const Arena& other);            // non construction-copyable
+    Arena& operator=(const Arena& other); // non copyable
+
+    typedef std::multimap<size_t, char*> SizeToChunkSortedMap;
+    /** Free chunks by size, for best-fit allocation */
+    SizeToChunkSortedMap size_to_free_chunk;
+
+    typedef std::map<char*, SizeToChunkSortedMap::iterator> ChunkToSizeMap;
+    /** Free chunks by their start address, to merge with the chunk before */
+    ChunkToSizeMap chunks_free;
+    /** Free chunks by their end address, to merge with the chunk after */
+    ChunkToSizeMap chunks_free_end;
+
+    /** Used chunks by start address, with their size */
+    std::map<char*, size_t> chunks_used;
+
+    /** Base address of arena */
+    char* base;
+    /** End address of arena */
+    char* end;
+    /** Minimum chunk alignment */
+    size_t alignment;
+};
+
+/**
+ * Pool for locked memory chunks.
+ *
+ * To avoid sensitive key data from being swapped to disk, the memory in this
+ * pool is locked/pinned.
+ *
+ * An arena manages a contiguous region of memory. The pool starts out with
+ * one arena but can grow to multiple arenas if the need arises. Unlike the
+ * per-page reference counting of LockedPageManager, pages are locked once
+ * when an arena is created and unlocked once when the pool goes away, so
+ * allocating a key costs a best-fit lookup rather than an mlock() call.
+ *
+ * Note that the lifetime of memory locking is bound to the physical pages of
+ * memory, not their virtual addresses, so the pages of an arena stay locked
+ * until it is freed.
+ */
+class LockedPool
+{
+public:
+    /** Size of one arena of locked memory. This is a compromise.
+     * Do not set this too low, as managing many arenas will increase
+     * allocation and deallocation overhead. Setting it too high allocates
+     * more locked memory from the OS than strictly necessary.
+     */
+    static const size_t ARENA_SIZE = 256 * 1024;
+    /** Chunk alignment. Another compromise. Setting this too high will waste
+     * memory, setting it too low will facilitate fragmentation.
+     */
+    static const size_t ARENA_ALIGN = 16;
+
+    /** Callback when allocation succeeds but locking fails.
+     * Return true to use the unlocked memory anyway, false to fail the allocation.
+     */
+    typedef bool (*LockingFailed_Callback)();
+
+    /** Memory statistics. */
+    struct Stats
+    {
+        size_t used;
+        size_t free;
+        size_t total;
+        size_t locked;
+        size_t chunks_used;
+        size_t chunks_free;
+    };
+
+    /** Create a new LockedPool. This takes ownership of the LockedPageAllocator,
+     * so it will be deleted along with the pool. lf_cb may be NULL, in which
+     * case memory that could not be locked is not used.
+     */
+    LockedPool(LockedPageAllocator* allocator, LockingFailed_Callback lf_cb = NULL);
+    ~LockedPool();
+
+    /** Allocate size bytes from this pool.
+     * Returns pointer on success, or NULL if memory is full or
+     * the application tried to allocate 0 bytes.
+     */
+    void* alloc(size_t size);
+
+    /** Free a previously allocated chunk of memory.
+     * Freeing the NULL pointer has no effect.
+     * Raises std::runtime_error in case of error.
+     */
+    void free(void* ptr);
+
+    /** Get pool usage statistics */
+    Stats stats() const;
+
+private:
+    LockedPool(const LockedPool& other);            // non construction-copyable
+    LockedPool& operator=(const LockedPool& other); // non copyable
+
+    LockedPageAllocator* allocator;
+
+    /** An arena of memory obtained from the allocator, returned to it on destruction. */
+    class LockedPageArena : public Arena
+    {
+    public:
+        LockedPageArena(LockedPageAllocator* alloc_in, void* base_in, size_t size, size_t align);
+        ~LockedPageArena();
+
+    private:
+        void* base;
+        size_t size;
+        LockedPageAllocator* allocator;
+    };
+
+    /** Obtain a new arena from the allocator; returns NULL on failure. */
+    LockedPageArena* new_arena(size_t size, size_t align);
+
+    /** Arenas by base address, so that free() finds the arena of a chunk with one lookup */
+    typedef std::map<char*, LockedPageArena*> ArenaMap;
+    ArenaMap arenas;
+    LockingFailed_Callback lf_cb;
+    size_t cumulative_bytes_locked;
+    /** Mutex protects access to this pool's data structures, including arenas.
+     */
+    mutable boost::mutex mutex;
+};
+
+/**
+ * Singleton class to keep track of locked (ie, non-swappable) memory, for use in
+ * std::allocator templates.
+ *
+ * Some implementations of the STL allocate memory in some constructors (i.e., see
+ * MSVC's vector<T> implementation where it allocates 1 byte of memory in the allocator.)
+ * Due to the unpredictable order of static initializers, we have to make sure the
+ * LockedPoolManager instance exists before any other STL-based objects that use
+ * secure_allocator are created. So instead of having LockedPoolManager also be
+ * static-initialized, it is created on demand.
+ */
+class LockedPoolManager : public LockedPool
+{
+public:
+    /** Return the current instance, or create it once */
+    static LockedPoolManager& Instance()
+    {
+        boost::call_once(LockedPoolManager::CreateInstance, LockedPoolManager::init_flag);
+        return *LockedPoolManager::_instance;
+    }
+
+private:
+    LockedPoolManager(LockedPageAllocator* allocator);
+
+    /** Create a new LockedPoolManager specialized to the OS */
+    static void CreateInstance();
+    /** Called when locking fails: logs a warning the first time, and keeps the memory */
+    static bool LockingFailed();
+
+    static LockedPoolManager* _instance;
+    static boost::once_flag init_flag;
+};
+
+#endif // BITCOIN_SUPPORT_LOCKEDPOOL_H
@@ -0,0 +1,195 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "arith_uint256.h"
+#include "chain.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "undo.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+namespace {
+/** An address index fed from memory instead of the block files. */
+class TestAddressIndex : public CAddressIndex
+{
+public:
+    std::map<const CBlockIndex*, CBlock> mapBlocks;
+    std::map<const CBlockIndex*, CBlockUndo> mapUndo;
+
+    TestAddressIndex() : CAddressIndex(1 << 20, true) {}
+
+    using CAddressIndex::AppendBlock;
+    using CAddressIndex::RewindBlock;
+    using CAddressIndex::Commit;
+
+protected:
+    bool ReadBlock(CBlock& block, const CBlockIndex* pindex)
+    {
+        block = mapBlocks[pindex];
+        return true;
+    }
+
+    bool ReadBlockUndo(CBlockUndo& blockundo, const CBlock& block, const CBlockIndex* pindex)
+    {
+        blockundo = mapUndo[pindex];
+        return true;
+    }
+};
+}
+
+BOOST_FIXTURE_TEST_SUITE(addressindex_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(addressindex_history_order)
+{
+    // Keys of the same script sort by height, whatever the byte order of the height
+    uint256 hashScript = GetScriptHash(CScript() << OP_TRUE);
+    CDataStream ss1(SER_DISK, CLIENT_VERSION), ss2(SER_DISK, CLIENT_VERSION);
+    ss1 << CAddressHistoryKey(hashScript, 255, uint256S("ff"), 7, true);
+    ss2 << CAddressHistoryKey(hashScript, 256, uint256(), 0, false);
+    BOOST_CHECK(ss1.str() < ss2.str());
+
+    CAddressHistoryKey key;
+    ss2 >> key;
+    BOOST_CHECK_EQUAL(key.nHeight, 256);
+    BOOST_CHECK(key.hashScript == hashScript);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_queries)
+{
+    CAddressIndexDB db(1 << 20, true);
+    uint256 hashScript = GetScriptHash(CScript() << OP_TRUE);
+    uint256 hashOther = GetScriptHash(CScript() << OP_FALSE);
+
+    CLevelDBBatch batch;
+    for (int nHeight = 1; nHeight <= 10; nHeight++) {
+        uint256 txid = ArithToUint256(arith_uint256(nHeight));
+        CAddressIndexDB::WriteHistoryEntry(batch, CAddressHistoryKey(hashScript, nHeight, txid, 0, false), CAddressHistoryValue(nHeight, COutPoint(), -1));
+        CAddressIndexDB::WriteHistoryEntry(batch, CAddressHistoryKey(hashOther, nHeight, txid, 1, false), CAddressHistoryValue(nHeight, COutPoint(), -1));
+        CAddressIndexDB::WriteUnspent(batch, CAddressUnspentKey(hashScript, COutPoint(txid, 0)), CAddressUnspentValue(nHeight, CScript() << OP_TRUE, nHeight));
+    }
+    CAddressIndexDB::EraseUnspent(batch, CAddressUnspentKey(hashScript, COutPoint(ArithToUint256(arith_uint256(3)), 0)));
+    BOOST_CHECK(db.WriteBatch(batch));
+
+    // History is paged in height order and does not run into other scripts
+    vector<CAddressHistoryEntry> vHistory;
+    BOOST_CHECK(db.ReadHistory(hashScript, 4, 2, 3, vHistory));
+    BOOST_CHECK_EQUAL(vHistory.size(), 3U);
+    for (size_t i = 0; i < vHistory.size(); i++) {
+        BOOST_CHECK_EQUAL(vHistory[i].first.nHeight, 6 + (int)i);
+        BOOST_CHECK_EQUAL(vHistory[i].second.nValue, 6 + (int)i);
+    }
+    vHistory.clear();
+    BOOST_CHECK(db.ReadHistory(hashScript, 9, 0, 100, vHistory));
+    BOOST_CHECK_EQUAL(vHistory.size(), 2U);
+
+    vector<CAddressUnspentEntry> vUnspent;
+    BOOST_CHECK(db.ReadUnspentOutputs(hashScript, 0, 100, vUnspent));
+    BOOST_CHECK_EQUAL(vUnspent.size(), 9U);
+    vUnspent.clear();
+    BOOST_CHECK(db.ReadUnspentOutputs(hashOther, 0, 100, vUnspent));
+    BOOST_CHECK(vUnspent.empty());
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_append_rewind)
+{
+    TestAddressIndex index;
+    CScript scriptA = CScript() << OP_TRUE;
+    CScript scriptB = CScript() << OP_2;
+    CScript scriptC = CScript() << OP_3;
+    uint256 hashA = GetScriptHash(scriptA), hashB = GetScriptHash(scriptB), hashC = GetScriptHash(scriptC);
+
+    CBlockIndex index1, index2;
+    index1.nHeight = 1;
+    index2.nHeight = 2;
+
+    // Block 1 pays its coinbase to A
+    CMutableTransaction coinbase1;
+    coinbase1.vin.resize(1);
+    coinbase1.vin[0].scriptSig = CScript() << 1;
+    coinbase1.vout.push_back(CTxOut(50 * COIN, scriptA));
+    CBlock& block1 = index.mapBlocks[&index1];
+    block1.vtx.push_back(coinbase1);
+    index.mapUndo[&index1];
+
+    // Block 2 pays its coinbase to B and spends the output of block 1 to C
+    CMutableTransaction coinbase2;
+    coinbase2.vin.resize(1);
+    coinbase2.vin[0].scriptSig = CScript() << 2;
+    coinbase2.vout.push_back(CTxOut(50 * COIN, scriptB));
+    CMutableTransaction spend;
+    spend.vin.push_back(CTxIn(COutPoint(block1.vtx[0].GetHash(), 0)));
+    spend.vout.push_back(CTxOut(49 * COIN, scriptC));
+    CBlock& block2 = index.mapBlocks[&index2];
+    block2.vtx.push_back(coinbase2);
+    block2.vtx.push_back(spend);
+    CBlockUndo& undo2 = index.mapUndo[&index2];
+    undo2.vtxundo.resize(1);
+    undo2.vtxundo[0].vprevout.push_back(CTxInUndo(block1.vtx[0].vout[0], true, 1, 1));
+
+    BOOST_CHECK(index.AppendBlock(block1, &index1));
+    BOOST_CHECK(index.Commit(CBlockLocator()));
+    BOOST_CHECK(index.AppendBlock(block2, &index2));
+    BOOST_CHECK(index.Commit(CBlockLocator()));
+
+    CAddressIndexDB& db = index.GetDB();
+    vector<CAddressUnspentEntry> vUnspent;
+    vector<CAddressHistoryEntry> vHistory;
+
+    // A was funded at height 1 and spent at height 2, where the spend remembers the funding height
+    BOOST_CHECK(db.ReadUnspentOutputs(hashA, 0, 100, vUnspent));
+    BOOST_CHECK(vUnspent.empty());
+    BOOST_CHECK(db.ReadHistory(hashA, 0, 0, 100, vHistory));
+    BOOST_REQUIRE_EQUAL(vHistory.size(), 2U);
+    BOOST_CHECK(!vHistory[0].first.fSpending);
+    BOOST_CHECK_EQUAL(vHistory[0].second.nValue, 50 * COIN);
+    BOOST_CHECK(vHistory[1].first.fSpending);
+    BOOST_CHECK_EQUAL(vHistory[1].first.nHeight, 2);
+    BOOST_CHECK(vHistory[1].first.txid == block2.vtx[1].GetHash());
+    BOOST_CHECK_EQUAL(vHistory[1].second.nValue, -50 * COIN);
+    BOOST_CHECK(vHistory[1].second.prevout == COutPoint(block1.vtx[0].GetHash(), 0));
+    BOOST_CHECK_EQUAL(vHistory[1].second.nPrevHeight, 1);
+
+    // C holds the new output
+    vUnspent.clear();
+    BOOST_CHECK(db.ReadUnspentOutputs(hashC, 0, 100, vUnspent));
+    BOOST_REQUIRE_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK(vUnspent[0].first.outpoint == COutPoint(block2.vtx[1].GetHash(), 0));
+    BOOST_CHECK_EQUAL(vUnspent[0].second.nValue, 49 * COIN);
+    BOOST_CHECK_EQUAL(vUnspent[0].second.nHeight, 2);
+
+    // Rewinding block 2 gives A its output back, with its original height, and forgets B and C
+    BOOST_CHECK(index.RewindBlock(&index2));
+    BOOST_CHECK(index.Commit(CBlockLocator()));
+
+    vUnspent.clear();
+    BOOST_CHECK(db.ReadUnspentOutputs(hashA, 0, 100, vUnspent));
+    BOOST_REQUIRE_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK(vUnspent[0].first.outpoint == COutPoint(block1.vtx[0].GetHash(), 0));
+    BOOST_CHECK_EQUAL(vUnspent[0].second.nValue, 50 * COIN);
+    BOOST_CHECK_EQUAL(vUnspent[0].second.nHeight, 1);
+    BOOST_CHECK(vUnspent[0].second.scriptPubKey == scriptA);
+    vHistory.clear();
+    BOOST_CHECK(db.ReadHistory(hashA, 0, 0, 100, vHistory));
+    BOOST_REQUIRE_EQUAL(vHistory.size(), 1U);
+    BOOST_CHECK(!vHistory[0].first.fSpending);
+
+    const uint256 hashes[] = {hashB, hashC};
+    for (unsigned int i = 0; i < 2; i++) {
+        vUnspent.clear();
+        vHistory.clear();
+        BOOST_CHECK(db.ReadUnspentOutputs(hashes[i], 0, 100, vUnspent));
+        BOOST_CHECK(vUnspent.empty());
+        BOOST_CHECK(db.ReadHistory(hashes[i], 0, 0, 100, vHistory));
+        BOOST_CHECK(vHistory.empty());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,11 +2,17 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "random.h"
 #include "util.h"
 
 #include "support/allocators/secure.h"
+#include "support/lockedpool.h"
+#include "support/pagelocker.h"
 #include "test/test_bitcoin.h"
 
+#include <limits>
+#include <stdexcept>
+
 #include <boost/test/unit_test.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(allocator_tests, BasicTestingSetup)
@@ -117,4 +123,165 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(arena_tests)
+{
+    // Fake memory base address for testing
+    // without actually using memory.
+    void *synth_base = reinterpret_cast<void*>(0x08000000);
+    const size_t synth_size = 1024*1024;
+    Arena b(synth_base, synth_size, 16);
+    void *chunk = b.alloc(1000);
+    BOOST_CHECK(chunk != NULL);
+    BOOST_CHECK(b.stats().chunks_used == 1);
+    BOOST_CHECK(b.stats().used == 1008); // rounded up to the alignment
+    BOOST_CHECK(b.stats().total == synth_size);
+    b.free(chunk);
+    BOOST_CHECK(b.stats().chunks_used == 0);
+    BOOST_CHECK(b.stats().chunks_free == 1);
+    BOOST_CHECK(b.stats().free == synth_size);
+    BOOST_CHECK_THROW(b.free(chunk), std::runtime_error); // double free
+
+    // Nothing is handed out for zero bytes or more than the arena holds
+    BOOST_CHECK(b.alloc(0) == NULL);
+    BOOST_CHECK(b.alloc(synth_size + 1) == NULL);
+
+    // Fill the arena with 1024 byte chunks, in a shuffled order free them
+    // again, and check that it coalesces back into one free chunk
+    std::vector<void*> addr;
+    for (size_t x=0; x<synth_size/1024; ++x)
+    {
+        void *p = b.alloc(1024);
+        BOOST_CHECK(p != NULL);
+        BOOST_CHECK(b.addressInArena(p));
+        addr.push_back(p);
+    }
+    BOOST_CHECK(b.alloc(1) == NULL); // full
+    BOOST_CHECK(b.stats().free == 0);
+    for (size_t x=0; x<addr.size(); ++x)
+        std::swap(addr[x], addr[insecure_rand() % addr.size()]);
+    for (size_t x=0; x<addr.size(); ++x)
+        b.free(addr[x]);
+    BOOST_CHECK(b.stats().chunks_free == 1);
+    BOOST_CHECK(b.stats().free == synth_size);
+
+    // Best fit: a hole left between used chunks is reused by a chunk that fits it
+    void *a0 = b.alloc(128);
+    void *a1 = b.alloc(256);
+    void *a2 = b.alloc(128);
+    b.free(a1);
+    BOOST_CHECK(b.alloc(256) == a1);
+    b.free(a0);
+    b.free(a1);
+    b.free(a2);
+    BOOST_CHECK(b.stats().chunks_free == 1);
+    BOOST_CHECK(b.stats().used == 0);
+}
+
+/** Mock LockedPageAllocator for testing */
+class TestLockedPageAllocator: public LockedPageAllocator
+{
+public:
+    TestLockedPageAllocator(int count_in, int lockedcount_in): count(count_in), lockedcount(lockedcount_in) {}
+    void* AllocateLocked(size_t len, bool *lockingSuccess)
+    {
+        *lockingSuccess = false;
+        if (count > 0) {
+            --count;
+
+            if (lockedcount > 0) {
+                --lockedcount;
+                *lockingSuccess = true;
+            }
+
+            return reinterpret_cast<void*>(0x08000000 + (count<<24)); // Fake address, do not actually use this memory
+        }
+        return NULL;
+    }
+    void FreeLocked(void* addr, size_t len)
+    {
+    }
+    size_t GetLimit()
+    {
+        return std::numeric_limits<size_t>::max();
+    }
+private:
+    int count;
+    int lockedcount;
+};
+
+static bool TestLockingFailed() { return true; }
+
+BOOST_AUTO_TEST_CASE(lockedpool_tests_mock)
+{
+    // Test over three virtual arenas, of which one will succeed being locked
+    LockedPool pool(new TestLockedPageAllocator(3, 1), &TestLockingFailed);
+    BOOST_CHECK(pool.stats().total == 0);
+    BOOST_CHECK(pool.stats().locked == 0);
+
+    // Ensure unreasonable requests are refused without allocating anything
+    void *invalid_toosmall = pool.alloc(0);
+    BOOST_CHECK(invalid_toosmall == NULL);
+    BOOST_CHECK(pool.stats().used == 0);
+    BOOST_CHECK(pool.stats().free == 0);
+    void *invalid_toobig = pool.alloc(LockedPool::ARENA_SIZE+1);
+    BOOST_CHECK(invalid_toobig == NULL);
+    BOOST_CHECK(pool.stats().used == 0);
+    BOOST_CHECK(pool.stats().free == 0);
+
+    void *a0 = pool.alloc(LockedPool::ARENA_SIZE / 2);
+    BOOST_CHECK(a0);
+    BOOST_CHECK(pool.stats().locked == LockedPool::ARENA_SIZE);
+    void *a1 = pool.alloc(LockedPool::ARENA_SIZE / 2);
+    BOOST_CHECK(a1);
+    void *a2 = pool.alloc(LockedPool::ARENA_SIZE / 2);
+    BOOST_CHECK(a2);
+    void *a3 = pool.alloc(LockedPool::ARENA_SIZE / 2);
+    BOOST_CHECK(a3);
+    void *a4 = pool.alloc(LockedPool::ARENA_SIZE / 2);
+    BOOST_CHECK(a4);
+    void *a5 = pool.alloc(LockedPool::ARENA_SIZE / 2);
+    BOOST_CHECK(a5);
+    // We've passed a count of three arenas, so this allocation should fail
+    void *a6 = pool.alloc(16);
+    BOOST_CHECK(!a6);
+
+    pool.free(a0);
+    pool.free(a2);
+    pool.free(a4);
+    pool.free(a1);
+    pool.free(a3);
+    pool.free(a5);
+    BOOST_CHECK(pool.stats().total == 3*LockedPool::ARENA_SIZE);
+    BOOST_CHECK(pool.stats().locked == LockedPool::ARENA_SIZE);
+    BOOST_CHECK(pool.stats().used == 0);
+
+    // Memory that could not be locked is refused without a callback saying otherwise
+    LockedPool poolStrict(new TestLockedPageAllocator(3, 1));
+    BOOST_CHECK(poolStrict.alloc(LockedPool::ARENA_SIZE) != NULL);
+    BOOST_CHECK(poolStrict.alloc(16) == NULL);
+    BOOST_CHECK(poolStrict.stats().total == LockedPool::ARENA_SIZE);
+}
+
+// These tests used the live LockedPoolManager object, this is also used
+// by other tests so the conditions are somewhat less controllable and thus the
+// tests are somewhat more error-prone.
+BOOST_AUTO_TEST_CASE(lockedpool_tests_live)
+{
+    LockedPoolManager &pool = LockedPoolManager::Instance();
+    LockedPool::Stats initial = pool.stats();
+
+    void *a0 = pool.alloc(16);
+    BOOST_CHECK(a0);
+    // Test reading and writing the allocated memory
+    *((uint32_t*)a0) = 0x1234;
+    BOOST_CHECK(*((uint32_t*)a0) == 0x1234);
+
+    pool.free(a0);
+    BOOST_CHECK_THROW(pool.free(a0), std::runtime_error); // Test failure on double-free
+    // If more than one new arena was allocated for the above tests, something is wrong
+    BOOST_CHECK(pool.stats().total <= (initial.total + LockedPool::ARENA_SIZE));
+    // Usage must be back to where we started
+    BOOST_CHECK(pool.stats().used == initial.used);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
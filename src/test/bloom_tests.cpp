@@ -535,6 +535,14 @@ BOOST_AUTO_TEST_CASE(rolling_bloom)
     for (int i = 0; i < DATASIZE; i++) {
         BOOST_CHECK(rb2.contains(data[i]));
     }
+
+    // Hashes are keyed by their bytes, without a vector copy:
+    uint256 hash = GetRandHash();
+    rb2.insert(hash);
+    BOOST_CHECK(rb2.contains(hash));
+    BOOST_CHECK(rb2.contains(std::vector<unsigned char>(hash.begin(), hash.end())));
+    rb2.clear();
+    BOOST_CHECK(!rb2.contains(hash));
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,92 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+/** Counts how many times it was run, and fails if constructed to. */
+class CCountingCheck
+{
+public:
+    boost::mutex* pmutex;
+    int* pnCount;
+    bool fResult;
+
+    CCountingCheck() : pmutex(NULL), pnCount(NULL), fResult(true) {}
+    CCountingCheck(boost::mutex& mutexIn, int& nCountIn, bool fResultIn) : pmutex(&mutexIn), pnCount(&nCountIn), fResult(fResultIn) {}
+
+    bool operator()()
+    {
+        boost::unique_lock<boost::mutex> lock(*pmutex);
+        (*pnCount)++;
+        return fResult;
+    }
+
+    void swap(CCountingCheck& check)
+    {
+        std::swap(pmutex, check.pmutex);
+        std::swap(pnCount, check.pnCount);
+        std::swap(fResult, check.fResult);
+    }
+};
+
+static void RunQueue(CCheckQueue<CCountingCheck>& queue, unsigned int nBatches, unsigned int nPerBatch, int nFailAt, bool fExpected)
+{
+    boost::mutex mutex;
+    int nCount = 0;
+    CCheckQueueControl<CCountingCheck> control(&queue);
+    for (unsigned int i = 0; i < nBatches; i++) {
+        std::vector<CCountingCheck> vChecks;
+        for (unsigned int j = 0; j < nPerBatch; j++)
+            vChecks.push_back(CCountingCheck(mutex, nCount, (int)(i * nPerBatch + j) != nFailAt));
+        control.Add(vChecks);
+    }
+    BOOST_CHECK_EQUAL(control.Wait(), fExpected);
+    if (fExpected)
+        BOOST_CHECK_EQUAL(nCount, (int)(nBatches * nPerBatch));
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_masteronly)
+{
+    CCheckQueue<CCountingCheck> queue(16);
+    RunQueue(queue, 10, 37, -1, true);
+    RunQueue(queue, 3, 5, 7, false);
+    RunQueue(queue, 1, 1, -1, true);
+    BOOST_CHECK(queue.IsIdle());
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_workstealing)
+{
+    CCheckQueue<CCountingCheck> queue(16, 4);
+    boost::thread_group threadGroup;
+    // More threads than slots, so some workers share a deque.
+    for (int i = 0; i < 6; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CCountingCheck>::Thread, &queue));
+
+    for (int nRound = 0; nRound < 20; nRound++) {
+        RunQueue(queue, 50, 1 + nRound * 3, -1, true);
+        RunQueue(queue, 5, 100, nRound * 17, false);
+    }
+
+    std::vector<CCheckQueueWorkerStats> vStats;
+    queue.GetStats(vStats);
+    // One slot for the master plus at most four for the workers (which may still be starting up).
+    BOOST_CHECK(vStats.size() >= 1 && vStats.size() <= 5);
+    uint64_t nChecks = 0;
+    for (unsigned int i = 0; i < vStats.size(); i++)
+        nChecks += vStats[i].nChecks;
+    BOOST_CHECK(nChecks > 0);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,14 +2,20 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "coins.h"
+#include "main.h"
 #include "random.h"
+#include "script/script.h"
+#include "streams.h"
+#include "txdb.h"
 #include "uint256.h"
 #include "test/test_bitcoin.h"
 
 #include <vector>
 #include <map>
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
 namespace
@@ -197,4 +203,113 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+BOOST_FIXTURE_TEST_CASE(txoutset_snapshot_test, TestingSetup)
+{
+    for (int i = 0; i < 100; i++) {
+        CCoinsModifier coins = pcoinsTip->ModifyCoins(GetRandHash());
+        coins->fCoinBase = (i % 10 == 0);
+        coins->nHeight = i;
+        coins->nVersion = 1;
+        coins->vout.resize(1 + insecure_rand() % 3);
+        for (unsigned int j = 0; j < coins->vout.size(); j++) {
+            coins->vout[j].nValue = 1 + insecure_rand() % 1000000;
+            coins->vout[j].scriptPubKey = CScript() << OP_TRUE;
+        }
+    }
+    BOOST_CHECK(pcoinsTip->Flush());
+
+    boost::filesystem::path path = pathTemp / "utxo.dat";
+    CCoinsStats statsDump;
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(pcoinsdbview->DumpSnapshot(fileout, statsDump));
+    }
+    BOOST_CHECK_EQUAL(statsDump.nTransactions, 100U);
+    BOOST_CHECK(statsDump.hashBlock == pcoinsdbview->GetBestBlock());
+
+    // Checking a snapshot gives the same hash as dumping it, and writes nothing.
+    CCoinsViewDB dbview(1 << 20, true);
+    CCoinsStats statsCheck;
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(dbview.LoadSnapshot(filein, false, statsCheck));
+    }
+    BOOST_CHECK(statsCheck.hashSerialized == statsDump.hashSerialized);
+    BOOST_CHECK(dbview.GetBestBlock().IsNull());
+
+    // Loading it reproduces the same coins and best block.
+    CCoinsStats statsLoad;
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(dbview.LoadSnapshot(filein, true, statsLoad));
+    }
+    BOOST_CHECK(statsLoad.hashSerialized == statsDump.hashSerialized);
+    BOOST_CHECK(dbview.GetBestBlock() == statsDump.hashBlock);
+    CCoinsStats statsRedump;
+    {
+        CAutoFile fileout(fopen((pathTemp / "utxo2.dat").string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(dbview.DumpSnapshot(fileout, statsRedump));
+    }
+    BOOST_CHECK(statsRedump.hashSerialized == statsDump.hashSerialized);
+    BOOST_CHECK_EQUAL(statsRedump.nTransactionOutputs, statsDump.nTransactionOutputs);
+
+    // A truncated snapshot is rejected.
+    boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 1);
+    CCoinsStats statsTruncated;
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(!dbview.LoadSnapshot(filein, false, statsTruncated));
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(txoutset_commitment_test, TestingSetup)
+{
+    // Build up a commitment output by output alongside the chain state.
+    CTxOutSetCommitment incremental;
+    for (int i = 0; i < 50; i++) {
+        uint256 txid = GetRandHash();
+        CCoinsModifier coins = pcoinsTip->ModifyCoins(txid);
+        coins->nHeight = i;
+        coins->nVersion = 1;
+        coins->vout.resize(1 + insecure_rand() % 3);
+        for (unsigned int j = 0; j < coins->vout.size(); j++) {
+            coins->vout[j].nValue = 1 + insecure_rand() % 1000000;
+            coins->vout[j].scriptPubKey = CScript() << OP_TRUE;
+            incremental.AddOutput(COutPoint(txid, j), coins->vout[j]);
+        }
+        incremental.nTransactions++;
+        if (i % 2 == 0) {
+            incremental.RemoveOutput(COutPoint(txid, 0), coins->vout[0]);
+            coins->Spend(0);
+            if (coins->IsPruned())
+                incremental.nTransactions--;
+        }
+    }
+    BOOST_CHECK(pcoinsTip->Flush());
+
+    // A full scan of the database agrees with it.
+    CTxOutSetCommitment full;
+    BOOST_CHECK(pcoinsdbview->ComputeTxOutSetCommitment(full));
+    BOOST_CHECK(full.hashBlock == pcoinsdbview->GetBestBlock());
+    BOOST_CHECK_EQUAL(full.nTransactions, incremental.nTransactions);
+    BOOST_CHECK_EQUAL(full.nTransactionOutputs, incremental.nTransactionOutputs);
+    BOOST_CHECK(full.nTotalAmount == incremental.nTotalAmount);
+    BOOST_CHECK(full.GetHash() == incremental.GetHash());
+
+    // It is only stored along with the best block it belongs to.
+    CCoinsMap mapCoins;
+    CTxOutSetCommitment stored;
+    pcoinsdbview->SetTxOutSetCommitment(incremental);
+    BOOST_CHECK(pcoinsdbview->BatchWrite(mapCoins, full.hashBlock));
+    BOOST_CHECK(!pcoinsdbview->ReadTxOutSetCommitment(stored));
+    incremental.hashBlock = full.hashBlock;
+    pcoinsdbview->SetTxOutSetCommitment(incremental);
+    BOOST_CHECK(pcoinsdbview->BatchWrite(mapCoins, full.hashBlock));
+    BOOST_CHECK(pcoinsdbview->ReadTxOutSetCommitment(stored));
+    BOOST_CHECK(stored.hashBlock == full.hashBlock);
+    BOOST_CHECK_EQUAL(stored.nTransactionOutputs, full.nTransactionOutputs);
+    BOOST_CHECK(stored.nTotalAmount == full.nTotalAmount);
+    BOOST_CHECK(stored.GetHash() == full.GetHash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
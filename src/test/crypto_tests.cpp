@@ -2,12 +2,14 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "crypto/muhash.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "hash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
@@ -248,4 +250,68 @@ BOOST_AUTO_TEST_CASE(hmac_sha512_testvectors) {
                    "b6022cac3c4982b10d5eeb55c3e4de15134676fb6de0446065c97440fa8c6a58");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    for (int i = 0; i <= 32; ++i) {
+        unsigned char in[64 * 32];
+        unsigned char out1[32 * 32], out2[32 * 32];
+        for (int j = 0; j < 64 * i; ++j) {
+            in[j] = insecure_rand();
+        }
+        for (int j = 0; j < i; ++j) {
+            CHash256().Write(in + 64 * j, 64).Finalize(out1 + 32 * j);
+        }
+        SHA256D64(out2, in, i);
+        BOOST_CHECK(memcmp(out1, out2, 32 * i) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(muhash_tests)
+{
+    // (p-1)^2 = 1 and (p-1)^-1 = p-1 for the modulus p = 2^3072 - 1103717.
+    Num3072 minusone;
+    minusone.limbs[0] = 0xffffffffU - 1103717;
+    for (int i = 1; i < Num3072::LIMBS; i++)
+        minusone.limbs[i] = 0xffffffffU;
+    Num3072 square = minusone;
+    square.Multiply(minusone);
+    BOOST_CHECK_EQUAL(square.limbs[0], 1U);
+    for (int i = 1; i < Num3072::LIMBS; i++)
+        BOOST_CHECK_EQUAL(square.limbs[i], 0U);
+    Num3072 inverse = minusone.GetInverse();
+    BOOST_CHECK(memcmp(inverse.limbs, minusone.limbs, sizeof(inverse.limbs)) == 0);
+
+    std::vector<uint256> elements;
+    for (int i = 0; i < 4; i++)
+        elements.push_back(GetRandHash());
+
+    unsigned char empty[32], hash1[32], hash2[32];
+    MuHash3072().Finalize(empty);
+
+    // Insertion order does not matter, and removal undoes insertion.
+    MuHash3072 acc1, acc2;
+    for (int i = 0; i < 4; i++) {
+        acc1.Insert(elements[i].begin(), 32);
+        acc2.Insert(elements[3 - i].begin(), 32);
+    }
+    acc1.Finalize(hash1);
+    acc2.Finalize(hash2);
+    BOOST_CHECK(memcmp(hash1, hash2, 32) == 0);
+    BOOST_CHECK(memcmp(hash1, empty, 32) != 0);
+
+    // The state survives serialization, before and after finalizing.
+    MuHash3072 acc3;
+    acc3.Insert(elements[0].begin(), 32).Insert(elements[1].begin(), 32).Remove(elements[0].begin(), 32);
+    unsigned char state[MuHash3072::SERIALIZED_SIZE];
+    acc3.Serialize(state);
+    MuHash3072 acc4;
+    acc4.Deserialize(state);
+    acc4.Insert(elements[0].begin(), 32).Insert(elements[2].begin(), 32).Insert(elements[3].begin(), 32);
+    acc4.Finalize(hash2);
+    BOOST_CHECK(memcmp(hash1, hash2, 32) == 0);
+    acc4.Remove(elements[0].begin(), 32).Remove(elements[1].begin(), 32).Remove(elements[2].begin(), 32).Remove(elements[3].begin(), 32);
+    acc4.Finalize(hash2);
+    BOOST_CHECK(memcmp(empty, hash2, 32) == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
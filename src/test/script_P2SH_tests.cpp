@@ -24,7 +24,7 @@ using namespace std;
 static std::vector<unsigned char>
 Serialize(const CScript& s)
 {
-    std::vector<unsigned char> sSerialized(s);
+    std::vector<unsigned char> sSerialized(s.begin(), s.end());
     return sSerialized;
 }
 
@@ -124,6 +124,71 @@ BOOST_AUTO_TEST_CASE(sign)
         }
 }
 
+BOOST_AUTO_TEST_CASE(sign_many_inputs)
+{
+    LOCK(cs_main);
+    // SignSignatures() spreads a large transaction over several threads and
+    // must produce the same (deterministic) signatures as SignSignature()
+    CBasicKeyStore keystore;
+    CKey key[4];
+    CScript scripts[4];
+    for (int i = 0; i < 4; i++)
+    {
+        key[i].MakeNewKey(i % 2 == 0);
+        keystore.AddKey(key[i]);
+    }
+    scripts[0] << ToByteVector(key[0].GetPubKey()) << OP_CHECKSIG;
+    scripts[1] = GetScriptForDestination(key[1].GetPubKey().GetID());
+    scripts[2] = GetScriptForDestination(key[2].GetPubKey().GetID());
+    keystore.AddCScript(scripts[2]);
+    scripts[2] = GetScriptForDestination(CScriptID(scripts[2]));
+    scripts[3] = GetScriptForDestination(key[3].GetPubKey().GetID());
+
+    CMutableTransaction txFrom;
+    txFrom.vout.resize(40);
+    for (unsigned int i = 0; i < txFrom.vout.size(); i++)
+    {
+        txFrom.vout[i].scriptPubKey = scripts[i % 4];
+        txFrom.vout[i].nValue = COIN;
+    }
+
+    CMutableTransaction txTo;
+    txTo.vin.resize(txFrom.vout.size());
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+    std::vector<const CScript*> vpFromPubKeys;
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        txTo.vin[i].prevout = COutPoint(txFrom.GetHash(), i);
+        vpFromPubKeys.push_back(&txFrom.vout[i].scriptPubKey);
+    }
+
+    CMutableTransaction txSerial(txTo);
+    for (unsigned int i = 0; i < txSerial.vin.size(); i++)
+        BOOST_CHECK(SignSignature(keystore, txFrom, txSerial, i));
+
+    // Inputs without a script are left alone
+    vpFromPubKeys[7] = NULL;
+    txTo.vin[7].scriptSig = CScript() << OP_1;
+    BOOST_CHECK(SignSignatures(keystore, vpFromPubKeys, txTo));
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        if (i == 7)
+        {
+            BOOST_CHECK(txTo.vin[i].scriptSig == CScript() << OP_1);
+            continue;
+        }
+        BOOST_CHECK_MESSAGE(txTo.vin[i].scriptSig == txSerial.vin[i].scriptSig, strprintf("SignSignatures %d", i));
+        BOOST_CHECK(CScriptCheck(CCoins(txFrom, 0), txTo, i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, false)());
+    }
+
+    // Any input that cannot be solved fails the whole transaction
+    CBasicKeyStore keystoreMissing;
+    keystoreMissing.AddKey(key[0]);
+    vpFromPubKeys[7] = &txFrom.vout[7].scriptPubKey;
+    BOOST_CHECK(!SignSignatures(keystoreMissing, vpFromPubKeys, txTo));
+}
+
 BOOST_AUTO_TEST_CASE(norecurse)
 {
     ScriptError err;
@@ -338,8 +403,8 @@ BOOST_AUTO_TEST_CASE(AreInputsStandard)
     // SignSignature doesn't know how to sign these. We're
     // not testing validating signatures, so just create
     // dummy signatures that DO include the correct P2SH scripts:
-    txTo.vin[3].scriptSig << OP_11 << OP_11 << static_cast<vector<unsigned char> >(oneAndTwo);
-    txTo.vin[4].scriptSig << static_cast<vector<unsigned char> >(fifteenSigops);
+    txTo.vin[3].scriptSig << OP_11 << OP_11 << ToByteVector(oneAndTwo);
+    txTo.vin[4].scriptSig << ToByteVector(fifteenSigops);
 
     BOOST_CHECK(::AreInputsStandard(txTo, coins));
     // 22 P2SH sigops for all inputs (1 for vin[0], 6 for vin[3], 15 for vin[4]
@@ -361,7 +426,7 @@ BOOST_AUTO_TEST_CASE(AreInputsStandard)
     txToNonStd1.vin.resize(1);
     txToNonStd1.vin[0].prevout.n = 5;
     txToNonStd1.vin[0].prevout.hash = txFrom.GetHash();
-    txToNonStd1.vin[0].scriptSig << static_cast<vector<unsigned char> >(sixteenSigops);
+    txToNonStd1.vin[0].scriptSig << ToByteVector(sixteenSigops);
 
     BOOST_CHECK(!::AreInputsStandard(txToNonStd1, coins));
     BOOST_CHECK_EQUAL(GetP2SHSigOpCount(txToNonStd1, coins), 16U);
@@ -373,7 +438,7 @@ BOOST_AUTO_TEST_CASE(AreInputsStandard)
     txToNonStd2.vin.resize(1);
     txToNonStd2.vin[0].prevout.n = 6;
     txToNonStd2.vin[0].prevout.hash = txFrom.GetHash();
-    txToNonStd2.vin[0].scriptSig << static_cast<vector<unsigned char> >(twentySigops);
+    txToNonStd2.vin[0].scriptSig << ToByteVector(twentySigops);
 
     BOOST_CHECK(!::AreInputsStandard(txToNonStd2, coins));
     BOOST_CHECK_EQUAL(GetP2SHSigOpCount(txToNonStd2, coins), 20U);
@@ -99,7 +99,10 @@ void DoTest(const CScript& scriptPubKey, const CScript& scriptSig, int flags, bo
 #if defined(HAVE_CONSENSUS_LIB)
     CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
     stream << tx2;
-    BOOST_CHECK_MESSAGE(bitcoinconsensus_verify_script(begin_ptr(scriptPubKey), scriptPubKey.size(), (const unsigned char*)&stream[0], stream.size(), 0, flags, NULL) == expect,message);
+    BOOST_CHECK_MESSAGE(bitcoinconsensus_verify_script(scriptPubKey.data(), scriptPubKey.size(), (const unsigned char*)&stream[0], stream.size(), 0, flags, NULL) == expect,message);
+    const unsigned char* pscriptPubKey = scriptPubKey.data();
+    unsigned int nScriptPubKeyLen = scriptPubKey.size();
+    BOOST_CHECK_MESSAGE(bitcoinconsensus_verify_script_batch(&pscriptPubKey, &nScriptPubKeyLen, 1, (const unsigned char*)&stream[0], stream.size(), flags, 1, NULL, NULL) == expect,message);
 #endif
 }
 
@@ -262,7 +265,7 @@ public:
 
     TestBuilder& PushRedeem()
     {
-        DoPush(static_cast<std::vector<unsigned char> >(scriptPubKey));
+        DoPush(ToByteVector(scriptPubKey));
         return *this;
     }
 
@@ -894,7 +897,7 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     combined = CombineSignatures(scriptPubKey, txTo, 0, scriptSigCopy, scriptSig);
     BOOST_CHECK(combined == scriptSigCopy || combined == scriptSig);
     // dummy scriptSigCopy with placeholder, should always choose non-placeholder:
-    scriptSigCopy = CScript() << OP_0 << static_cast<vector<unsigned char> >(pkSingle);
+    scriptSigCopy = CScript() << OP_0 << ToByteVector(pkSingle);
     combined = CombineSignatures(scriptPubKey, txTo, 0, scriptSigCopy, scriptSig);
     BOOST_CHECK(combined == scriptSig);
     combined = CombineSignatures(scriptPubKey, txTo, 0, scriptSig, scriptSigCopy);
@@ -953,6 +956,76 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+#if defined(HAVE_CONSENSUS_LIB)
+BOOST_AUTO_TEST_CASE(script_consensus_batch)
+{
+    // All inputs of a transaction verified at once, on several threads,
+    // agree with verifying them one by one
+    CBasicKeyStore keystore;
+    CKey key[3];
+    CMutableTransaction txFrom;
+    txFrom.vout.resize(24);
+    for (int i = 0; i < 3; i++)
+    {
+        key[i].MakeNewKey(i != 1);
+        keystore.AddKey(key[i]);
+    }
+    for (unsigned int i = 0; i < txFrom.vout.size(); i++)
+    {
+        if (i % 3 == 0)
+            txFrom.vout[i].scriptPubKey << ToByteVector(key[0].GetPubKey()) << OP_CHECKSIG;
+        else
+            txFrom.vout[i].scriptPubKey = GetScriptForDestination(key[i % 3].GetPubKey().GetID());
+        txFrom.vout[i].nValue = 1;
+    }
+
+    CMutableTransaction txTo;
+    txTo.vin.resize(txFrom.vout.size());
+    txTo.vout.resize(1);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        txTo.vin[i].prevout = COutPoint(txFrom.GetHash(), i);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        BOOST_CHECK(SignSignature(keystore, txFrom, txTo, i));
+    // Swap two signatures so that those inputs no longer verify
+    std::swap(txTo.vin[4].scriptSig, txTo.vin[7].scriptSig);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << txTo;
+    std::vector<const unsigned char*> vpScriptPubKeys;
+    std::vector<unsigned int> vScriptPubKeyLens;
+    for (unsigned int i = 0; i < txFrom.vout.size(); i++)
+    {
+        vpScriptPubKeys.push_back(txFrom.vout[i].scriptPubKey.data());
+        vScriptPubKeyLens.push_back(txFrom.vout[i].scriptPubKey.size());
+    }
+
+    std::vector<int> vResults(txTo.vin.size(), -1);
+    bitcoinconsensus_error err;
+    BOOST_CHECK_EQUAL(bitcoinconsensus_verify_script_batch(&vpScriptPubKeys[0], &vScriptPubKeyLens[0], vpScriptPubKeys.size(),
+                                                           (const unsigned char*)&stream[0], stream.size(), flags, 4, &vResults[0], &err), 0);
+    BOOST_CHECK_EQUAL(err, bitcoinconsensus_ERR_OK);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        int expect = bitcoinconsensus_verify_script(vpScriptPubKeys[i], vScriptPubKeyLens[i], (const unsigned char*)&stream[0], stream.size(), i, flags, NULL);
+        BOOST_CHECK_EQUAL(vResults[i], expect);
+        BOOST_CHECK_EQUAL(expect, (i == 4 || i == 7) ? 0 : 1);
+    }
+
+    // Left to the library, the thread count gives the same results, whether
+    // or not it is safe to use more than one
+    std::vector<int> vResultsDefault(txTo.vin.size(), -1);
+    BOOST_CHECK_EQUAL(bitcoinconsensus_verify_script_batch(&vpScriptPubKeys[0], &vScriptPubKeyLens[0], vpScriptPubKeys.size(),
+                                                           (const unsigned char*)&stream[0], stream.size(), flags, 0, &vResultsDefault[0], &err), 0);
+    BOOST_CHECK_EQUAL(err, bitcoinconsensus_ERR_OK);
+    BOOST_CHECK(vResultsDefault == vResults);
+
+    // The spent outputs must match the inputs one to one
+    BOOST_CHECK_EQUAL(bitcoinconsensus_verify_script_batch(&vpScriptPubKeys[0], &vScriptPubKeyLens[0], vpScriptPubKeys.size() - 1,
+                                                           (const unsigned char*)&stream[0], stream.size(), flags, 4, NULL, &err), 0);
+    BOOST_CHECK_EQUAL(err, bitcoinconsensus_ERR_SPENT_OUTPUTS_MISMATCH);
+}
+#endif
+
 BOOST_AUTO_TEST_CASE(script_standard_push)
 {
     ScriptError err;
@@ -274,6 +274,20 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     CSerializeData d;
     ss.GetAndClear(d);
     BOOST_CHECK_EQUAL(ss.size(), 0);
+    BOOST_CHECK_EQUAL(d.size(), 4);
+    BOOST_CHECK_EQUAL(d[0], 0);
+    BOOST_CHECK_EQUAL(d[3], (char)0xff);
+
+    // Unread data only is handed over, and the stream stays usable
+    ss << (unsigned char)7 << (unsigned char)8;
+    unsigned char ch;
+    ss >> ch;
+    ss.GetAndClear(d);
+    BOOST_CHECK_EQUAL(d.size(), 1);
+    BOOST_CHECK_EQUAL(d[0], 8);
+    ss << (unsigned char)9;
+    BOOST_CHECK_EQUAL(ss.size(), 1);
+    BOOST_CHECK_EQUAL(ss[0], 9);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
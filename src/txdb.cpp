@@ -10,6 +10,7 @@
 #include "hash.h"
 #include "main.h"
 #include "pow.h"
+#include "streams.h"
 #include "uint256.h"
 #include "arith_uint256.h"
 
@@ -22,9 +23,11 @@ using namespace std;
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
+static const char DB_TXINDEX_BEST_BLOCK = 'T';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
+static const char DB_TXOUTSET_COMMITMENT = 'M';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
@@ -72,13 +75,24 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
         CCoinsMap::iterator itOld = it++;
         mapCoins.erase(itOld);
     }
-    if (!hashBlock.IsNull())
+    if (!hashBlock.IsNull()) {
         BatchWriteHashBestChain(batch, hashBlock);
+        if (commitmentToWrite.hashBlock == hashBlock)
+            batch.Write(DB_TXOUTSET_COMMITMENT, commitmentToWrite);
+    }
 
     LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
+void CCoinsViewDB::SetTxOutSetCommitment(const CTxOutSetCommitment &commitment) {
+    commitmentToWrite = commitment;
+}
+
+bool CCoinsViewDB::ReadTxOutSetCommitment(CTxOutSetCommitment &commitment) const {
+    return db.Read(DB_TXOUTSET_COMMITMENT, commitment);
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -102,6 +116,25 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
+/** Add the coins of one transaction to the stats and the hash of a coin set. */
+void static HashCoinsStats(CHashWriter &ss, CCoinsStats &stats, const uint256 &txhash, const CCoins &coins) {
+    ss << txhash;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i=0; i<coins.vout.size(); i++) {
+        const CTxOut &out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i+1);
+            ss << out;
+            stats.nTotalAmount += out.nValue;
+        }
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
@@ -112,7 +145,6 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    arith_uint256 nTotalAmount = 0;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -127,22 +159,8 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
                 ssValue >> coins;
                 uint256 txhash;
                 ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
+                HashCoinsStats(ss, stats, txhash, coins);
                 stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
             }
             pcursor->Next();
         } catch (const std::exception& e) {
@@ -151,7 +169,122 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     }
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    return true;
+}
+
+bool CCoinsViewDB::ComputeTxOutSetCommitment(CTxOutSetCommitment &commitment) const {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    pcursor->SeekToFirst();
+
+    commitment = CTxOutSetCommitment();
+    commitment.hashBlock = GetBestBlock();
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType == DB_COINS) {
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CCoins coins;
+                ssValue >> coins;
+                uint256 txhash;
+                ssKey >> txhash;
+                commitment.AddCoins(txhash, coins);
+            }
+            pcursor->Next();
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CCoinsViewDB::DumpSnapshot(CAutoFile &fileout, CCoinsStats &stats) const {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    pcursor->SeekToFirst();
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    stats.hashBlock = GetBestBlock();
+    ss << stats.hashBlock;
+    try {
+        fileout << FLATDATA(Params().MessageStart()) << TXOUTSET_SNAPSHOT_VERSION << stats.hashBlock;
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType == DB_COINS) {
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CCoins coins;
+                ssValue >> coins;
+                uint256 txhash;
+                ssKey >> txhash;
+                HashCoinsStats(ss, stats, txhash, coins);
+                stats.nSerializedSize += 32 + slValue.size();
+                fileout << txhash << coins;
+            }
+            pcursor->Next();
+        }
+        fileout << uint256();
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+    stats.hashSerialized = ss.GetHash();
+    return true;
+}
+
+bool CCoinsViewDB::LoadSnapshot(CAutoFile &filein, bool fWrite, CCoinsStats &stats) {
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    CLevelDBBatch batch;
+    size_t nBatchSize = 0;
+    try {
+        unsigned char pchMessageStart[MESSAGE_START_SIZE];
+        int nVersion;
+        filein >> FLATDATA(pchMessageStart) >> nVersion >> stats.hashBlock;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0 || nVersion != TXOUTSET_SNAPSHOT_VERSION)
+            return error("%s: not a UTXO set snapshot for this network, or of an unknown version", __func__);
+        ss << stats.hashBlock;
+        while (true) {
+            boost::this_thread::interruption_point();
+            uint256 txhash;
+            filein >> txhash;
+            if (txhash.IsNull())
+                break;
+            CCoins coins;
+            filein >> coins;
+            if (coins.IsPruned())
+                return error("%s: snapshot holds spent coins for %s", __func__, txhash.ToString());
+            HashCoinsStats(ss, stats, txhash, coins);
+            unsigned int nSize = ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+            stats.nSerializedSize += 32 + nSize;
+            if (fWrite) {
+                BatchWriteCoins(batch, txhash, coins);
+                nBatchSize += 32 + nSize;
+                if (nBatchSize > 16 * 1000 * 1000) {
+                    if (!db.WriteBatch(batch))
+                        return false;
+                    batch = CLevelDBBatch();
+                    nBatchSize = 0;
+                }
+            }
+        }
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+    stats.hashSerialized = ss.GetHash();
+
+    if (fWrite) {
+        // The best block is written last, so an interrupted load leaves the
+        // database at its previous best block.
+        BatchWriteHashBestChain(batch, stats.hashBlock);
+        if (!db.WriteBatch(batch))
+            return false;
+    }
     return true;
 }
 
@@ -171,13 +304,18 @@ bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair(DB_TXINDEX, txid), pos);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
+bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect, const CBlockLocator &locator) {
     CLevelDBBatch batch;
     for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
         batch.Write(make_pair(DB_TXINDEX, it->first), it->second);
+    batch.Write(DB_TXINDEX_BEST_BLOCK, locator);
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadTxIndexBestBlock(CBlockLocator &locator) {
+    return Read(DB_TXINDEX_BEST_BLOCK, locator);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
 }
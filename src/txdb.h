@@ -14,8 +14,10 @@
 #include <utility>
 #include <vector>
 
+class CAutoFile;
 class CBlockFileInfo;
 class CBlockIndex;
+struct CBlockLocator;
 struct CDiskTxPos;
 class uint256;
 
@@ -25,12 +27,15 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! Version of the UTXO set snapshot format written by dumptxoutset
+static const int TXOUTSET_SNAPSHOT_VERSION = 1;
 
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+    CTxOutSetCommitment commitmentToWrite;
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
@@ -39,6 +44,24 @@ public:
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Write commitment with the next batch whose best block it belongs to
+    void SetTxOutSetCommitment(const CTxOutSetCommitment &commitment);
+    bool ReadTxOutSetCommitment(CTxOutSetCommitment &commitment) const;
+    //! Build the UTXO set commitment for the best block by scanning the whole database
+    bool ComputeTxOutSetCommitment(CTxOutSetCommitment &commitment) const;
+
+    /**
+     * Write the whole coin set to a snapshot file: a header with the best block hash, then every
+     * (txid, coins) pair in database order, ended by a null txid. stats is filled in as by GetStats,
+     * so the snapshot is identified by the hash_serialized gettxoutsetinfo reports at that block.
+     */
+    bool DumpSnapshot(CAutoFile &fileout, CCoinsStats &stats) const;
+    /**
+     * Read a snapshot written by DumpSnapshot and fill in its stats (except nHeight). With fWrite,
+     * also store its coins and make its block the best block; the database must be empty then.
+     */
+    bool LoadSnapshot(CAutoFile &filein, bool fWrite, CCoinsStats &stats);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -56,7 +79,9 @@ public:
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    //! Write index entries together with the block the index is now complete up to
+    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list, const CBlockLocator &locator);
+    bool ReadTxIndexBestBlock(CBlockLocator &locator);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
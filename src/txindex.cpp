@@ -0,0 +1,55 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txindex.h"
+
+#include "chain.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+CTxIndex *ptxindex = NULL;
+
+bool CTxIndex::ReadBestBlock(CBlockLocator& locator)
+{
+    if (pblocktree->ReadTxIndexBestBlock(locator))
+        return true;
+
+    // Older versions maintained the index inline and only recorded that it
+    // was enabled, so it is complete up to the tip.
+    bool fInlineIndex = false;
+    if (!pblocktree->ReadFlag("txindex", fInlineIndex) || !fInlineIndex)
+        return false;
+    {
+        LOCK(cs_main);
+        if (!chainActive.Tip())
+            return false;
+        locator = chainActive.GetLocator();
+    }
+    vector<pair<uint256, CDiskTxPos> > vNone;
+    if (!pblocktree->WriteTxIndex(vNone, locator) || !pblocktree->WriteFlag("txindex", false))
+        return error("%s: failed to write transaction index", __func__);
+    return true;
+}
+
+bool CTxIndex::AppendBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        vPos.push_back(make_pair(tx.GetHash(), pos));
+        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+    }
+    return true;
+}
+
+bool CTxIndex::Commit(const CBlockLocator& locator)
+{
+    if (!pblocktree->WriteTxIndex(vPos, locator))
+        return false;
+    vPos.clear();
+    return true;
+}
@@ -0,0 +1,36 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXINDEX_H
+#define BITCOIN_TXINDEX_H
+
+#include "baseindex.h"
+#include "main.h"
+
+#include <vector>
+
+/**
+ * Maintains the transaction index (-txindex) in the block tree database.
+ * Entries of blocks that are rewound are left in place: they still point
+ * at a copy of the transaction on disk, and are overwritten if it is
+ * confirmed again.
+ */
+class CTxIndex : public CBaseIndex
+{
+private:
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+
+protected:
+    const char* GetName() const { return "txindex"; }
+    bool ReadBestBlock(CBlockLocator& locator);
+    bool AppendBlock(const CBlock& block, const CBlockIndex* pindex);
+    bool RewindBlock(const CBlockIndex* pindex) { return true; }
+    size_t GetPendingCount() const { return vPos.size(); }
+    bool Commit(const CBlockLocator& locator);
+};
+
+/** The transaction index, if -txindex is enabled. */
+extern CTxIndex *ptxindex;
+
+#endif // BITCOIN_TXINDEX_H
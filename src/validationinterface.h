@@ -9,6 +9,7 @@
 #include <boost/signals2/signal.hpp>
 
 class CBlock;
+class CBlockIndex;
 struct CBlockLocator;
 class CTransaction;
 class CValidationInterface;
@@ -27,10 +28,13 @@ void UnregisterAllValidationInterfaces();
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL);
 
 class CValidationInterface {
+public:
+    virtual ~CValidationInterface() {}
 protected:
     virtual void SyncTransaction(const CTransaction &tx, const CBlock *pblock) {}
     virtual void EraseFromWallet(const uint256 &hash) {}
     virtual void SetBestChain(const CBlockLocator &locator) {}
+    virtual void UpdatedBlockTip(const CBlockIndex *pindex) {}
     virtual void UpdatedTransaction(const uint256 &hash) {}
     virtual void Inventory(const uint256 &hash) {}
     virtual void ResendWalletTransactions(int64_t nBestBlockTime) {}
@@ -49,6 +53,8 @@ struct CMainSignals {
     boost::signals2::signal<void (const uint256 &)> UpdatedTransaction;
     /** Notifies listeners of a new active block chain. */
     boost::signals2::signal<void (const CBlockLocator &)> SetBestChain;
+    /** Notifies listeners when the block chain tip advances, also during initial block download. */
+    boost::signals2::signal<void (const CBlockIndex *)> UpdatedBlockTip;
     /** Notifies listeners about an inventory item being seen on the network. */
     boost::signals2::signal<void (const uint256 &)> Inventory;
     /** Tells listeners to broadcast their data. */
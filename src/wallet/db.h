@@ -274,11 +274,12 @@ public:
         return true;
     }
 
-    bool TxnCommit()
+    /** Commit the active transaction; with fSync, wait for its log records to reach the disk. */
+    bool TxnCommit(bool fSync = false)
     {
         if (!pdb || !activeTxn)
             return false;
-        int ret = activeTxn->commit(0);
+        int ret = activeTxn->commit(fSync ? DB_TXN_SYNC : 0);
         activeTxn = NULL;
         return (ret == 0);
     }
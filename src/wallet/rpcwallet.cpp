@@ -20,6 +20,7 @@
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 
 #include "json/json_spirit_utils.h"
 #include "json/json_spirit_value.h"
@@ -1371,6 +1372,17 @@ void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Ar
     }
 }
 
+static bool ListTxItem(const string& strAccount, const isminefilter& filter, int nMax, Array& ret, const CWallet::TxItems::value_type& item)
+{
+    CWalletTx *const pwtx = item.second.first;
+    if (pwtx != 0)
+        ListTransactions(*pwtx, strAccount, 0, true, ret, filter);
+    CAccountingEntry *const pacentry = item.second.second;
+    if (pacentry != 0)
+        AcentryToJSON(*pacentry, strAccount, ret);
+    return (int)ret.size() < nMax;
+}
+
 Value listtransactions(const Array& params, bool fHelp)
 {
     if (!EnsureWalletIsAvailable(fHelp))
@@ -1451,21 +1463,9 @@ Value listtransactions(const Array& params, bool fHelp)
 
     Array ret;
 
+    // Walk back from the newest transaction until we have nCount items to return
     std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
-
-    // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
-    {
-        CWalletTx *const pwtx = (*it).second.first;
-        if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret, filter);
-        CAccountingEntry *const pacentry = (*it).second.second;
-        if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
-
-        if ((int)ret.size() >= (nCount+nFrom)) break;
-    }
+    pwalletMain->WalkOrderedTxItems(acentries, strAccount, boost::bind(&ListTxItem, boost::cref(strAccount), filter, nCount + nFrom, boost::ref(ret), _1));
     // ret is newest to oldest
 
     if (nFrom > (int)ret.size())
@@ -1638,12 +1638,21 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (depth == -1)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions, filter);
+        for (map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions, filter);
+    }
+    else
+    {
+        // Only transactions in the blocks above pindex, or in none, qualify
+        std::vector<const CWalletTx*> vwtx;
+        pwalletMain->GetTransactionsAfterHeight(pindex->nHeight, vwtx);
+        BOOST_FOREACH(const CWalletTx* pwtx, vwtx)
+        {
+            if (pwtx->GetDepthInMainChain() < depth)
+                ListTransactions(*pwtx, "*", 0, true, transactions, filter);
+        }
     }
 
     CBlockIndex *pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
@@ -2187,6 +2196,11 @@ Value getwalletinfo(const Array& params, bool fHelp)
             "  \"keypoololdest\": xxxxxx,    (numeric) the timestamp (seconds since GMT epoch) of the oldest pre-generated key in the key pool\n"
             "  \"keypoolsize\": xxxx,        (numeric) how many new keys are pre-generated\n"
             "  \"unlocked_until\": ttt,      (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
+            "  \"scanning\":                 (json object) current rescan details, or false if the wallet is not rescanning\n"
+            "    {\n"
+            "      \"duration\" : xxxx,        (numeric) elapsed seconds since the rescan started\n"
+            "      \"progress\" : x.xxxx,      (numeric) fraction of the rescan done\n"
+            "    }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getwalletinfo", "")
@@ -2205,9 +2219,90 @@ Value getwalletinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
     if (pwalletMain->IsCrypted())
         obj.push_back(Pair("unlocked_until", nWalletUnlockTime));
+    if (pwalletMain->IsScanning()) {
+        Object scanning;
+        scanning.push_back(Pair("duration", pwalletMain->ScanningDuration() / 1000));
+        scanning.push_back(Pair("progress", pwalletMain->ScanningProgress()));
+        obj.push_back(Pair("scanning", scanning));
+    } else {
+        obj.push_back(Pair("scanning", false));
+    }
     return obj;
 }
 
+Value rescanblockchain(const Array& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return Value::null;
+
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "rescanblockchain ( start_height stop_height )\n"
+            "\nRescan the local blockchain for wallet related transactions.\n"
+            "The node keeps running while the rescan is in progress; see getwalletinfo for its\n"
+            "progress, and abortrescan to stop it.\n"
+            "\nArguments:\n"
+            "1. start_height    (numeric, optional, default=0) block height where the rescan should start\n"
+            "2. stop_height     (numeric, optional) the last block height that should be scanned (default: the tip)\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"start_height\"     (numeric) The block height where the rescan started\n"
+            "  \"stop_height\"      (numeric) The last block height that was scanned\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("rescanblockchain", "100000 120000")
+            + HelpExampleRpc("rescanblockchain", "100000, 120000")
+        );
+
+    CBlockIndex *pindexStart = NULL;
+    CBlockIndex *pindexStop = NULL;
+    {
+        LOCK(cs_main);
+        int nStartHeight = params.size() > 0 ? params[0].get_int() : 0;
+        int nStopHeight = params.size() > 1 ? params[1].get_int() : chainActive.Height();
+        if (nStartHeight < 0 || nStartHeight > chainActive.Height())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid start_height");
+        if (nStopHeight < nStartHeight || nStopHeight > chainActive.Height())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid stop_height");
+        pindexStart = chainActive[nStartHeight];
+        pindexStop = chainActive[nStopHeight];
+    }
+
+    // The rescan takes cs_main and cs_wallet itself, a block at a time
+    if (pwalletMain->ScanForWalletTransactions(pindexStart, true, pindexStop) < 0)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
+    if (pwalletMain->IsAbortingRescan())
+        throw JSONRPCError(RPC_MISC_ERROR, "Rescan aborted by user.");
+    pwalletMain->MarkDirty();
+
+    Object ret;
+    ret.push_back(Pair("start_height", pindexStart->nHeight));
+    ret.push_back(Pair("stop_height", pindexStop->nHeight));
+    return ret;
+}
+
+Value abortrescan(const Array& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return Value::null;
+
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "\nStops the current wallet rescan, as started by rescanblockchain or an import.\n"
+            "\nResult:\n"
+            "true|false    (boolean) Whether a rescan was running\n"
+            "\nExamples:\n"
+            + HelpExampleCli("abortrescan", "")
+            + HelpExampleRpc("abortrescan", "")
+        );
+
+    if (!pwalletMain->IsScanning())
+        return false;
+    pwalletMain->AbortRescan();
+    return true;
+}
+
 Value resendwallettransactions(const Array& params, bool fHelp)
 {
     if (!EnsureWalletIsAvailable(fHelp))
@@ -2,8 +2,17 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "main.h"
+#include "miner.h"
+#include "pow.h"
+#include "script/sign.h"
+#include "script/standard.h"
 #include "txmempool.h"
 #include "wallet/wallet.h"
+#include "wallet/wallet_ismine.h"
 
 #include <set>
 #include <stdint.h>
@@ -12,6 +21,7 @@
 
 #include "test/test_bitcoin.h"
 
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
@@ -24,8 +34,42 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
+/** Regtest chain, so the tests can mine the blocks they need. */
+struct RegtestWalletSetup : public TestingSetup {
+    RegtestWalletSetup() : TestingSetup(CBaseChainParams::REGTEST) {}
+
+    /** Create a block on the tip paying to scriptPubKey and containing txns, but do not connect it. */
+    CBlock CreateBlock(const std::vector<CMutableTransaction>& txns, const CScript& scriptPubKey)
+    {
+        CBlockTemplate* pblocktemplate = CreateNewBlock(scriptPubKey);
+        CBlock block = pblocktemplate->block;
+        delete pblocktemplate;
+
+        BOOST_FOREACH(const CMutableTransaction& tx, txns)
+            block.vtx.push_back(tx);
+        unsigned int nExtraNonce = 0;
+        {
+            LOCK(cs_main);
+            IncrementExtraNonce(&block, chainActive.Tip(), nExtraNonce);
+        }
+        while (!CheckProofOfWork(block.GetPoWHash(), block.nBits, Params().GetConsensus(chainActive.Height() + 1)))
+            ++block.nNonce;
+        return block;
+    }
+
+    CBlock CreateAndProcessBlock(const std::vector<CMutableTransaction>& txns, const CScript& scriptPubKey)
+    {
+        CBlock block = CreateBlock(txns, scriptPubKey);
+        CValidationState state;
+        BOOST_CHECK(ProcessNewBlock(state, NULL, &block, true, NULL));
+        return block;
+    }
+};
+
 BOOST_FIXTURE_TEST_SUITE(wallet_tests, TestingSetup)
 
 static CWallet wallet;
@@ -308,6 +352,117 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_without_change)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+    empty_wallet();
+
+    add_coin( 6*CENT);
+    add_coin( 7*CENT);
+    add_coin( 8*CENT);
+    add_coin(20*CENT);
+    add_coin(30*CENT);
+
+    // making 16 cents, the 20 cent coin is closest but leaves change
+    BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 20 * CENT);
+
+    // if up to 5 cents may go without change, 6+7+8 = 21 cents will do
+    BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, 5 * CENT));
+    BOOST_CHECK_EQUAL(nValueRet, 21 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 3U);
+
+    // a wallet with far more coins than the stochastic selection looks at
+    empty_wallet();
+    for (int i = 0; i < 20000; i++)
+        add_coin(1 * COIN);
+    add_coin(COIN / 2);
+
+    // the exact match is found without trying every subset of equal coins
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1000 * COIN + COIN / 2, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1000 * COIN + COIN / 2);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1001U);
+
+    // and without one, enough coins are still selected
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1000 * COIN + COIN / 4, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_GE(nValueRet, 1000 * COIN + COIN / 4);
+    BOOST_CHECK_LE(nValueRet, 1001 * COIN);
+
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(keypool_topup_batch)
+{
+    LOCK(pwalletMain->cs_wallet);
+
+    // The keys of a top-up are written in one database transaction
+    unsigned int nSize = pwalletMain->GetKeyPoolSize();
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nSize + 200));
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nSize + 201);
+
+    // and their pool entries can be read back
+    CPubKey pubkey;
+    BOOST_CHECK(pwalletMain->GetKeyFromPool(pubkey));
+    BOOST_CHECK(pwalletMain->HaveKey(pubkey.GetID()));
+}
+
+/** Wallet that fails to store keys once it has stored nKeysLeft more. */
+class CFailingKeyWallet : public CWallet
+{
+public:
+    int nKeysLeft;
+
+    CFailingKeyWallet(const std::string& strWalletFileIn) : CWallet(strWalletFileIn), nKeysLeft(-1) {}
+
+    bool AddKeyPubKey(const CKey& key, const CPubKey& pubkey)
+    {
+        if (nKeysLeft == 0)
+            return false;
+        if (nKeysLeft > 0)
+            nKeysLeft--;
+        return CWallet::AddKeyPubKey(key, pubkey);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(keypool_new_rollback)
+{
+    // A new key pool that fails half way leaves the old one in place, in
+    // memory as in the file
+    CFailingKeyWallet walletFail("wallet_keypool_rollback.dat");
+    bool fFirstRun;
+    BOOST_CHECK_EQUAL(walletFail.LoadWallet(fFirstRun), DB_LOAD_OK);
+    LOCK(walletFail.cs_wallet);
+    BOOST_CHECK(walletFail.TopUpKeyPool(5));
+
+    std::set<int64_t> setKeyPool = walletFail.setKeyPool;
+    std::set<CKeyID> setKeys;
+    walletFail.GetKeys(setKeys);
+    std::map<CKeyID, CKeyMetadata> mapKeyMetadata = walletFail.mapKeyMetadata;
+    BOOST_CHECK_EQUAL(setKeyPool.size(), 6U);
+
+    walletFail.nKeysLeft = 3;
+    BOOST_CHECK_THROW(walletFail.NewKeyPool(), std::runtime_error);
+    walletFail.nKeysLeft = -1;
+
+    BOOST_CHECK(walletFail.setKeyPool == setKeyPool);
+    std::set<CKeyID> setKeysAfter;
+    walletFail.GetKeys(setKeysAfter);
+    BOOST_CHECK(setKeysAfter == setKeys);
+    BOOST_CHECK_EQUAL(walletFail.mapKeyMetadata.size(), mapKeyMetadata.size());
+    BOOST_FOREACH(const PAIRTYPE(CKeyID, CKeyMetadata)& item, mapKeyMetadata)
+        BOOST_CHECK(walletFail.mapKeyMetadata.count(item.first));
+
+    CWalletDB walletdb(walletFail.strWalletFile);
+    BOOST_FOREACH(int64_t nIndex, setKeyPool)
+    {
+        CKeyPool keypool;
+        BOOST_CHECK(walletdb.ReadPool(nIndex, keypool));
+    }
+}
+
 BOOST_AUTO_TEST_CASE(GetMinimumFee_test)
 {
     uint64_t value = 1000 * COIN; // 1,000 DOGE
@@ -343,4 +498,313 @@ BOOST_AUTO_TEST_CASE(GetMinimumFee_dust_test)
     BOOST_CHECK_EQUAL(CWallet::GetMinimumFee(tx, 1999, 0, pool), 3 * nMinTxFee);
 }
 
+BOOST_AUTO_TEST_CASE(ismine_script_map)
+{
+    // The precomputed script set must agree with the full IsMine evaluation
+    CWallet keystore;
+    LOCK(keystore.cs_wallet);
+
+    CKey key1, key2, key3;
+    key1.MakeNewKey(true);
+    key2.MakeNewKey(false);
+    key3.MakeNewKey(true);
+    CPubKey pub1 = key1.GetPubKey(), pub2 = key2.GetPubKey(), pub3 = key3.GetPubKey();
+
+    // A redeem script known before its keys
+    CScript multisig = GetScriptForMultisig(1, std::vector<CPubKey>(1, pub1));
+    BOOST_CHECK(keystore.AddCScript(multisig));
+    BOOST_CHECK(keystore.AddKeyPubKey(key1, pub1));
+    BOOST_CHECK(keystore.AddKeyPubKey(key2, pub2));
+
+    CScript watched = GetScriptForDestination(pub3.GetID());
+    BOOST_CHECK(keystore.AddWatchOnly(watched));
+
+    std::vector<CScript> scripts;
+    GetScriptsForKey(pub1, scripts);
+    GetScriptsForKey(pub2, scripts);
+    GetScriptsForKey(pub3, scripts);
+    scripts.push_back(multisig);
+    scripts.push_back(GetScriptForDestination(CScriptID(multisig)));
+    scripts.push_back(GetScriptForDestination(CScriptID(watched)));
+    // P2PK with a non-minimal push is not a key script and must fall back
+    scripts.push_back(CScript() << OP_PUSHDATA1 << ToByteVector(pub1) << OP_CHECKSIG);
+    scripts.push_back(CScript() << OP_RETURN << ToByteVector(pub1.GetID()));
+    scripts.push_back(CScript() << OP_TRUE);
+
+    BOOST_FOREACH(const CScript& script, scripts)
+        BOOST_CHECK_EQUAL(keystore.IsMine(script), ::IsMine(keystore, script));
+    BOOST_CHECK_EQUAL(keystore.IsMine(watched), ISMINE_WATCH_ONLY);
+    BOOST_CHECK_EQUAL(keystore.IsMine(GetScriptForDestination(pub2.GetID())), ISMINE_SPENDABLE);
+
+    BOOST_CHECK(keystore.RemoveWatchOnly(watched));
+    BOOST_FOREACH(const CScript& script, scripts)
+        BOOST_CHECK_EQUAL(keystore.IsMine(script), ::IsMine(keystore, script));
+    BOOST_CHECK_EQUAL(keystore.IsMine(watched), ISMINE_NO);
+}
+
+BOOST_AUTO_TEST_CASE(cached_balances)
+{
+    // Balances and available coins follow the wallet's transactions as they
+    // enter and leave the mempool
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+    CScript script = GetScriptForDestination(key.GetPubKey().GetID());
+
+    CMutableTransaction receive;
+    receive.vin.resize(1);
+    receive.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    receive.vout.push_back(CTxOut(10 * COIN, script));
+    CWalletTx wtxReceive(pwalletMain, receive);
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxReceive, false, &walletdb));
+
+    // Neither confirmed nor in the mempool
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), 0);
+    mempool.addUnchecked(wtxReceive.GetHash(), CTxMemPoolEntry(wtxReceive, 0, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), 10 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 0);
+
+    // Spend it with change back to us, which is trusted
+    CMutableTransaction spend;
+    spend.vin.push_back(CTxIn(wtxReceive.GetHash(), 0));
+    spend.vout.push_back(CTxOut(4 * COIN, script));
+    spend.vout.push_back(CTxOut(5 * COIN, CScript() << OP_TRUE));
+    CWalletTx wtxSpend(pwalletMain, spend);
+    mempool.addUnchecked(wtxSpend.GetHash(), CTxMemPoolEntry(wtxSpend, 0, 0, 0.0, 1));
+    pwalletMain->SyncTransaction(wtxSpend, NULL);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), 0);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 4 * COIN);
+
+    vector<COutput> vAvailable;
+    pwalletMain->AvailableCoins(vAvailable);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 1U);
+    BOOST_CHECK(vAvailable[0].tx->GetHash() == wtxSpend.GetHash() && vAvailable[0].i == 0);
+
+    // Once the spend is dropped as a conflict, of which the wallet is told,
+    // the output it spent is available again
+    std::list<CTransaction> removed;
+    mempool.remove(wtxSpend, removed);
+    pwalletMain->SyncTransaction(wtxSpend, NULL);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 0);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), 10 * COIN);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 1U);
+    BOOST_CHECK(vAvailable[0].tx->GetHash() == wtxReceive.GetHash());
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(cached_balances_time_lock)
+{
+    // A cached balance must not outlive the time lock of a transaction in it
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime);
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+
+    CMutableTransaction locked;
+    locked.vin.resize(1);
+    locked.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    locked.vin[0].nSequence = 0;
+    locked.nLockTime = nStartTime + 60;
+    locked.vout.push_back(CTxOut(3 * COIN, GetScriptForDestination(key.GetPubKey().GetID())));
+    CWalletTx wtxLocked(pwalletMain, locked);
+    CAmount nPending = pwalletMain->GetUnconfirmedBalance();
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxLocked, false, &walletdb));
+
+    // Not final yet, so it counts as pending although it is not in the mempool
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nPending + 3 * COIN);
+    SetMockTime(nStartTime + 60);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nPending + 3 * COIN);
+    SetMockTime(nStartTime + 61);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nPending);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(ordered_tx_index)
+{
+    // The order index follows mapWallet, newest last, and unconfirmed
+    // transactions are always listed as possibly since any block
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+
+    vector<uint256> vHashes;
+    for (int i = 0; i < 3; i++)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+        CWalletTx wtx(pwalletMain, tx);
+        BOOST_CHECK(pwalletMain->AddToWallet(wtx, false, &walletdb));
+        vHashes.push_back(wtx.GetHash());
+    }
+    BOOST_CHECK_EQUAL(pwalletMain->wtxOrdered.size(), pwalletMain->mapWallet.size());
+    BOOST_CHECK(pwalletMain->wtxOrdered.rbegin()->second.first->GetHash() == vHashes[2]);
+
+    int64_t nLastPos = -1;
+    BOOST_FOREACH(const CWallet::TxItems::value_type& item, pwalletMain->wtxOrdered)
+    {
+        BOOST_CHECK(item.first > nLastPos);
+        BOOST_CHECK_EQUAL(item.first, item.second.first->nOrderPos);
+        nLastPos = item.first;
+    }
+
+    vector<const CWalletTx*> vwtx;
+    pwalletMain->GetTransactionsAfterHeight(chainActive.Height(), vwtx);
+    set<uint256> setListed;
+    BOOST_FOREACH(const CWalletTx* pwtx, vwtx)
+        setListed.insert(pwtx->GetHash());
+    BOOST_FOREACH(const uint256& hash, vHashes)
+        BOOST_CHECK(setListed.count(hash));
+
+    pwalletMain->EraseFromWallet(vHashes[2]);
+    BOOST_CHECK_EQUAL(pwalletMain->wtxOrdered.size(), pwalletMain->mapWallet.size());
+    BOOST_CHECK(pwalletMain->wtxOrdered.rbegin()->second.first->GetHash() == vHashes[1]);
+
+    // A transaction loaded again under another position moves in the index
+    CWalletTx wtxMoved = pwalletMain->mapWallet[vHashes[0]];
+    wtxMoved.nOrderPos = pwalletMain->nOrderPosNext + 10;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxMoved, true, NULL));
+    BOOST_CHECK_EQUAL(pwalletMain->wtxOrdered.size(), pwalletMain->mapWallet.size());
+    BOOST_CHECK(pwalletMain->wtxOrdered.rbegin()->second.first->GetHash() == vHashes[0]);
+    BOOST_CHECK_EQUAL(pwalletMain->wtxOrdered.rbegin()->first, wtxMoved.nOrderPos);
+
+    // The merged walk visits the index newest first
+    std::list<CAccountingEntry> acentries;
+    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries);
+    BOOST_CHECK_EQUAL(txOrdered.size(), pwalletMain->wtxOrdered.size() + acentries.size());
+    BOOST_CHECK(txOrdered.rbegin()->second.first->GetHash() == vHashes[0]);
+}
+
+BOOST_AUTO_TEST_CASE(load_tx_batches)
+{
+    // Transactions read in several batches on several threads load as they
+    // do in a single batch read in order, including the order repair and
+    // the upgrade of old records
+    vector<CWalletTx> vWtx;
+    for (int i = 0; i < 20; i++)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.push_back(CTxOut(COIN + i, CScript() << OP_TRUE));
+        CWalletTx wtx(NULL, tx);
+        wtx.nTimeReceived = 1000 + i;
+        wtx.nOrderPos = i % 5 == 0 ? -1 : i;
+        if (i == 7)
+            wtx.fTimeReceivedIsTxTime = 31500;
+        vWtx.push_back(wtx);
+    }
+    const char* pszFiles[] = {"wallet_load_serial.dat", "wallet_load_batched.dat"};
+    BOOST_FOREACH(const char* pszFile, pszFiles)
+    {
+        CWalletDB walletdb(pszFile, "cr+");
+        BOOST_FOREACH(const CWalletTx& wtx, vWtx)
+            BOOST_CHECK(walletdb.WriteTx(wtx.GetHash(), wtx));
+    }
+
+    bool fFirstRun;
+    nWalletLoadThreads = 1;
+    CWallet walletSerial(pszFiles[0]);
+    BOOST_CHECK_EQUAL(walletSerial.LoadWallet(fFirstRun), DB_LOAD_OK);
+    nWalletLoadTxBatch = 8;
+    nWalletLoadThreads = 3;
+    CWallet walletBatched(pszFiles[1]);
+    BOOST_CHECK_EQUAL(walletBatched.LoadWallet(fFirstRun), DB_LOAD_OK);
+    nWalletLoadTxBatch = DEFAULT_WALLET_LOAD_TX_BATCH;
+    nWalletLoadThreads = 0;
+
+    LOCK2(walletSerial.cs_wallet, walletBatched.cs_wallet);
+    BOOST_CHECK_EQUAL(walletBatched.mapWallet.size(), vWtx.size());
+    BOOST_CHECK_EQUAL(walletSerial.mapWallet.size(), vWtx.size());
+    set<int64_t> setOrderPos;
+    BOOST_FOREACH(const CWalletTx& wtx, vWtx)
+    {
+        uint256 hash = wtx.GetHash();
+        BOOST_CHECK(walletSerial.mapWallet.count(hash) && walletBatched.mapWallet.count(hash));
+        const CWalletTx& wtxBatched = walletBatched.mapWallet[hash];
+        BOOST_CHECK_EQUAL(wtxBatched.nOrderPos, walletSerial.mapWallet[hash].nOrderPos);
+        BOOST_CHECK_EQUAL(wtxBatched.nTimeReceived, wtx.nTimeReceived);
+        BOOST_CHECK_EQUAL(wtxBatched.fTimeReceivedIsTxTime, 0U);
+        BOOST_CHECK(wtxBatched.nOrderPos >= 0);
+        setOrderPos.insert(wtxBatched.nOrderPos);
+    }
+    BOOST_CHECK_EQUAL(setOrderPos.size(), vWtx.size());
+    BOOST_CHECK_EQUAL(walletBatched.wtxOrdered.size(), vWtx.size());
+}
+
+static CBlock* pblockDuringRescan = NULL;
+static uint256 hashRescanTrigger;
+
+static void ConnectBlockDuringRescan(CWallet* pwallet, const uint256& hashTx, ChangeType status)
+{
+    if (hashTx != hashRescanTrigger || !pblockDuringRescan)
+        return;
+    CBlock* pblock = pblockDuringRescan;
+    pblockDuringRescan = NULL;
+    CValidationState state;
+    BOOST_CHECK(ProcessNewBlock(state, NULL, pblock, true, NULL));
+}
+
+BOOST_FIXTURE_TEST_CASE(rescan_connects_during_drain, RegtestWalletSetup)
+{
+    // A block connected while the rescan is still adding earlier blocks must
+    // be scanned too: the wallet does not know the outputs it spends yet, so
+    // SyncTransaction alone would drop the spend.
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptOther = CScript() << OP_TRUE;
+
+    std::vector<CMutableTransaction> noTxns;
+    std::vector<CBlock> vBlocks;
+    for (int i = 1; i <= 12; i++)
+        vBlocks.push_back(CreateAndProcessBlock(noTxns, i <= 2 ? scriptMine : scriptOther));
+    BOOST_CHECK_EQUAL(chainActive.Height(), 12);
+
+    // Spend the second coinbase, which is mature from height 12 on
+    const CTransaction& txCoinbase = vBlocks[1].vtx[0];
+    CMutableTransaction spend;
+    spend.vin.push_back(CTxIn(txCoinbase.GetHash(), 0));
+    spend.vout.push_back(CTxOut(txCoinbase.vout[0].nValue - COIN, scriptOther));
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    BOOST_CHECK(SignSignature(keystore, txCoinbase, spend, 0));
+    CBlock blockSpend = CreateBlock(std::vector<CMutableTransaction>(1, spend), scriptOther);
+
+    CWallet walletRescan("wallet_rescan.dat");
+    bool fFirstRun;
+    BOOST_CHECK_EQUAL(walletRescan.LoadWallet(fFirstRun), DB_LOAD_OK);
+    {
+        LOCK(walletRescan.cs_wallet);
+        BOOST_CHECK(walletRescan.AddKeyPubKey(key, key.GetPubKey()));
+    }
+    RegisterValidationInterface(&walletRescan);
+    walletRescan.NotifyTransactionChanged.connect(boost::bind(&ConnectBlockDuringRescan, _1, _2, _3));
+
+    // Connect the spend as soon as the first coinbase is added, while the
+    // pipeline still holds the block with the one it spends
+    pblockDuringRescan = &blockSpend;
+    hashRescanTrigger = vBlocks[0].vtx[0].GetHash();
+    BOOST_CHECK_EQUAL(walletRescan.ScanForWalletTransactions(chainActive.Genesis(), true), 3);
+    BOOST_CHECK(pblockDuringRescan == NULL);
+    BOOST_CHECK_EQUAL(chainActive.Height(), 13);
+
+    {
+        LOCK2(cs_main, walletRescan.cs_wallet);
+        BOOST_CHECK(walletRescan.mapWallet.count(spend.GetHash()));
+        BOOST_CHECK(walletRescan.IsSpent(txCoinbase.GetHash(), 0));
+    }
+    UnregisterValidationInterface(&walletRescan);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -20,9 +20,13 @@
 #include "utilmoneystr.h"
 
 #include <assert.h>
+#include <deque>
+#include <limits>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -81,7 +85,7 @@ CPubKey CWallet::GenerateNewKey()
 
     // Compressed public keys were introduced in version 0.6.0
     if (fCompressed)
-        SetMinVersion(FEATURE_COMPRPUBKEY);
+        SetMinVersion(FEATURE_COMPRPUBKEY, pwalletdbKeyBatch);
 
     CPubKey pubkey = secret.GetPubKey();
     assert(secret.VerifyPubKey(pubkey));
@@ -92,16 +96,42 @@ CPubKey CWallet::GenerateNewKey()
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
+    if (pwalletdbKeyBatch)
+        vKeyBatchAdded.push_back(pubkey);
     if (!AddKeyPubKey(secret, pubkey))
         throw std::runtime_error("CWallet::GenerateNewKey(): AddKey failed");
     return pubkey;
 }
 
+void CWallet::AddScriptPubKey(const CScript& scriptPubKey, isminetype mine)
+{
+    LOCK(cs_KeyStore);
+    isminetype& entry = mapScriptPubKeys[scriptPubKey];
+    entry = std::max(entry, mine);
+}
+
+void CWallet::AddScriptPubKeysForKey(const CPubKey& pubkey)
+{
+    std::vector<CScript> vScripts;
+    GetScriptsForKey(pubkey, vScripts);
+    BOOST_FOREACH(const CScript& script, vScripts)
+        AddScriptPubKey(script, ISMINE_SPENDABLE);
+}
+
+void CWallet::AddScriptPubKeysForRedeemScript(const CScript& redeemScript)
+{
+    // Pay-to-script-hash outputs whose redeem script only becomes ours
+    // through keys added later are left to the full check in IsMine().
+    if (::IsMine(*this, redeemScript) == ISMINE_SPENDABLE)
+        AddScriptPubKey(GetScriptForDestination(CScriptID(redeemScript)), ISMINE_SPENDABLE);
+}
+
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    AddScriptPubKeysForKey(pubkey);
 
     // check if we need to remove from watch-only
     CScript script;
@@ -112,6 +142,10 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
+        if (pwalletdbKeyBatch)
+            return pwalletdbKeyBatch->WriteKey(pubkey,
+                                               secret.GetPrivKey(),
+                                               mapKeyMetadata[pubkey.GetID()]);
         return CWalletDB(strWalletFile).WriteKey(pubkey,
                                                  secret.GetPrivKey(),
                                                  mapKeyMetadata[pubkey.GetID()]);
@@ -124,6 +158,7 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    AddScriptPubKeysForKey(vchPubKey);
     if (!fFileBacked)
         return true;
     {
@@ -132,6 +167,10 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
             return pwalletdbEncryption->WriteCryptedKey(vchPubKey,
                                                         vchCryptedSecret,
                                                         mapKeyMetadata[vchPubKey.GetID()]);
+        else if (pwalletdbKeyBatch)
+            return pwalletdbKeyBatch->WriteCryptedKey(vchPubKey,
+                                                      vchCryptedSecret,
+                                                      mapKeyMetadata[vchPubKey.GetID()]);
         else
             return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey,
                                                             vchCryptedSecret,
@@ -150,15 +189,27 @@ bool CWallet::LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &meta)
     return true;
 }
 
+bool CWallet::LoadKey(const CKey& key, const CPubKey &pubkey)
+{
+    if (!CCryptoKeyStore::AddKeyPubKey(key, pubkey))
+        return false;
+    AddScriptPubKeysForKey(pubkey);
+    return true;
+}
+
 bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
-    return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    AddScriptPubKeysForKey(vchPubKey);
+    return true;
 }
 
 bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    AddScriptPubKeysForRedeemScript(redeemScript);
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -177,13 +228,17 @@ bool CWallet::LoadCScript(const CScript& redeemScript)
         return true;
     }
 
-    return CCryptoKeyStore::AddCScript(redeemScript);
+    if (!CCryptoKeyStore::AddCScript(redeemScript))
+        return false;
+    AddScriptPubKeysForRedeemScript(redeemScript);
+    return true;
 }
 
 bool CWallet::AddWatchOnly(const CScript &dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    AddScriptPubKey(dest, ISMINE_WATCH_ONLY);
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
@@ -196,6 +251,12 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    {
+        LOCK(cs_KeyStore);
+        ScriptPubKeyMap::iterator it = mapScriptPubKeys.find(dest);
+        if (it != mapScriptPubKeys.end() && it->second == ISMINE_WATCH_ONLY)
+            mapScriptPubKeys.erase(it);
+    }
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
@@ -207,7 +268,10 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
 
 bool CWallet::LoadWatchOnly(const CScript &dest)
 {
-    return CCryptoKeyStore::AddWatchOnly(dest);
+    if (!CCryptoKeyStore::AddWatchOnly(dest))
+        return false;
+    AddScriptPubKey(dest, ISMINE_WATCH_ONLY);
+    return true;
 }
 
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
@@ -452,6 +516,146 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
     return false;
 }
 
+/**
+ * Outpoint is spent in the chain if a wallet transaction in a block of the
+ * active chain spends it. Unlike IsSpent() this can only change with the
+ * chain, which the wallet hears about through SyncTransaction.
+ */
+bool CWallet::IsSpentInChain(const COutPoint& outpoint) const
+{
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+    range = mapTxSpends.equal_range(outpoint);
+
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+    {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0)
+            return true;
+    }
+    return false;
+}
+
+void CWallet::UpdateUnspentOutputs(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    fBalancesCached = false;
+    if (fUnspentOutputsDirty)
+        return; // rebuilt in full on next use
+
+    const uint256& hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        const COutPoint outpoint(hash, i);
+        if (IsMine(wtx.vout[i]) != ISMINE_NO && !IsSpentInChain(outpoint))
+            setUnspentOutputs.insert(outpoint);
+        else
+            setUnspentOutputs.erase(outpoint);
+    }
+
+    if (wtx.IsCoinBase())
+        return;
+
+    // The transaction was either just confirmed, and its inputs are gone,
+    // or it is unconfirmed, possibly because its block was disconnected,
+    // and the outputs it spends are back unless something else spends them.
+    bool fConfirmed = wtx.GetDepthInMainChain() > 0;
+    BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+    {
+        if (fConfirmed)
+        {
+            setUnspentOutputs.erase(txin.prevout);
+            continue;
+        }
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
+        if (mi == mapWallet.end() || txin.prevout.n >= mi->second.vout.size())
+            continue;
+        if (IsMine(mi->second.vout[txin.prevout.n]) != ISMINE_NO && !IsSpentInChain(txin.prevout))
+            setUnspentOutputs.insert(txin.prevout);
+    }
+}
+
+void CWallet::IndexTransactionBlock(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+    const uint256& hash = wtx.GetHash();
+    if (!wtx.hashBlock.IsNull())
+    {
+        bool fIndexed = false;
+        std::pair<std::multimap<uint256, uint256>::iterator, std::multimap<uint256, uint256>::iterator> range = mapTxByBlock.equal_range(wtx.hashBlock);
+        for (std::multimap<uint256, uint256>::iterator it = range.first; it != range.second && !fIndexed; ++it)
+            fIndexed = (it->second == hash);
+        if (!fIndexed)
+            mapTxByBlock.insert(range.second, std::make_pair(wtx.hashBlock, hash));
+    }
+    if (fUnconfirmedTxDirty)
+        return; // rebuilt in full on next use
+
+    // Transactions only enter or leave the active chain through here, when
+    // their block is connected or disconnected.
+    AssertLockHeld(cs_main);
+    if (wtx.GetDepthInMainChain() > 0)
+        setUnconfirmedTx.erase(hash);
+    else
+        setUnconfirmedTx.insert(hash);
+}
+
+void CWallet::GetTransactionsAfterHeight(int nHeight, std::vector<const CWalletTx*>& vwtx) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (fUnconfirmedTxDirty)
+    {
+        setUnconfirmedTx.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            if (it->second.GetDepthInMainChain() <= 0)
+                setUnconfirmedTx.insert(setUnconfirmedTx.end(), it->first);
+        fUnconfirmedTxDirty = false;
+    }
+
+    std::set<uint256> setHashes(setUnconfirmedTx);
+    for (const CBlockIndex* pindex = chainActive[std::max(nHeight + 1, 0)]; pindex; pindex = chainActive.Next(pindex))
+    {
+        std::pair<std::multimap<uint256, uint256>::const_iterator, std::multimap<uint256, uint256>::const_iterator> range = mapTxByBlock.equal_range(pindex->GetBlockHash());
+        for (std::multimap<uint256, uint256>::const_iterator it = range.first; it != range.second; ++it)
+            setHashes.insert(it->second);
+    }
+
+    vwtx.clear();
+    vwtx.reserve(setHashes.size());
+    BOOST_FOREACH(const uint256& hash, setHashes)
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+            vwtx.push_back(&mi->second);
+    }
+}
+
+const std::set<COutPoint>& CWallet::GetUnspentOutputs() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (fUnspentOutputsDirty)
+    {
+        int64_t nStart = GetTimeMillis();
+        setUnspentOutputs.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            const CWalletTx& wtx = it->second;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+            {
+                const COutPoint outpoint(it->first, i);
+                if (IsMine(wtx.vout[i]) != ISMINE_NO && !IsSpentInChain(outpoint))
+                    setUnspentOutputs.insert(setUnspentOutputs.end(), outpoint);
+            }
+        }
+        fUnspentOutputsDirty = false;
+        LogPrint("db", "Indexed %u unspent outputs of %u wallet transactions  %dms\n",
+                 setUnspentOutputs.size(), mapWallet.size(), GetTimeMillis() - nStart);
+    }
+    return setUnspentOutputs;
+}
+
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
@@ -578,29 +782,46 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+static bool InsertTxItem(CWallet::TxItems* ptxOrdered, const CWallet::TxItems::value_type& item)
 {
-    AssertLockHeld(cs_wallet); // mapWallet
-    CWalletDB walletdb(strWalletFile);
+    // Visited newest first, so each goes in front of those before it
+    ptxOrdered->insert(ptxOrdered->begin(), item);
+    return true;
+}
 
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
+CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+{
     TxItems txOrdered;
+    WalkOrderedTxItems(acentries, strAccount, boost::bind(&InsertTxItem, &txOrdered, _1));
+    return txOrdered;
+}
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
-    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
-    }
+void CWallet::WalkOrderedTxItems(std::list<CAccountingEntry>& acentries, const std::string& strAccount,
+                                 const boost::function<bool (const TxItems::value_type&)>& fn)
+{
+    AssertLockHeld(cs_wallet); // mapWallet
+
+    // The accounting entries are few, so they are read and sorted here and
+    // merged into the index of transactions as it is walked
     acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
+    if (fFileBacked)
+        CWalletDB(strWalletFile).ListAccountCreditDebit(strAccount, acentries);
+    TxItems txAccounting;
     BOOST_FOREACH(CAccountingEntry& entry, acentries)
+        txAccounting.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+
+    TxItems::reverse_iterator itTx = wtxOrdered.rbegin();
+    TxItems::reverse_iterator itAcc = txAccounting.rbegin();
+    while (itTx != wtxOrdered.rend() || itAcc != txAccounting.rend())
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        TxItems::reverse_iterator it;
+        if (itAcc != txAccounting.rend() && (itTx == wtxOrdered.rend() || itAcc->first >= itTx->first))
+            it = itAcc++;
+        else
+            it = itTx++;
+        if (!fn(*it))
+            break;
     }
-
-    return txOrdered;
 }
 
 void CWallet::MarkDirty()
@@ -609,7 +830,40 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // What is ours may have changed too (e.g. after an import)
+        fUnspentOutputsDirty = true;
+        fBalancesCached = false;
+    }
+}
+
+/**
+ * Visitor for WalkOrderedTxItems that stops at the newest wallet activity
+ * other than pwtxNew that is not later than nLatestTolerated.
+ */
+static bool FindLatestTime(const CWalletTx* pwtxNew, int64_t nLatestTolerated, int64_t* pnLatestEntry, int64_t* pnLatestNow,
+                           const CWallet::TxItems::value_type& item)
+{
+    const CWalletTx* pwtx = item.second.first;
+    if (pwtx == pwtxNew)
+        return true;
+    const CAccountingEntry* pacentry = item.second.second;
+    int64_t nSmartTime;
+    if (pwtx)
+    {
+        nSmartTime = pwtx->nTimeSmart;
+        if (!nSmartTime)
+            nSmartTime = pwtx->nTimeReceived;
+    }
+    else
+        nSmartTime = pacentry->nTime;
+    if (nSmartTime <= nLatestTolerated)
+    {
+        *pnLatestEntry = nSmartTime;
+        if (nSmartTime > *pnLatestNow)
+            *pnLatestNow = nSmartTime;
+        return false;
     }
+    return true;
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb)
@@ -618,8 +872,24 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
     if (fFromLoadWallet)
     {
-        mapWallet[hash] = wtxIn;
-        mapWallet[hash].BindWallet(this);
+        pair<map<uint256, CWalletTx>::iterator, bool> ret = mapWallet.insert(make_pair(hash, wtxIn));
+        CWalletTx& wtx = (*ret.first).second;
+        bool fReorder = ret.second;
+        if (!ret.second)
+        {
+            // The copy read again may have been given another position
+            if (wtx.nOrderPos != wtxIn.nOrderPos)
+            {
+                EraseOrderedTx(wtx);
+                fReorder = true;
+            }
+            wtx = wtxIn;
+        }
+        wtx.BindWallet(this);
+        if (fReorder)
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+        fUnconfirmedTxDirty = true;
+        IndexTransactionBlock(wtx);
         AddToSpends(hash);
     }
     else
@@ -634,6 +904,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext(pwalletdb);
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (!wtxIn.hashBlock.IsNull())
@@ -646,30 +917,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
                         std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
-                        {
-                            CWalletTx *const pwtx = (*it).second.first;
-                            if (pwtx == &wtx)
-                                continue;
-                            CAccountingEntry *const pacentry = (*it).second.second;
-                            int64_t nSmartTime;
-                            if (pwtx)
-                            {
-                                nSmartTime = pwtx->nTimeSmart;
-                                if (!nSmartTime)
-                                    nSmartTime = pwtx->nTimeReceived;
-                            }
-                            else
-                                nSmartTime = pacentry->nTime;
-                            if (nSmartTime <= latestTolerated)
-                            {
-                                latestEntry = nSmartTime;
-                                if (nSmartTime > latestNow)
-                                    latestNow = nSmartTime;
-                                break;
-                            }
-                        }
+                        WalkOrderedTxItems(acentries, "", boost::bind(&FindLatestTime, &wtx, latestTolerated, &latestEntry, &latestNow, _1));
                     }
 
                     int64_t blocktime = mapBlockIndex[wtxIn.hashBlock]->GetBlockTime();
@@ -715,6 +963,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        UpdateUnspentOutputs(wtx);
+        IndexTransactionBlock(wtx);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -777,14 +1027,35 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     }
 }
 
+void CWallet::EraseOrderedTx(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+    std::pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(wtx.nOrderPos);
+    for (TxItems::iterator it = range.first; it != range.second; ++it)
+    {
+        if (it->second.first == &wtx)
+        {
+            wtxOrdered.erase(it);
+            break;
+        }
+    }
+}
+
 void CWallet::EraseFromWallet(const uint256 &hash)
 {
     if (!fFileBacked)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            EraseOrderedTx(mi->second);
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
+        fUnspentOutputsDirty = true;
+        fBalancesCached = false;
     }
     return;
 }
@@ -821,9 +1092,29 @@ CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter& filter) const
     return 0;
 }
 
+isminetype CWallet::IsMine(const CScript& scriptPubKey) const
+{
+    {
+        LOCK(cs_KeyStore);
+        ScriptPubKeyMap::const_iterator it = mapScriptPubKeys.find(scriptPubKey);
+        isminetype mine = it != mapScriptPubKeys.end() ? it->second : ISMINE_NO;
+        if (mine == ISMINE_SPENDABLE)
+            return mine;
+        // Scripts of keys are all in the map, as are watch-only scripts,
+        // and unspendable scripts cannot be ours otherwise. A
+        // pay-to-script-hash output can only be ours through a redeem
+        // script we have.
+        if (IsKeyScript(scriptPubKey) || scriptPubKey.IsUnspendable())
+            return mine;
+        if (scriptPubKey.IsPayToScriptHash() && !HaveCScript(CScriptID(uint160(std::vector<unsigned char>(scriptPubKey.begin() + 2, scriptPubKey.begin() + 22)))))
+            return mine;
+    }
+    return ::IsMine(*this, scriptPubKey);
+}
+
 isminetype CWallet::IsMine(const CTxOut& txout) const
 {
-    return ::IsMine(*this, txout.scriptPubKey);
+    return IsMine(txout.scriptPubKey);
 }
 
 CAmount CWallet::GetCredit(const CTxOut& txout, const isminefilter& filter) const
@@ -842,7 +1133,7 @@ bool CWallet::IsChange(const CTxOut& txout) const
     // a better way of identifying which outputs are 'the send' and which are
     // 'the change' will need to be implemented (maybe extend CWalletTx to remember
     // which output, if any, was change).
-    if (::IsMine(*this, txout.scriptPubKey))
+    if (IsMine(txout.scriptPubKey))
     {
         CTxDestination address;
         if (!ExtractDestination(txout.scriptPubKey, address))
@@ -1052,49 +1343,252 @@ bool CWalletTx::WriteToDisk(CWalletDB *pwalletdb)
     return pwalletdb->WriteTx(GetHash(), *this);
 }
 
+namespace {
+
+/** Number of blocks a rescan reads ahead of the one it is adding to the wallet. */
+static const size_t RESCAN_READ_AHEAD = 64;
+
+/** A block on its way through CRescanPipeline. */
+struct CRescanBlock
+{
+    uint64_t nSequence;
+    CBlockIndex* pindex;
+    bool fRead;
+    CBlock block;
+    std::vector<bool> vfMine; //! Per transaction: whether any of its outputs is ours
+
+    CRescanBlock() : nSequence(0), pindex(NULL), fRead(false) {}
+};
+typedef boost::shared_ptr<CRescanBlock> CRescanBlockRef;
+
+/**
+ * Reads blocks for a rescan on worker threads on all cores and matches their
+ * outputs against the wallet's keys and scripts, which only needs the keystore
+ * lock. Push() queues a block and Next() hands the blocks back in that order,
+ * so the caller only has to look at the inputs of each transaction.
+ */
+class CRescanPipeline
+{
+private:
+    const CWallet& wallet;
+
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condNext;
+    std::deque<CRescanBlockRef> queueToRead;
+    std::map<uint64_t, CRescanBlockRef> mapMatched;
+    uint64_t nPushed;
+    uint64_t nNext;
+
+    boost::thread_group threads;
+
+    void ThreadMatch()
+    {
+        RenameThread("dogecoin-rescan");
+        while (true) {
+            CRescanBlockRef prescan;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueToRead.empty())
+                    condWorker.wait(lock);
+                prescan = queueToRead.front();
+                queueToRead.pop_front();
+            }
+
+            prescan->fRead = ReadBlockFromDisk(prescan->block, prescan->pindex);
+            if (prescan->fRead) {
+                prescan->vfMine.reserve(prescan->block.vtx.size());
+                BOOST_FOREACH(const CTransaction& tx, prescan->block.vtx)
+                    prescan->vfMine.push_back(wallet.IsMine(tx));
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapMatched.insert(std::make_pair(prescan->nSequence, prescan));
+            if (prescan->nSequence == nNext)
+                condNext.notify_all();
+        }
+    }
+
+public:
+    CRescanPipeline(const CWallet& walletIn) : wallet(walletIn), nPushed(0), nNext(0)
+    {
+        int nWorkers = std::max(1, (int)boost::thread::hardware_concurrency());
+        try {
+            for (int i = 0; i < nWorkers; i++)
+                threads.create_thread(boost::bind(&CRescanPipeline::ThreadMatch, this));
+        } catch (...) {
+            // The destructor does not run for a half-built pipeline
+            threads.interrupt_all();
+            threads.join_all();
+            throw;
+        }
+    }
+
+    ~CRescanPipeline()
+    {
+        threads.interrupt_all();
+        threads.join_all();
+    }
+
+    /** Number of blocks pushed and not yet taken back with Next(). */
+    size_t GetPendingCount()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nPushed - nNext;
+    }
+
+    void Push(CBlockIndex* pindex)
+    {
+        CRescanBlockRef prescan(new CRescanBlock());
+        prescan->pindex = pindex;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        prescan->nSequence = nPushed++;
+        queueToRead.push_back(prescan);
+        condWorker.notify_one();
+    }
+
+    /** Wait for the next block, in the order pushed. Returns NULL if none is pending. */
+    CRescanBlockRef Next()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nNext == nPushed)
+            return CRescanBlockRef();
+        std::map<uint64_t, CRescanBlockRef>::iterator it;
+        while ((it = mapMatched.find(nNext)) == mapMatched.end())
+            condNext.wait(lock);
+        CRescanBlockRef prescan = it->second;
+        mapMatched.erase(it);
+        nNext++;
+        return prescan;
+    }
+};
+
+/** Clears the scanning flag of a wallet when a rescan ends, also when it ends in an exception. */
+class CScanningFlagReset
+{
+private:
+    CCriticalSection& cs;
+    bool& fScanning;
+
+public:
+    CScanningFlagReset(CCriticalSection& csIn, bool& fScanningIn) : cs(csIn), fScanning(fScanningIn) {}
+
+    ~CScanningFlagReset()
+    {
+        LOCK(cs);
+        fScanning = false;
+    }
+};
+
+} // anon namespace
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
  */
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, CBlockIndex* pindexStop)
 {
     int ret = 0;
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
 
+    {
+        LOCK(cs_scan);
+        if (fScanningWallet)
+            return -1;
+        fScanningWallet = true;
+        fAbortRescan = false;
+        nScanStartTime = GetTimeMillis();
+        dScanProgress = 0;
+    }
+    CScanningFlagReset scanning(cs_scan, fScanningWallet);
+
     CBlockIndex* pindex = pindexStart;
+    int nStopHeight = pindexStop ? pindexStop->nHeight : std::numeric_limits<int>::max();
+    double dProgressStart, dProgressTip;
     {
         LOCK2(cs_main, cs_wallet);
 
         // no need to read and scan block, if block was created before
         // our wallet birthday (as adjusted for block time variability)
-        while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
+        while (pindex && pindex->nHeight < nStopHeight && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
-        while (pindex)
-        {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+        dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindexStop ? pindexStop : chainActive.Tip(), false);
+    }
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
-            {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+    CRescanPipeline pipeline(*this);
+    CBlockIndex* pindexLastPushed = NULL;
+    while (true)
+    {
+        {
+            // Find the next block under cs_main on every pass: blocks connected
+            // while the pipeline drains may spend outputs it has yet to add,
+            // and SyncTransaction drops those spends, so they are scanned here.
+            LOCK(cs_main);
+            while (pipeline.GetPendingCount() < RESCAN_READ_AHEAD) {
+                CBlockIndex* pindexNext = pindex;
+                if (pindexLastPushed) {
+                    // Blocks connected after a reorganization reach the wallet
+                    // through SyncTransaction, so continue above the fork.
+                    pindexNext = chainActive.Next(chainActive.Contains(pindexLastPushed) ? pindexLastPushed : chainActive.FindFork(pindexLastPushed));
+                }
+                if (!pindexNext || pindexNext->nHeight > nStopHeight)
+                    break;
+                pipeline.Push(pindexNext);
+                pindexLastPushed = pindexNext;
             }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
+        }
+
+        // Only stops once the chain had no further block when the queue was last filled
+        CRescanBlockRef prescan = pipeline.Next();
+        if (!prescan)
+            break;
+        if (IsAbortingRescan()) {
+            LogPrintf("Rescan aborted at block %d\n", prescan->pindex->nHeight);
+            break;
+        }
+        if (!prescan->fRead)
+            continue;
+
+        const CBlock& block = prescan->block;
+        double dProgress = 0;
+        {
+            LOCK2(cs_main, cs_wallet);
+
+            // A block that was disconnected meanwhile has been reported to the wallet already
+            if (chainActive.Contains(prescan->pindex)) {
+                for (unsigned int i = 0; i < block.vtx.size(); i++) {
+                    const CTransaction& tx = block.vtx[i];
+                    // The workers matched the outputs; a transaction can also
+                    // involve us by spending one of our earlier transactions.
+                    bool fCandidate = prescan->vfMine[i] || mapWallet.count(tx.GetHash());
+                    for (unsigned int j = 0; !fCandidate && j < tx.vin.size(); j++)
+                        fCandidate = mapWallet.count(tx.vin[j].prevout.hash) != 0;
+                    if (fCandidate && AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                        ret++;
+                }
             }
+            if (dProgressTip - dProgressStart > 0.0)
+                dProgress = (Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), prescan->pindex, false) - dProgressStart) / (dProgressTip - dProgressStart);
+        }
+        dProgress = std::max(0.0, std::min(1.0, dProgress));
+        {
+            LOCK(cs_scan);
+            dScanProgress = dProgress;
+        }
+
+        if (prescan->pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+            ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)(dProgress * 100))));
+        if (GetTime() >= nNow + 60) {
+            nNow = GetTime();
+            LogPrintf("Still rescanning. At block %d. Progress=%f\n", prescan->pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), prescan->pindex));
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     return ret;
 }
 
@@ -1137,7 +1631,9 @@ bool CWalletTx::RelayWalletTransaction()
     {
         if (GetDepthInMainChain() == 0) {
             LogPrintf("Relaying wtx %s\n", GetHash().ToString());
-            RelayTransaction((CTransaction)*this);
+            // Share the mempool's copy when the transaction is in the pool
+            CTransactionRef ptx = mempool.get(GetHash());
+            RelayTransaction(ptx ? ptx : MakeTransactionRef(*this));
             return true;
         }
     }
@@ -1401,94 +1897,96 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime)
  */
 
 
-CAmount CWallet::GetBalance() const
+/**
+ * Only transactions with an output in setUnspentOutputs can have available
+ * or immature credit, so those are the only ones visited. The result is
+ * kept until the tip, the mempool or the wallet's transactions change, or
+ * until a transaction that is only time-locked becomes final.
+ */
+const CWallet::CBalances& CWallet::GetBalances() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (fBalancesCached && pindexBalances == chainActive.Tip() &&
+        nBalancesMempoolUpdated == mempool.GetTransactionsUpdated() &&
+        GetAdjustedTime() < nBalancesFinalTime)
+        return cachedBalances;
+
+    CBalances balances;
+    int64_t nFinalTime = std::numeric_limits<int64_t>::max();
+    const std::set<COutPoint>& setUnspent = GetUnspentOutputs();
+    std::set<COutPoint>::const_iterator it = setUnspent.begin();
+    while (it != setUnspent.end())
+    {
+        const uint256 hash = it->hash;
+        // Skip over the rest of this transaction's outputs
+        it = setUnspent.upper_bound(COutPoint(hash, std::numeric_limits<uint32_t>::max()));
+
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx* pcoin = &mi->second;
+        bool fTrusted = pcoin->IsTrusted();
+        if (fTrusted)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            balances.nTrusted += pcoin->GetAvailableCredit();
+            balances.nWatchTrusted += pcoin->GetAvailableWatchOnlyCredit();
+        }
+        bool fFinal = CheckFinalTx(*pcoin);
+        if (!fFinal || (!fTrusted && pcoin->GetDepthInMainChain() == 0))
+        {
+            balances.nUntrustedPending += pcoin->GetAvailableCredit();
+            balances.nWatchUntrustedPending += pcoin->GetAvailableWatchOnlyCredit();
         }
+        // A time lock expires with the clock rather than with a new block
+        if (!fFinal && pcoin->nLockTime >= LOCKTIME_THRESHOLD)
+            nFinalTime = std::min(nFinalTime, (int64_t)pcoin->nLockTime + 1);
+        balances.nImmature += pcoin->GetImmatureCredit();
+        balances.nWatchImmature += pcoin->GetImmatureWatchOnlyCredit();
     }
 
-    return nTotal;
+    cachedBalances = balances;
+    pindexBalances = chainActive.Tip();
+    nBalancesMempoolUpdated = mempool.GetTransactionsUpdated();
+    nBalancesFinalTime = nFinalTime;
+    fBalancesCached = true;
+    return cachedBalances;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!CheckFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUntrustedPending;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!CheckFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchUntrustedPending;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchImmature;
 }
 
 /**
@@ -1500,9 +1998,16 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const std::set<COutPoint>& setUnspent = GetUnspentOutputs();
+        std::set<COutPoint>::const_iterator itUnspent = setUnspent.begin();
+        while (itUnspent != setUnspent.end())
         {
-            const uint256& wtxid = it->first;
+            const uint256 wtxid = itUnspent->hash;
+            itUnspent = setUnspent.upper_bound(COutPoint(wtxid, std::numeric_limits<uint32_t>::max()));
+
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(wtxid);
+            if (it == mapWallet.end())
+                continue;
             const CWalletTx* pcoin = &(*it).second;
 
             if (!CheckFinalTx(*pcoin))
@@ -1529,7 +2034,78 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
     }
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+/**
+ * Depth-first search for a subset of vValue (sorted by decreasing value)
+ * worth between nTargetValue and nTargetValue + nTolerance, preferring the
+ * one that wastes least. Branches that cannot reach the target with what is
+ * left, or already overshoot it, are cut, and an exclusion followed by an
+ * equal value is not retried. Gives up after nMaxTries steps, so the result
+ * depends only on the input.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTargetValue, const CAmount& nTolerance,
+                           vector<char>& vfBest, CAmount& nBest, unsigned int nMaxTries)
+{
+    const size_t nCoins = vValue.size();
+    CAmount nAvailable = 0;
+    for (size_t i = 0; i < nCoins; i++)
+        nAvailable += vValue[i].first;
+    if (nAvailable < nTargetValue)
+        return false;
+
+    vector<char> vfIncluded(nCoins, false);
+    CAmount nTotal = 0;
+    size_t nDepth = 0; // coins before nDepth are decided, nAvailable is what remains after them
+    bool fFound = false;
+
+    for (unsigned int nTries = 0; nTries < nMaxTries; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nTotal + nAvailable < nTargetValue || nTotal > nTargetValue + nTolerance)
+            fBacktrack = true;
+        else if (nTotal >= nTargetValue)
+        {
+            if (!fFound || nTotal < nBest)
+            {
+                fFound = true;
+                nBest = nTotal;
+                vfBest = vfIncluded;
+                if (nBest == nTargetValue)
+                    break;
+            }
+            fBacktrack = true;
+        }
+        else if (nDepth == nCoins)
+            fBacktrack = true;
+
+        if (fBacktrack)
+        {
+            // Undo trailing exclusions, then exclude the last included coin
+            while (nDepth > 0 && !vfIncluded[nDepth - 1])
+                nAvailable += vValue[--nDepth].first;
+            if (nDepth == 0)
+                break; // search exhausted
+            vfIncluded[nDepth - 1] = false;
+            nTotal -= vValue[nDepth - 1].first;
+            continue;
+        }
+
+        const CAmount nValue = vValue[nDepth].first;
+        nAvailable -= nValue;
+        if (nDepth > 0 && !vfIncluded[nDepth - 1] && vValue[nDepth - 1].first == nValue)
+        {
+            // Including this one would repeat the branch just explored
+            nDepth++;
+            continue;
+        }
+        vfIncluded[nDepth++] = true;
+        nTotal += nValue;
+    }
+    if (fFound)
+        vfBest.resize(nCoins, false);
+    return fFound;
+}
+
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
                                   vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1575,21 +2151,15 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
-                                 set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
+                                 set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CAmount& nChangeTolerance) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
-    // List of values less than target
-    pair<CAmount, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
-    coinLowestLarger.first = std::numeric_limits<CAmount>::max();
-    coinLowestLarger.second.first = NULL;
-    vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
-    CAmount nTotalLower = 0;
-
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
+    // Eligible coins, in random order
+    vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vEligible;
+    vEligible.reserve(vCoins.size());
     BOOST_FOREACH(const COutput &output, vCoins)
     {
         if (!output.fSpendable)
@@ -1600,10 +2170,21 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
             continue;
 
-        int i = output.i;
-        CAmount n = pcoin->vout[i].nValue;
+        vEligible.push_back(make_pair(pcoin->vout[output.i].nValue, make_pair(pcoin, (unsigned int)output.i)));
+    }
+    random_shuffle(vEligible.begin(), vEligible.end(), GetRandInt);
+
+    // List of values less than target
+    pair<CAmount, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
+    coinLowestLarger.first = std::numeric_limits<CAmount>::max();
+    coinLowestLarger.second.first = NULL;
+    vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
+    CAmount nTotalLower = 0;
 
-        pair<CAmount,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
+    for (unsigned int j = 0; j < vEligible.size(); j++)
+    {
+        const pair<CAmount,pair<const CWalletTx*,unsigned int> >& coin = vEligible[j];
+        CAmount n = coin.first;
 
         if (n == nTargetValue)
         {
@@ -1641,11 +2222,40 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
+    // The candidates are sorted here rather than kept in a standing index by
+    // value: which coins qualify depends on the confirmation targets of this
+    // call, the tip, coin control and locked coins, and only those below the
+    // target plus a cent are left. Sorting them costs less than the
+    // AvailableCoins pass that produced them.
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     CAmount nBest;
 
+    // Look for a subset that needs no change first
+    if (SelectCoinsBnB(vValue, nTargetValue, nChangeTolerance, vfBest, nBest, COIN_SELECTION_BNB_MAX_TRIES))
+    {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+        LogPrint("selectcoins", "SelectCoins() exact subset of %u coins: total %s\n", setCoinsRet.size(), FormatMoney(nBest));
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation. Each iteration passes
+    // over all candidates, so on large wallets only the largest take part,
+    // as many as still cover the target with a cent to spare.
+    if (vValue.size() > COIN_SELECTION_MAX_APPROXIMATE_COINS)
+    {
+        unsigned int nKeep = 0;
+        nTotalLower = 0;
+        while (nKeep < vValue.size() && (nKeep < COIN_SELECTION_MAX_APPROXIMATE_COINS || nTotalLower < nTargetValue + CENT))
+            nTotalLower += vValue[nKeep++].first;
+        vValue.resize(nKeep);
+    }
+
     ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
         ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
@@ -1676,15 +2286,12 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     return true;
 }
 
-bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
+bool CWallet::SelectCoins(const vector<COutput>& vAvailableCoins, const CAmount& nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
-
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
     {
-        BOOST_FOREACH(const COutput& out, vCoins)
+        BOOST_FOREACH(const COutput& out, vAvailableCoins)
         {
             if(!out.fSpendable)
                 continue;
@@ -1694,9 +2301,9 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)));
+    return (SelectCoinsMinConf(nTargetValue, 1, 6, vAvailableCoins, setCoinsRet, nValueRet) ||
+            SelectCoinsMinConf(nTargetValue, 1, 1, vAvailableCoins, setCoinsRet, nValueRet) ||
+            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vAvailableCoins, setCoinsRet, nValueRet)));
 }
 
 bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend,
@@ -1751,6 +2358,10 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend,
     {
         LOCK2(cs_main, cs_wallet);
         {
+            // The coins to choose from do not change between fee iterations
+            vector<COutput> vAvailableCoins;
+            AvailableCoins(vAvailableCoins, true, coinControl);
+
             nFeeRet = 0;
             while (true)
             {
@@ -1799,7 +2410,7 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend,
                 // Choose coins to use
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 CAmount nValueIn = 0;
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl))
+                if (!SelectCoins(vAvailableCoins, nTotalValue, setCoins, nValueIn, coinControl))
                 {
                     strFailReason = _("Insufficient funds");
                     return false;
@@ -1902,13 +2513,15 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend,
                                               std::numeric_limits<unsigned int>::max()-1));
 
                 // Sign
-                int nIn = 0;
+                std::vector<const CScript*> vpFromPubKeys;
+                vpFromPubKeys.reserve(setCoins.size());
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, txNew, nIn++))
-                    {
-                        strFailReason = _("Signing transaction failed");
-                        return false;
-                    }
+                    vpFromPubKeys.push_back(&coin.first->vout[coin.second].scriptPubKey);
+                if (!SignSignatures(*this, vpFromPubKeys, txNew))
+                {
+                    strFailReason = _("Signing transaction failed");
+                    return false;
+                }
 
                 // Embed the constructed transaction data in wtxNew.
                 *static_cast<CTransaction*>(&wtxNew) = CTransaction(txNew);
@@ -2152,6 +2765,53 @@ bool CWallet::SetDefaultKey(const CPubKey &vchPubKey)
     return true;
 }
 
+/**
+ * Route the keys generated from here on into one database transaction on
+ * walletdb, until CommitKeyBatch. Returns false if they are written one by one.
+ */
+bool CWallet::BeginKeyBatch(CWalletDB& walletdb)
+{
+    AssertLockHeld(cs_wallet);
+    if (!fFileBacked || pwalletdbKeyBatch || !walletdb.TxnBegin())
+        return false;
+    pwalletdbKeyBatch = &walletdb;
+    vKeyBatchAdded.clear();
+    return true;
+}
+
+/**
+ * Commit or roll back the transaction of BeginKeyBatch. If the keys do not
+ * reach the file, they are removed from memory too, so the wallet does not
+ * hold keys that its file does not.
+ */
+bool CWallet::CommitKeyBatch(CWalletDB& walletdb, bool fCommit)
+{
+    AssertLockHeld(cs_wallet);
+    assert(pwalletdbKeyBatch == &walletdb);
+    pwalletdbKeyBatch = NULL;
+    std::vector<CPubKey> vAdded;
+    vAdded.swap(vKeyBatchAdded);
+    // A single log sync covers every key of the batch
+    if (fCommit && walletdb.TxnCommit(true))
+        return true;
+
+    // A failed commit leaves nothing of the transaction behind either
+    bool ret = !fCommit && walletdb.TxnAbort();
+    BOOST_FOREACH(const CPubKey& pubkey, vAdded)
+    {
+        std::vector<CScript> vScripts;
+        GetScriptsForKey(pubkey, vScripts);
+        {
+            LOCK(cs_KeyStore);
+            BOOST_FOREACH(const CScript& script, vScripts)
+                mapScriptPubKeys.erase(script);
+        }
+        mapKeyMetadata.erase(pubkey.GetID());
+        RemoveKey(pubkey.GetID());
+    }
+    return ret;
+}
+
 /**
  * Mark old keypool keys as used,
  * and generate all new keys 
@@ -2161,19 +2821,43 @@ bool CWallet::NewKeyPool()
     {
         LOCK(cs_wallet);
         CWalletDB walletdb(strWalletFile);
+        bool fBatch = BeginKeyBatch(walletdb);
         BOOST_FOREACH(int64_t nIndex, setKeyPool)
             walletdb.ErasePool(nIndex);
-        setKeyPool.clear();
+        // Kept until the batch commits, as rolling it back restores the old pool
+        std::set<int64_t> setOldKeyPool;
+        setOldKeyPool.swap(setKeyPool);
 
         if (IsLocked())
+        {
+            if (fBatch && !CommitKeyBatch(walletdb, true))
+            {
+                setKeyPool.swap(setOldKeyPool);
+                throw runtime_error("NewKeyPool(): committing key pool failed");
+            }
             return false;
+        }
 
         int64_t nKeys = max(GetArg("-keypool", 100), (int64_t)0);
-        for (int i = 0; i < nKeys; i++)
+        try {
+            for (int i = 0; i < nKeys; i++)
+            {
+                int64_t nIndex = i+1;
+                walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
+                setKeyPool.insert(nIndex);
+            }
+        } catch (...) {
+            if (fBatch)
+            {
+                CommitKeyBatch(walletdb, false);
+                setKeyPool.swap(setOldKeyPool);
+            }
+            throw;
+        }
+        if (fBatch && !CommitKeyBatch(walletdb, true))
         {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
+            setKeyPool.swap(setOldKeyPool);
+            throw runtime_error("NewKeyPool(): committing key pool failed");
         }
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
@@ -2197,16 +2881,38 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         else
             nTargetSize = max(GetArg("-keypool", 100), (int64_t) 0);
 
-        while (setKeyPool.size() < (nTargetSize + 1))
-        {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool(): writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+        if (setKeyPool.size() >= (nTargetSize + 1))
+            return true;
+
+        // The new keys and their pool entries are written in one database
+        // transaction; if it fails, none of them enter the pool or stay in
+        // the key store.
+        std::vector<int64_t> vAdded;
+        bool fBatch = BeginKeyBatch(walletdb);
+        try {
+            while (setKeyPool.size() < (nTargetSize + 1))
+            {
+                int64_t nEnd = 1;
+                if (!setKeyPool.empty())
+                    nEnd = *(--setKeyPool.end()) + 1;
+                if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+                    throw runtime_error("TopUpKeyPool(): writing generated key failed");
+                setKeyPool.insert(nEnd);
+                vAdded.push_back(nEnd);
+            }
+            if (fBatch && !CommitKeyBatch(walletdb, true))
+            {
+                fBatch = false;
+                throw runtime_error("TopUpKeyPool(): committing generated keys failed");
+            }
+        } catch (...) {
+            if (fBatch)
+                CommitKeyBatch(walletdb, false);
+            BOOST_FOREACH(int64_t nIndex, vAdded)
+                setKeyPool.erase(nIndex);
+            throw;
         }
+        LogPrintf("keypool added %u keys, size=%u\n", vAdded.size(), setKeyPool.size());
     }
     return true;
 }
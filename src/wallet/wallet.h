@@ -15,6 +15,7 @@
 #include "tinyformat.h"
 #include "ui_interface.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 #include "validationinterface.h"
 #include "wallet/crypter.h"
 #include "wallet/wallet_ismine.h"
@@ -29,6 +30,9 @@
 #include <utility>
 #include <vector>
 
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
+
 /**
  * Settings
  */
@@ -51,6 +55,10 @@ static const unsigned int DEFAULT_TX_CONFIRM_TARGET = 2;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 0;
+//! Branches the exact-match coin search may visit before giving up
+static const unsigned int COIN_SELECTION_BNB_MAX_TRIES = 100000;
+//! Candidates beyond which the stochastic coin selection only uses the largest ones
+static const unsigned int COIN_SELECTION_MAX_APPROXIMATE_COINS = 5000;
 
 class CAccountingEntry;
 class CBlockIndex;
@@ -387,10 +395,20 @@ public:
 class CWallet : public CCryptoKeyStore, public CValidationInterface
 {
 private:
-    bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
+    bool SelectCoins(const std::vector<COutput>& vAvailableCoins, const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
 
     CWalletDB *pwalletdbEncryption;
 
+    /**
+     * Set while the key pool is being written in one database transaction,
+     * so that the keys generated for it go into the same transaction.
+     */
+    CWalletDB *pwalletdbKeyBatch;
+    //! keys generated during the batch, forgotten again if it is rolled back
+    std::vector<CPubKey> vKeyBatchAdded;
+    bool BeginKeyBatch(CWalletDB& walletdb);
+    bool CommitKeyBatch(CWalletDB& walletdb, bool fCommit);
+
     //! the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -413,6 +431,79 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * The output scripts our keys, redeem scripts and watch-only scripts
+     * make ours, with what IsMine() returns for them, so that most outputs
+     * are matched with one lookup. Protected by cs_KeyStore, since IsMine()
+     * is called without cs_wallet.
+     */
+    typedef boost::unordered_map<CScript, isminetype, CScriptHasher> ScriptPubKeyMap;
+    ScriptPubKeyMap mapScriptPubKeys;
+    void AddScriptPubKey(const CScript& scriptPubKey, isminetype mine);
+    void AddScriptPubKeysForKey(const CPubKey& pubkey);
+    void AddScriptPubKeysForRedeemScript(const CScript& redeemScript);
+
+    /**
+     * Outputs of ours that no wallet transaction in a block of the active
+     * chain spends. Kept up to date as transactions are added and blocks are
+     * connected or disconnected, it holds every unspent output of the wallet
+     * (plus those only spent by unconfirmed transactions), so that balances
+     * and coin selection visit the transactions it names rather than all of
+     * mapWallet. Rebuilt from mapWallet on first use after MarkDirty().
+     */
+    mutable std::set<COutPoint> setUnspentOutputs;
+    mutable bool fUnspentOutputsDirty;
+    bool IsSpentInChain(const COutPoint& outpoint) const;
+    void UpdateUnspentOutputs(const CWalletTx& wtx);
+    const std::set<COutPoint>& GetUnspentOutputs() const;
+
+    //! The wallet's balances by confirmation state
+    struct CBalances
+    {
+        CAmount nTrusted;
+        CAmount nUntrustedPending;
+        CAmount nImmature;
+        CAmount nWatchTrusted;
+        CAmount nWatchUntrustedPending;
+        CAmount nWatchImmature;
+
+        CBalances() : nTrusted(0), nUntrustedPending(0), nImmature(0), nWatchTrusted(0), nWatchUntrustedPending(0), nWatchImmature(0) {}
+    };
+    /**
+     * Balances as of the tip and mempool state they were computed for, until
+     * the adjusted time reaches nBalancesFinalTime, when a time-locked
+     * transaction becomes final; any change to the wallet's transactions
+     * clears fBalancesCached.
+     */
+    mutable CBalances cachedBalances;
+    mutable bool fBalancesCached;
+    mutable const CBlockIndex* pindexBalances;
+    mutable unsigned int nBalancesMempoolUpdated;
+    mutable int64_t nBalancesFinalTime;
+    const CBalances& GetBalances() const;
+
+    /**
+     * Transactions by the block they were last seen in, and the transactions
+     * that were not in a block of the active chain when last added, so that
+     * listsinceblock visits the blocks after the one it is given rather than
+     * all of mapWallet. Both may hold stale entries (a transaction moved to
+     * another block, or erased); users check the depth themselves.
+     * setUnconfirmedTx is rebuilt from mapWallet on first use after loading.
+     */
+    std::multimap<uint256, uint256> mapTxByBlock;
+    mutable std::set<uint256> setUnconfirmedTx;
+    mutable bool fUnconfirmedTxDirty;
+    void IndexTransactionBlock(const CWalletTx& wtx);
+    //! Remove wtx from wtxOrdered, where it is found under its nOrderPos
+    void EraseOrderedTx(const CWalletTx& wtx);
+
+    //! state of a running ScanForWalletTransactions, protected by cs_scan
+    mutable CCriticalSection cs_scan;
+    bool fScanningWallet;
+    bool fAbortRescan;
+    int64_t nScanStartTime;
+    double dScanProgress;
+
 public:
     /*
      * Main wallet lock.
@@ -459,11 +550,22 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbKeyBatch = NULL;
         nOrderPosNext = 0;
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
+        fScanningWallet = false;
+        fAbortRescan = false;
+        nScanStartTime = 0;
+        dScanProgress = 0;
+        fUnspentOutputsDirty = true;
+        fBalancesCached = false;
+        pindexBalances = NULL;
+        nBalancesMempoolUpdated = 0;
+        nBalancesFinalTime = 0;
+        fUnconfirmedTxDirty = true;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -485,7 +587,13 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL, bool fIncludeZeroValue=false) const;
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    /**
+     * Select coins with at least nConfMine (our own) or nConfTheirs
+     * confirmations worth at least nTargetValue. A selection worth no more
+     * than nTargetValue + nChangeTolerance, which needs no change output, is
+     * preferred if one can be found.
+     */
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CAmount& nChangeTolerance = 0) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -503,7 +611,7 @@ public:
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    bool LoadKey(const CKey& key, const CPubKey &pubkey);
     //! Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
 
@@ -553,12 +661,52 @@ public:
      */
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
 
+    /**
+     * Visit the wallet's transactions and the accounting entries of
+     * strAccount ("*" for all) by order, newest first, until fn returns
+     * false. fn must not add or remove transactions.
+     * @warning The pointers passed to fn are *only* valid within the scope of passed acentries
+     */
+    void WalkOrderedTxItems(std::list<CAccountingEntry>& acentries, const std::string& strAccount,
+                            const boost::function<bool (const TxItems::value_type&)>& fn);
+
+    /**
+     * mapWallet by nOrderPos, kept up to date as transactions are added, so
+     * that the newest transactions can be listed without sorting them all.
+     * Holds no accounting entries; merge those in from the database.
+     */
+    TxItems wtxOrdered;
+
+    /**
+     * Get the transactions that may have been confirmed in a block of the
+     * active chain above nHeight, or are not confirmed at all, by txid.
+     * Callers still need to check the depth of each.
+     */
+    void GetTransactionsAfterHeight(int nHeight, std::vector<const CWalletTx*>& vwtx) const;
+
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
-    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    /**
+     * Add the transactions of the active chain from pindexStart on (up to
+     * pindexStop, if given) that involve the wallet. Blocks are read and
+     * matched against the wallet's keys on worker threads; cs_main and
+     * cs_wallet are only held while a block's matches are added, so callers
+     * should not hold them. Returns the number of transactions added or
+     * updated, or -1 if another rescan is running.
+     */
+    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false, CBlockIndex* pindexStop = NULL);
+    /** Ask a running rescan to stop after the block it is on. */
+    void AbortRescan() { LOCK(cs_scan); fAbortRescan = true; }
+    /** Whether the last rescan was (or the running one is being) aborted. */
+    bool IsAbortingRescan() const { LOCK(cs_scan); return fAbortRescan; }
+    bool IsScanning() const { LOCK(cs_scan); return fScanningWallet; }
+    /** Milliseconds the running rescan has taken so far. */
+    int64_t ScanningDuration() const { LOCK(cs_scan); return fScanningWallet ? GetTimeMillis() - nScanStartTime : 0; }
+    /** Fraction of the running rescan done, from 0 to 1. */
+    double ScanningProgress() const { LOCK(cs_scan); return fScanningWallet ? dScanProgress : 0; }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime);
     std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime);
@@ -591,6 +739,7 @@ public:
 
     isminetype IsMine(const CTxIn& txin) const;
     CAmount GetDebit(const CTxIn& txin, const isminefilter& filter) const;
+    isminetype IsMine(const CScript& scriptPubKey) const;
     isminetype IsMine(const CTxOut& txout) const;
     CAmount GetCredit(const CTxOut& txout, const isminefilter& filter) const;
     bool IsChange(const CTxOut& txout) const;
@@ -5,11 +5,15 @@
 
 #include "wallet_ismine.h"
 
+#include "hash.h"
 #include "key.h"
 #include "keystore.h"
+#include "random.h"
 #include "script/script.h"
 #include "script/standard.h"
 
+#include <limits>
+
 #include <boost/foreach.hpp>
 
 using namespace std;
@@ -89,3 +93,30 @@ isminetype IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
         return ISMINE_WATCH_ONLY;
     return ISMINE_NO;
 }
+
+void GetScriptsForKey(const CPubKey& pubkey, vector<CScript>& vScripts)
+{
+    vScripts.push_back(GetScriptForDestination(pubkey.GetID()));
+    vScripts.push_back(CScript() << ToByteVector(pubkey) << OP_CHECKSIG);
+}
+
+bool IsKeyScript(const CScript& scriptPubKey)
+{
+    // OP_DUP OP_HASH160 <20 bytes> OP_EQUALVERIFY OP_CHECKSIG
+    if (scriptPubKey.size() == 25)
+        return scriptPubKey[0] == OP_DUP && scriptPubKey[1] == OP_HASH160 && scriptPubKey[2] == 20 &&
+               scriptPubKey[23] == OP_EQUALVERIFY && scriptPubKey[24] == OP_CHECKSIG;
+    // <33 to 65 bytes> OP_CHECKSIG, which Solver() takes for a public key
+    return scriptPubKey.size() >= 35 && scriptPubKey.size() <= 67 &&
+           scriptPubKey[0] == scriptPubKey.size() - 2 && scriptPubKey.back() == OP_CHECKSIG;
+}
+
+CScriptHasher::CScriptHasher() :
+    k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+}
+
+size_t CScriptHasher::operator()(const CScript& script) const
+{
+    return CSipHasher(k0, k1).Write(script.data(), script.size()).Finalize();
+}
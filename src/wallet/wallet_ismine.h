@@ -9,6 +9,8 @@
 #include "key.h"
 #include "script/standard.h"
 
+#include <vector>
+
 class CKeyStore;
 class CScript;
 
@@ -26,4 +28,25 @@ typedef uint8_t isminefilter;
 isminetype IsMine(const CKeyStore& keystore, const CScript& scriptPubKey);
 isminetype IsMine(const CKeyStore& keystore, const CTxDestination& dest);
 
+/** The output scripts that pay to a key: pay-to-pubkey-hash and pay-to-pubkey. */
+void GetScriptsForKey(const CPubKey& pubkey, std::vector<CScript>& vScripts);
+/**
+ * Whether scriptPubKey has one of the forms GetScriptsForKey() produces
+ * (with minimal pushes), so that whether it is ours only depends on whether
+ * it is one of the scripts of our keys.
+ */
+bool IsKeyScript(const CScript& scriptPubKey);
+
+/** Salted hash of a script, for hash tables keyed by scripts. */
+class CScriptHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    CScriptHasher();
+
+    size_t operator()(const CScript& script) const;
+};
+
 #endif // BITCOIN_WALLET_WALLET_ISMINE_H
@@ -8,6 +8,7 @@
 #include "base58.h"
 #include "consensus/validation.h"
 #include "main.h"
+#include "parallel.h"
 #include "protocol.h"
 #include "serialize.h"
 #include "sync.h"
@@ -15,6 +16,7 @@
 #include "utiltime.h"
 #include "wallet/wallet.h"
 
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
@@ -24,6 +26,12 @@ using namespace std;
 
 static uint64_t nAccountingEntryNumber = 0;
 
+//! Most threads deserializing transactions on load
+static const unsigned int MAX_WALLET_LOAD_THREADS = 8;
+
+unsigned int nWalletLoadTxBatch = DEFAULT_WALLET_LOAD_TX_BATCH;
+unsigned int nWalletLoadThreads = 0;
+
 //
 // CWalletDB
 //
@@ -322,6 +330,14 @@ DBErrors CWalletDB::ReorderTransactions(CWallet* pwallet)
     }
     WriteOrderPosNext(nOrderPosNext);
 
+    // The positions were assigned above; re-key the wallet's index by them
+    pwallet->wtxOrdered.clear();
+    for (map<uint256, CWalletTx>::iterator it = pwallet->mapWallet.begin(); it != pwallet->mapWallet.end(); ++it)
+    {
+        CWalletTx* wtx = &((*it).second);
+        pwallet->wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+    }
+
     return DB_LOAD_OK;
 }
 
@@ -343,6 +359,42 @@ public:
     }
 };
 
+/**
+ * Read a "tx" record, whose key has been read up to the hash. Touches no
+ * wallet state, so records can be read on several threads at once.
+ */
+static bool ReadWalletTx(CDataStream& ssKey, CDataStream& ssValue, CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    uint256 hash;
+    ssKey >> hash;
+    ssValue >> wtx;
+    CValidationState state;
+    if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    // Undo serialize changes in 31600
+    fUpgraded = false;
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, string& strType, string& strErr)
@@ -366,33 +418,12 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "tx")
         {
-            uint256 hash;
-            ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgraded;
+            if (!ReadWalletTx(ssKey, ssValue, wtx, fUpgraded, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
+            if (fUpgraded)
+                wss.vWalletUpgrade.push_back(wtx.GetHash());
 
             if (wtx.nOrderPos == -1)
                 wss.fAnyUnordered = true;
@@ -604,6 +635,79 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+namespace {
+
+/** A "tx" record read from the database, and the transaction it holds. */
+struct CWalletTxRecord
+{
+    CDataStream ssKey;
+    CDataStream ssValue;
+    CWalletTx wtx;
+    bool fRead;
+    bool fOK;
+    bool fUpgraded;
+    string strErr;
+
+    CWalletTxRecord(const CDataStream& ssKeyIn, const CDataStream& ssValueIn) :
+        ssKey(ssKeyIn), ssValue(ssValueIn), fRead(false), fOK(false), fUpgraded(false) {}
+};
+
+void ReadWalletTxRecords(std::vector<CWalletTxRecord>* pvRecords, size_t nStart, size_t nStep)
+{
+    for (size_t i = nStart; i < pvRecords->size(); i += nStep)
+    {
+        CWalletTxRecord& record = (*pvRecords)[i];
+        if (record.fRead)
+            continue;
+        record.fRead = true;
+        try {
+            string strType;
+            record.ssKey >> strType;
+            record.fOK = ReadWalletTx(record.ssKey, record.ssValue, record.wtx, record.fUpgraded, record.strErr);
+        } catch (...) {
+            record.fOK = false;
+        }
+    }
+}
+
+/**
+ * Deserialize and check a batch of transactions on all cores, then add
+ * them to the wallet in the order they were read. If the threads cannot
+ * all be started, the records they did not get to are read here.
+ */
+void LoadWalletTxRecords(CWallet* pwallet, std::vector<CWalletTxRecord>& vRecords, CWalletScanState& wss, bool& fNoncriticalErrors)
+{
+    size_t nThreads = nWalletLoadThreads;
+    if (nThreads == 0)
+        nThreads = std::min((size_t)std::max(boost::thread::hardware_concurrency(), 1U), (size_t)MAX_WALLET_LOAD_THREADS);
+    if (nThreads <= 1 || vRecords.size() < nThreads ||
+        !RunOnThreads(nThreads, boost::bind(&ReadWalletTxRecords, &vRecords, _1, _2)))
+        ReadWalletTxRecords(&vRecords, 0, 1);
+
+    BOOST_FOREACH(CWalletTxRecord& record, vRecords)
+    {
+        if (!record.fOK)
+        {
+            // Rescan if there is a bad transaction record:
+            fNoncriticalErrors = true;
+            SoftSetBoolArg("-rescan", true);
+        }
+        else
+        {
+            if (record.fUpgraded)
+                wss.vWalletUpgrade.push_back(record.wtx.GetHash());
+            if (record.wtx.nOrderPos == -1)
+                wss.fAnyUnordered = true;
+            pwallet->AddToWallet(record.wtx, true, NULL);
+        }
+        if (!record.strErr.empty())
+            LogPrintf("%s\n", record.strErr);
+    }
+    vRecords.clear();
+}
+
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -629,6 +733,10 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
+        int64_t nStart = GetTimeMillis();
+        unsigned int nTxRecords = 0;
+        std::vector<CWalletTxRecord> vTxRecords;
+        vTxRecords.reserve(nWalletLoadTxBatch);
         while (true)
         {
             // Read next record
@@ -643,8 +751,24 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 return DB_CORRUPT;
             }
 
-            // Try to be tolerant of single corrupt records:
+            // Transactions, the bulk of a large wallet, are read in batches
+            // on several threads; everything else is read here in order.
             string strType, strErr;
+            if (ssKey.size() > 3 && ssKey[0] == 2 && ssKey[1] == 't' && ssKey[2] == 'x')
+            {
+                vTxRecords.push_back(CWalletTxRecord(ssKey, ssValue));
+                nTxRecords++;
+                if (vTxRecords.size() >= nWalletLoadTxBatch)
+                    LoadWalletTxRecords(pwallet, vTxRecords, wss, fNoncriticalErrors);
+                continue;
+            }
+            // The records are sorted by type, so this only happens once. Add
+            // the transactions before the accounting entries, which check
+            // fAnyUnordered, as they were added before batching.
+            if (!vTxRecords.empty())
+                LoadWalletTxRecords(pwallet, vTxRecords, wss, fNoncriticalErrors);
+
+            // Try to be tolerant of single corrupt records:
             if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
             {
                 // losing keys is considered a catastrophic error, anything else
@@ -664,6 +788,8 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 LogPrintf("%s\n", strErr);
         }
         pcursor->close();
+        LoadWalletTxRecords(pwallet, vTxRecords, wss, fNoncriticalErrors);
+        LogPrint("db", "Read %u wallet transactions  %dms\n", nTxRecords, GetTimeMillis() - nStart);
     }
     catch (const boost::thread_interrupted&) {
         throw;
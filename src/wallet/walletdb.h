@@ -28,6 +28,14 @@ class CWalletTx;
 class uint160;
 class uint256;
 
+//! Default for nWalletLoadTxBatch
+static const unsigned int DEFAULT_WALLET_LOAD_TX_BATCH = 10000;
+
+//! Transaction records read before they are deserialized together on load
+extern unsigned int nWalletLoadTxBatch;
+//! Threads deserializing them, or 0 for one per core
+extern unsigned int nWalletLoadThreads;
+
 /** Error statuses for the wallet database */
 enum DBErrors
 {